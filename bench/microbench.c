@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "mpi.h"
+#include "hashdict.h"
+#include "tokenize.h"
+#include "chnkcnt.h"
+#include "histogram.h"
+#include "zipf.h"
+
+/*********************************************************************************
+ * Microbenchmarks of the hot paths, on a synthetic Zipf corpus held in memory so
+ * the file system never gets in the way:
+ *   tokenize          tokenize_span alone, with a sink that only counts words
+ *   count_words       count_words_span: tokenizer and dictionary
+ *   dic_add           adding every word of the vocabulary to an empty dictionary
+ *   dic_find          looking up the words of the corpus, in corpus order
+ *   pack_histogram    packing the histogram of the corpus
+ *   merge_dict        merging it into an empty dictionary, and into a full one
+ *   transfer          a packed histogram from rank 0 to rank 1 and back (to
+ *                     itself when there's a single process)
+ * Every benchmark runs -r times and reports the best run.
+ * *******************************************************************************/
+
+#define BENCH_TAG 6
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char* name, double seconds, double ops, const char* unit, double bytes){
+    printf("%-18s %10.3f ms", name, seconds * 1e3);
+    if(ops > 0)
+        printf(" %10.1f ns/%s", seconds * 1e9 / ops, unit);
+    else
+        printf(" %15s", "");
+    if(bytes > 0)
+        printf(" %10.1f MB/s", bytes / seconds / 1e6);
+    printf("\n");
+}
+
+static void count_sink(const char* word, size_t len, void* user){
+    (void)word;
+    (void)len;
+    (*(long*)user)++;
+}
+
+/* Words of the corpus back to back, with their lengths, for dic_find */
+typedef struct{
+    char*           blob;
+    long            blob_size;
+    long            blob_capacity;
+    unsigned char*  lengths;
+    long            size;
+    long            capacity;
+} Word_list;
+
+static void list_sink(const char* word, size_t len, void* user){
+    Word_list* list = user;
+    if(list->size == list->capacity){
+        list->capacity = list->capacity ? list->capacity * 2 : 1024;
+        list->lengths = realloc(list->lengths, sizeof(*list->lengths) * list->capacity);
+    }
+    if(list->blob_size + (long)len > list->blob_capacity){
+        list->blob_capacity = list->blob_capacity ? list->blob_capacity * 2 : 65536;
+        list->blob = realloc(list->blob, sizeof(*list->blob) * list->blob_capacity);
+    }
+    memcpy(list->blob + list->blob_size, word, len);
+    list->blob_size += len;
+    list->lengths[list->size++] = len;
+}
+
+int main(int argc, char* argv[]){
+    int rank, wsize;
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &wsize);
+
+    Zipf_params params;
+    zipf_defaults(&params);
+    long bytes = 64L << 20;
+    int repetitions = 5;
+    int opt;
+    while((opt = getopt(argc, argv, "b:v:s:l:r:S:")) != -1){
+        switch(opt){
+            case 'b': bytes = atol(optarg); break;
+            case 'v': params.vocabulary = atol(optarg); break;
+            case 's': params.exponent = atof(optarg); break;
+            case 'l': params.mean_length = atof(optarg); break;
+            case 'r': repetitions = atoi(optarg); break;
+            case 'S': params.seed = strtoull(optarg, NULL, 10); break;
+            default:
+                if(rank == 0)
+                    fprintf(stderr, "Usage: %s [-b bytes] [-v vocabulary] [-s exponent] [-l mean_length] [-r repetitions] [-S seed]\n", argv[0]);
+                MPI_Finalize();
+                return EXIT_FAILURE;
+        }
+    }
+    if(repetitions < 1)
+        repetitions = 1;
+
+    Zipf_corpus* zipf = zipf_new(&params);
+    char* corpus = malloc(sizeof(*corpus) * (bytes + 257));
+    bytes = zipf_fill(zipf, corpus, bytes);
+
+    if(rank == 0)
+        printf("corpus: %ld bytes, vocabulary %ld, exponent %.2f, kernel %s\n\n", bytes, params.vocabulary, params.exponent, tokenizer_kernel());
+
+    double best, t;
+    long nwords = 0;
+
+    best = 1e30;
+    for(int r = 0; r < repetitions; r++){
+        nwords = 0;
+        t = now();
+        tokenize_span(corpus, bytes, count_sink, &nwords);
+        t = now() - t;
+        best = t < best ? t : best;
+    }
+    if(rank == 0)
+        report("tokenize", best, nwords, "word", bytes);
+
+    struct dictionary* counted = NULL;
+    best = 1e30;
+    for(int r = 0; r < repetitions; r++){
+        struct dictionary* dic = dic_new(0);
+        t = now();
+        count_words_span(corpus, bytes, dic);
+        t = now() - t;
+        best = t < best ? t : best;
+        if(counted)
+            dic_delete(counted);
+        counted = dic;
+    }
+    if(rank == 0)
+        report("count_words", best, nwords, "word", bytes);
+
+    best = 1e30;
+    for(int r = 0; r < repetitions; r++){
+        struct dictionary* dic = dic_new(0);
+        t = now();
+        for(long i = 0; i < params.vocabulary; i++){
+            dic_add(dic, zipf->words[i], zipf->lengths[i]);
+            *dic->value = 1;
+        }
+        t = now() - t;
+        best = t < best ? t : best;
+        dic_delete(dic);
+    }
+    if(rank == 0)
+        report("dic_add", best, params.vocabulary, "key", 0);
+
+    Word_list list = { NULL, 0, 0, NULL, 0, 0 };
+    tokenize_span(corpus, bytes, list_sink, &list);
+    long found = 0;
+    best = 1e30;
+    for(int r = 0; r < repetitions; r++){
+        found = 0;
+        char* word = list.blob;
+        t = now();
+        for(long i = 0; i < list.size; i++){
+            found += dic_find(counted, word, list.lengths[i]);
+            word += list.lengths[i];
+        }
+        t = now() - t;
+        best = t < best ? t : best;
+    }
+    if(rank == 0)
+        report("dic_find", best, list.size, "key", 0);
+    if(found != list.size && rank == 0)
+        fprintf(stderr, "dic_find: only %ld of %ld words found\n", found, list.size);
+    free(list.blob);
+    free(list.lengths);
+
+    packed_histogram packed = { NULL, 0, 0 };
+    best = 1e30;
+    for(int r = 0; r < repetitions; r++){
+        t = now();
+        pack_histogram(&packed, counted);
+        t = now() - t;
+        best = t < best ? t : best;
+    }
+    if(rank == 0)
+        report("pack_histogram", best, counted->count, "word", packed.size);
+
+    best = 1e30;
+    for(int r = 0; r < repetitions; r++){
+        struct dictionary* dic = dic_new(0);
+        t = now();
+        merge_dict(dic, packed.data, packed.size);
+        t = now() - t;
+        best = t < best ? t : best;
+        dic_delete(dic);
+    }
+    if(rank == 0)
+        report("merge_dict (new)", best, counted->count, "word", packed.size);
+
+    best = 1e30;
+    for(int r = 0; r < repetitions; r++){
+        struct dictionary* dic = dic_new(0);
+        merge_dict(dic, packed.data, packed.size);
+        t = now();
+        merge_dict(dic, packed.data, packed.size);
+        t = now() - t;
+        best = t < best ? t : best;
+        dic_delete(dic);
+    }
+    if(rank == 0)
+        report("merge_dict (full)", best, counted->count, "word", packed.size);
+
+    // Ping-pong between rank 0 and 1, sized by probing like reduce_histograms does
+    int peer = wsize > 1 ? 1 - rank : rank;
+    unsigned char* incoming = malloc(sizeof(*incoming) * (packed.size ? packed.size : 1));
+    best = 1e30;
+    for(int r = 0; r < repetitions && rank < 2; r++){
+        MPI_Request request;
+        MPI_Message message;
+        MPI_Status status;
+        int size;
+        t = now();
+        if(rank == 0 || wsize == 1){
+            MPI_Isend(packed.data, packed.size, MPI_BYTE, peer, BENCH_TAG, MPI_COMM_WORLD, &request);
+            MPI_Mprobe(peer, BENCH_TAG, MPI_COMM_WORLD, &message, &status);
+            MPI_Get_count(&status, MPI_BYTE, &size);
+            MPI_Mrecv(incoming, size, MPI_BYTE, &message, &status);
+            MPI_Wait(&request, MPI_STATUS_IGNORE);
+        }
+        else {
+            MPI_Mprobe(peer, BENCH_TAG, MPI_COMM_WORLD, &message, &status);
+            MPI_Get_count(&status, MPI_BYTE, &size);
+            MPI_Mrecv(incoming, size, MPI_BYTE, &message, &status);
+            MPI_Send(incoming, size, MPI_BYTE, peer, BENCH_TAG, MPI_COMM_WORLD);
+        }
+        t = now() - t;
+        best = t < best ? t : best;
+    }
+    if(rank == 0)
+        report(wsize > 1 ? "transfer (0<->1)" : "transfer (self)", best, 0, NULL, 2.0 * packed.size);
+
+    free(incoming);
+    free_packed_histogram(&packed);
+    dic_delete(counted);
+    free(corpus);
+    zipf_delete(zipf);
+    MPI_Finalize();
+    return 0;
+}
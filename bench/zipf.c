@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "hashdict.h"
+#include "zipf.h"
+
+/* splitmix64: tiny, fast, and the same sequence on every platform */
+static uint64_t next_random(uint64_t* state){
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1) */
+static double next_uniform(uint64_t* state){
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void zipf_defaults(Zipf_params* params){
+    params->vocabulary = 50000;
+    params->exponent = 1.0;
+    params->mean_length = 5.0;
+    params->min_length = 1;
+    params->max_length = 20;
+    params->short_frequent = 1;
+    params->seed = 42;
+}
+
+static int draw_length(const Zipf_params* params, uint64_t* state){
+    /* Geometric number of extra letters, with mean mean_length - min_length */
+    double extra = params->mean_length - params->min_length;
+    int len = params->min_length;
+    if(extra > 0){
+        double p = 1.0 / (extra + 1.0);
+        while(len < params->max_length && next_uniform(state) >= p)
+            len++;
+    }
+    return len;
+}
+
+/* Shorter first, and in generation order among words of the same length, so the order doesn't depend on qsort */
+typedef struct{
+    char*   word;
+    int     len;
+    long    index;
+} Ranked_word;
+
+static int shorter_first(const void* a, const void* b){
+    const Ranked_word* x = a;
+    const Ranked_word* y = b;
+    if(x->len != y->len)
+        return (x->len > y->len) - (x->len < y->len);
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+Zipf_corpus* zipf_new(const Zipf_params* params){
+    Zipf_corpus* corpus = malloc(sizeof(*corpus));
+    corpus->params = *params;
+    corpus->state = params->seed;
+    long nwords = params->vocabulary;
+    corpus->words = malloc(sizeof(*corpus->words) * nwords);
+    corpus->lengths = malloc(sizeof(*corpus->lengths) * nwords);
+    corpus->cdf = malloc(sizeof(*corpus->cdf) * nwords);
+
+    /* Random words, drawing again on duplicates: short lengths run out of words quickly, so after a few
+       failed attempts the word gets one letter longer */
+    struct dictionary* seen = dic_new(nwords * 2);
+    char word[256];
+    for(long i = 0; i < nwords; i++){
+        int len = draw_length(params, &corpus->state);
+        for(int attempt = 0;; attempt++){
+            if(attempt && attempt % 8 == 0 && len < (int)sizeof(word) - 1)
+                len++;
+            for(int j = 0; j < len; j++)
+                word[j] = 'a' + next_random(&corpus->state) % 26;
+            if(!dic_add(seen, word, len))
+                break;
+        }
+        corpus->words[i] = malloc(sizeof(*corpus->words[i]) * (len + 1));
+        memcpy(corpus->words[i], word, len);
+        corpus->words[i][len] = '\0';
+    }
+    dic_delete(seen);
+
+    if(params->short_frequent){
+        Ranked_word* ranked = malloc(sizeof(*ranked) * nwords);
+        for(long i = 0; i < nwords; i++){
+            ranked[i].word = corpus->words[i];
+            ranked[i].len = strlen(corpus->words[i]);
+            ranked[i].index = i;
+        }
+        qsort(ranked, nwords, sizeof(*ranked), shorter_first);
+        for(long i = 0; i < nwords; i++)
+            corpus->words[i] = ranked[i].word;
+        free(ranked);
+    }
+    for(long i = 0; i < nwords; i++)
+        corpus->lengths[i] = strlen(corpus->words[i]);
+
+    double total = 0;
+    for(long i = 0; i < nwords; i++){
+        total += pow(i + 1, -params->exponent);
+        corpus->cdf[i] = total;
+    }
+    for(long i = 0; i < nwords; i++)
+        corpus->cdf[i] /= total;
+    return corpus;
+}
+
+void zipf_delete(Zipf_corpus* corpus){
+    for(long i = 0; i < corpus->params.vocabulary; i++)
+        free(corpus->words[i]);
+    free(corpus->words);
+    free(corpus->lengths);
+    free(corpus->cdf);
+    free(corpus);
+}
+
+long zipf_next(Zipf_corpus* corpus){
+    double u = next_uniform(&corpus->state);
+    long lo = 0, hi = corpus->params.vocabulary - 1;
+    while(lo < hi){
+        long mid = lo + (hi - lo) / 2;
+        if(corpus->cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+size_t zipf_fill(Zipf_corpus* corpus, char* buffer, size_t bytes){
+    size_t size = 0;
+    int column = 0;
+    while(size < bytes){
+        long r = zipf_next(corpus);
+        memcpy(buffer + size, corpus->words[r], corpus->lengths[r]);
+        size += corpus->lengths[r];
+        buffer[size++] = ++column % 12 ? ' ' : '\n';
+    }
+    return size;
+}
@@ -0,0 +1,45 @@
+#ifndef ZIPF_H
+#define ZIPF_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**************************************
+ * Deterministic synthetic corpora: a
+ * vocabulary of random lowercase words,
+ * sampled with Zipf frequencies. The same
+ * parameters always give the same bytes.
+ * ************************************/
+
+typedef struct{
+    long        vocabulary;     /* Distinct words */
+    double      exponent;       /* Zipf exponent s: the word of rank r has weight 1/r^s */
+    double      mean_length;    /* Mean word length, lengths are geometric from min_length */
+    int         min_length;
+    int         max_length;
+    int         short_frequent; /* Sort the vocabulary by length, so the most frequent words are the shortest */
+    uint64_t    seed;
+} Zipf_params;
+
+typedef struct{
+    Zipf_params params;
+    char**      words;
+    int*        lengths;
+    double*     cdf;
+    uint64_t    state;
+} Zipf_corpus;
+
+void zipf_defaults(Zipf_params* params);
+
+Zipf_corpus* zipf_new(const Zipf_params* params);
+
+void zipf_delete(Zipf_corpus* corpus);
+
+/* Rank (0 based) of the next word of the corpus */
+long zipf_next(Zipf_corpus* corpus);
+
+/* Writes words separated by spaces, with a newline every few words, until at least bytes bytes are written.
+   Returns how many bytes were written to buffer (which must hold bytes + max_length + 1) */
+size_t zipf_fill(Zipf_corpus* corpus, char* buffer, size_t bytes);
+
+#endif
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include "zipf.h"
+
+/* Writes a synthetic Zipf corpus, see zipf.h. Same parameters, same file. */
+
+#define GEN_BLOCK (1 << 20)
+
+static void usage_print(char* exec_name){
+    fprintf(stderr, "Usage: %s [options] <bytes> [output_file]\n", exec_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -v WORDS : Vocabulary size (default: 50000)\n");
+    fprintf(stderr, "  -s EXPONENT : Zipf exponent (default: 1.0)\n");
+    fprintf(stderr, "  -l MEAN : Mean word length (default: 5.0)\n");
+    fprintf(stderr, "  -m MIN, -M MAX : Shortest and longest word length (default: 1, 20)\n");
+    fprintf(stderr, "  -u : Don't give the shortest words the highest frequencies\n");
+    fprintf(stderr, "  -S SEED : Random seed (default: 42)\n");
+    fprintf(stderr, "Without an output file the corpus goes to stdout.\n");
+}
+
+int main(int argc, char* argv[]){
+    Zipf_params params;
+    zipf_defaults(&params);
+
+    int opt;
+    while((opt = getopt(argc, argv, "v:s:l:m:M:uS:")) != -1){
+        switch(opt){
+            case 'v': params.vocabulary = atol(optarg); break;
+            case 's': params.exponent = atof(optarg); break;
+            case 'l': params.mean_length = atof(optarg); break;
+            case 'm': params.min_length = atoi(optarg); break;
+            case 'M': params.max_length = atoi(optarg); break;
+            case 'u': params.short_frequent = 0; break;
+            case 'S': params.seed = strtoull(optarg, NULL, 10); break;
+            default: usage_print(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if(optind >= argc || params.vocabulary < 1 || params.min_length < 1 || params.max_length > 255 || params.min_length > params.max_length){
+        usage_print(argv[0]);
+        return EXIT_FAILURE;
+    }
+    long bytes = atol(argv[optind]);
+    FILE* output = optind + 1 < argc ? fopen(argv[optind + 1], "w") : stdout;
+    if(!output){
+        fprintf(stderr, "Could not open %s\n", argv[optind + 1]);
+        return EXIT_FAILURE;
+    }
+
+    Zipf_corpus* corpus = zipf_new(&params);
+    char* buffer = malloc(sizeof(*buffer) * (GEN_BLOCK + 257));
+    for(long written = 0; written < bytes; ){
+        size_t size = zipf_fill(corpus, buffer, bytes - written < GEN_BLOCK ? bytes - written : GEN_BLOCK);
+        fwrite(buffer, sizeof(*buffer), size, output);
+        written += size;
+    }
+    free(buffer);
+    zipf_delete(corpus);
+
+    if(output != stdout)
+        fclose(output);
+    return 0;
+}
@@ -44,6 +44,37 @@ for ((i=0; i<${#files[@]}; i++)); do
   done
 done
 
+# Same with -C utf8, on words joined by a fullwidth comma: the whole file is a single run of word bytes, so every cut
+# between processes falls in the middle of a word, and often of a character
+echo "Executing with -C utf8..."
+utf8_dir=$(mktemp -d)
+words=("上海" "北京" "中国" "東京" "Straße" "ÉCOLE" "Москва" "naïve")
+for ((k=0; k<20000; k++)); do
+    printf '%s，' "${words[k % 8]}${words[(k * 7 / 3) % 8]}"
+done > "$utf8_dir/words.txt"
+
+utf8_files=()
+for ((i=1; i<="$no_of_processors"; i++)); do
+    mpirun \
+        --allow-run-as-root \
+        --oversubscribe \
+        --mca btl_vader_single_copy_mechanism none \
+        -np $i "./word_count.out" \
+        -C utf8 -d -f "$utf8_dir" "utf8_output$i.csv" 2> /dev/null
+    sort "utf8_output$i.csv" > "sorted_utf8_$i.csv"
+    utf8_files+=("sorted_utf8_$i.csv")
+done
+
+for ((i=1; i<${#utf8_files[@]}; i++)); do
+    echo "Comparing ${utf8_files[0]} and ${utf8_files[i]}:"
+    diff -s "${utf8_files[0]}" "${utf8_files[i]}"
+    echo
+done
+rm -rf "$utf8_dir"
+rm -f utf8_output*
+
+echo "=========================================="
+
 echo "Merging logfiles..."
 echo "RECAP OF THE EXECUTIONS FOR $i PROCESSORS" > final_logfile
 for ((i=1; i<=no_of_processors; i++)); do
@@ -0,0 +1,41 @@
+#ifndef ASYNCREAD_H
+#define ASYNCREAD_H
+
+#include <stddef.h>
+#include "hashdict.h"
+#include "workload.h"
+
+/* Bytes asked for by every read */
+#define ASYNC_BLOCK (1 << 20)
+/* Reads in flight, one buffer each: the one being tokenized is not among them */
+#define ASYNC_DEPTH 4
+
+/**************************************
+ * Read pipeline over a list of byte
+ * ranges. Blocks come out in order, but
+ * the reads of the next ASYNC_DEPTH
+ * blocks, of the current range and of
+ * the ones after it, are already running
+ * while the caller works on the current
+ * block. Reads go through io_uring when
+ * the kernel has it, through a reader
+ * thread otherwise.
+ * ************************************/
+typedef struct Read_pipeline Read_pipeline;
+
+/* Not thread safe: called once, before any pipeline is opened. Without the reader thread, where there's no io_uring
+   either, blocks are read by the caller as it gets to them, with nothing read ahead */
+void read_pipeline_allow_thread(int allowed);
+
+/* Compressed files can't be read raw: ranges must be plain files */
+Read_pipeline* read_pipeline_open(const File_chunk* ranges, size_t nranges);
+
+/* Next block: *buffer stays valid until the following call. Returns 0 once every range has been read */
+int read_pipeline_next(Read_pipeline* rp, const char** buffer, size_t* len, size_t* range);
+
+void read_pipeline_close(Read_pipeline* rp);
+
+/* Counts the chunks in the calling thread, tokenizing each block while the next ones are read */
+void count_chunk_vector_async(Chunk_vector* chunks, struct dictionary* dic);
+
+#endif
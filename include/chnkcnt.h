@@ -2,25 +2,68 @@
 #define CHNKCNT_H
 
 #include "hashdict.h"
+#include "tokenize.h"
+#include "workload.h"
 #include "mpi.h"
 
 #define BLOCKSIZE 2048
-#define WORD_MAX 256
+#define BOUNDARY_WINDOW 4096
 
+#define BOUNDARY_TAG 3
+
+/* Edge words exchanged with the neighbouring processes, see boundary_post */
 typedef struct{
-	char* first_word;
-	char* last_word;
-	int chunk_type;
-} sync_info;
+    char            first_word[TOKEN_EDGE]; /* Ours, sent to rank-1 */
+    char            last_word[TOKEN_EDGE];  /* Ours, sent to rank+1 */
+    char            prev_last[TOKEN_EDGE];  /* Received from rank-1 */
+    char            next_first[TOKEN_EDGE]; /* Received from rank+1 */
+    int             with_prev;
+    int             with_next;
+    MPI_Request     requests[4];
+} Boundary_exchange;
+
+void count_words_span(const char* buffer, size_t len, struct dictionary* dic);
+
+/* Returns the offset of the first non-word byte in [offset, end), looking at most BOUNDARY_WINDOW bytes ahead, or -1.
+   Cutting a file there can't split a word in two. */
+long find_word_boundary(const char* file_name, long offset, long end);
 
-char* count_words(char* buffer, struct dictionary* dic, size_t* lwlen);
+/* Same, but looks on both sides of offset (at most BOUNDARY_WINDOW/2 bytes each), strictly inside (lo, hi) */
+long find_nearest_boundary(const char* file_name, long offset, long lo, long hi);
 
-char* recover_missing_word(char* buffer, char* previous_portion, size_t lwlen, size_t* b4_space);
+/* Moves [start, end) of a chunk to the words that start inside it: the tail of a word coming from before
+   the chunk is skipped, and the word running past its end is read to its end. Chunks trimmed like this
+   can be counted on their own, with no synchronization between them. */
+void own_words(File_chunk* chunk);
+
+void align_cuts_to_words(Chunk_vector** chunks_proc, int rank, int wsize, char* needs_sync, MPI_Comm comm);
+
+/* Counts a chunk that's read block by block, keeping track of its edge words */
+typedef struct{
+    struct dictionary*  dic;
+    Token_stream        stream;
+    char*               first_word;
+    int                 started;
+    int                 want_first;
+} Chunk_stream;
+
+void chunk_stream_init(Chunk_stream* cs, struct dictionary* dic);
+
+void chunk_stream_feed(Chunk_stream* cs, const char* buffer, size_t len);
+
+char* chunk_stream_end(Chunk_stream* cs, char** first_word);
 
 char* count_words_chunk(char* file_name, long start, long end, struct dictionary* dic, char** first_word);
 
-void sync_with_next(char* last_word, int rank, struct dictionary* dic, MPI_Comm comm);
+/* Hands every word of [start, end) to sink, without counting anything */
+void tokenize_chunk(const char* file_name, long start, long end, token_sink sink, void* user);
+
+/* Reads the pieces of word a chunk starts and ends with (see tokenize_edge_head/tail), empty strings if it doesn't.
+   Both have room for TOKEN_EDGE bytes */
+void read_chunk_edges(const char* file_name, long start, long end, char* first_word, char* last_word);
+
+void boundary_post(Boundary_exchange* bx, Chunk_vector* chunks, int rank, int sync_prev, int sync_next, MPI_Comm comm);
 
-void sync_with_prev(char* fw_word, int rank, struct dictionary* dic, MPI_Comm comm);
+void boundary_complete(Boundary_exchange* bx, struct dictionary* dic);
 
 #endif
@@ -0,0 +1,22 @@
+#ifndef CHNKPOOL_H
+#define CHNKPOOL_H
+
+#include "hashdict.h"
+#include "chnkcnt.h"
+#include "workload.h"
+
+/* Chunks are split in pieces of at least this many bytes when counting with more than one thread */
+#define PIECE_MIN (1 << 20)
+/* Pieces per thread: more than one, so threads that finish early can pick up the remaining ones */
+#define PIECES_PER_THREAD 4
+
+typedef struct{
+    char*   file_name;
+    long    start;
+    long    end;
+    size_t  chunk;      /* Index of the chunk this piece belongs to */
+} Chunk_piece;
+
+void count_chunk_vector(Chunk_vector* chunks, int nthreads, struct dictionary* dic);
+
+#endif
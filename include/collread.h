@@ -0,0 +1,16 @@
+#ifndef COLLREAD_H
+#define COLLREAD_H
+
+#include "mpi.h"
+#include "hashdict.h"
+#include "chnkcnt.h"
+#include "workload.h"
+
+/* Bytes read by every process in each collective round, also used as the collective buffer size */
+#define MPIIO_BLOCK (4 << 20)
+/* Default stripe size, for planning and hints, when the file system doesn't tell */
+#define MPIIO_STRIPE (1 << 20)
+
+void count_chunk_vector_mpiio(Chunk_vector** chunks_proc, int rank, int wsize, long stripe, struct dictionary* dic);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdio.h>
+#include "mpi.h"
+
+/* How often the master looks for new job files in a spool directory */
+#define DAEMON_POLL_MS 50
+/* How long the other processes sleep between two checks for the next job, instead of spinning in MPI */
+#define DAEMON_IDLE_US 1000
+
+/* A job file goes job -> running -> done (or failed), renamed in place */
+#define JOB_SUFFIX ".job"
+#define JOB_RUNNING_SUFFIX ".running"
+#define JOB_DONE_SUFFIX ".done"
+#define JOB_FAILED_SUFFIX ".failed"
+
+/* A job line made of just this stops the daemon */
+#define DAEMON_STOP "stop"
+
+/**************************************
+ * Jobs of a resident run. A job is one
+ * line: the input directory, then
+ * optionally a tab and the output file
+ * (stdout of the master without one).
+ * Jobs come from a FIFO, a line at a
+ * time, or from a spool directory, a
+ * file <name>.job per job, taken in
+ * name order.
+ * ************************************/
+typedef struct{
+    char*   input_dir;
+    char*   output_file;    /* NULL for stdout */
+    char*   spool_file;     /* Job file, without its suffix. NULL for jobs read from a FIFO */
+} Daemon_job;
+
+typedef struct{
+    const char* path;
+    int         fifo;
+    FILE*       stream;     /* The FIFO, while a writer has it open */
+} Job_source;
+
+/* Master only. Returns -1 if path is neither a directory nor a FIFO */
+int job_source_open(Job_source* source, const char* path);
+
+/* Master only. Waits for the next job, returns 0 when told to stop */
+int job_next(Job_source* source, Daemon_job* job);
+
+/* Master only. Checks that the input directory is there and that the output file can be written, before the other
+   processes hear of the job. Returns -1, with a message, if not */
+int job_check(const Daemon_job* job);
+
+/* Master only. Marks the job file as done or failed */
+void job_finish(Job_source* source, Daemon_job* job, int failed);
+
+void job_source_close(Job_source* source);
+
+/* Collective: the job of root reaches every process (the others wait without spinning). Returns 0 on stop */
+int job_share(Daemon_job* job, int running, int root, MPI_Comm comm);
+
+void job_free(Daemon_job* job);
+
+#endif
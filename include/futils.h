@@ -1,7 +1,10 @@
 #ifndef FILE_UTILS_H
 #define FILE_UTILS_H
 
-#define MAX_FILES 512
+#include "mpi.h"
+
+/* Threads walking the directory tree on the master: it waits on metadata, not on the CPU */
+#define SCAN_THREADS 8
 
 /**************************************
  * List implementation
@@ -29,12 +32,28 @@ typedef struct file_info File_info;
 
 struct file_vector{
     size_t		size;
+    char*		names;		/* Buffer holding all the names, if they came from share_file_vec */
     File_info	files[];
 };
 
 typedef struct file_vector File_vector;
 
-void get_file_vec(File_vector **vector, size_t* total_lines, char* dir_path, char* executable_name);
+/* Walks the tree below dir_path with nthreads threads. Returns -1 if dir_path isn't a readable directory */
+int get_file_vec(File_vector **vector, size_t* total_size, char* dir_path, char* executable_name, int nthreads);
+
+/* Reads the list of files from a manifest. Returns -1 if it can't be opened */
+int read_manifest(File_vector **vector, size_t* total_size, char* manifest_path);
+
+/* Largest single broadcast: buffers past what an int can count go in slices of this size */
+#define BCAST_SLICE (1L << 30)
+
+/* Broadcasts size bytes from root, in slices of BCAST_SLICE */
+void bcast_bytes(char* buffer, long size, int root, MPI_Comm comm);
+
+/* Sends the vector discovered by root to every process in comm */
+void share_file_vec(File_vector **vector, size_t* total_size, int root, MPI_Comm comm);
+
+void free_file_vec(File_vector *vector);
 
 File_info* get_file_at(File_vector **vector, size_t position);
 
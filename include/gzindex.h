@@ -0,0 +1,90 @@
+#ifndef GZINDEX_H
+#define GZINDEX_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "futils.h"
+
+/* Files with this suffix are read through their uncompressed stream */
+#define GZ_SUFFIX ".gz"
+/* Side index of a compressed file: <file>.gz.zidx, next to it. Never counted as input */
+#define GZ_INDEX_SUFFIX ".zidx"
+#define GZ_INDEX_MAGIC "WCGZIDX1"
+
+/* Uncompressed bytes between two checkpoints: the most a read has to decompress before reaching its offset */
+#define GZ_SPAN (1L << 20)
+/* History a checkpoint needs to restart inflating: the deflate window */
+#define GZ_WINDOW 32768
+#define GZ_CHUNK (1 << 16)
+
+/**************************************
+ * Checkpoint of the decompressor, in
+ * the style of zlib's zran example: the
+ * deflate stream can be restarted at
+ * bit `bits` before byte `in` of the
+ * compressed file, which is byte `out`
+ * of the uncompressed stream, given the
+ * GZ_WINDOW bytes that come before it.
+ * ************************************/
+typedef struct{
+    int64_t     out;
+    int64_t     in;
+    int32_t     bits;
+    int32_t     unused;
+} Gz_point;
+
+/* What a side index is valid for: the compressed file it was built from */
+typedef struct{
+    uint64_t    size;
+    int64_t     mtime_sec;
+    int64_t     mtime_nsec;
+} Gz_key;
+
+/**************************************
+ * Side index, on disk:
+ *
+ *   char       magic[8]        GZ_INDEX_MAGIC
+ *   Gz_key     key
+ *   int64_t    length          of the uncompressed stream
+ *   int64_t    npoints
+ *   uint8_t    windows[npoints][GZ_WINDOW]
+ *   Gz_point   points[npoints]
+ *
+ * Only the points are loaded: the window of
+ * a checkpoint is read when it's used.
+ * ************************************/
+typedef struct{
+    char*           file_name;
+    int64_t         length;
+    size_t          npoints;
+    Gz_point*       points;
+    unsigned char*  windows;    /* In memory when the side index couldn't be written, NULL otherwise */
+} Gz_index;
+
+#define GZ_INDEX_HEADER (sizeof(GZ_INDEX_MAGIC) - 1 + sizeof(Gz_key) + 2 * sizeof(int64_t))
+
+/* Receives the uncompressed stream, one buffer at a time */
+typedef void (*gz_sink)(const char* buffer, size_t len, void* user);
+
+/* Whether file_name is read through its uncompressed stream */
+int gz_is_compressed(const char* file_name);
+
+/* Length of the uncompressed stream, loading (or building) the index of the file. -1 if it isn't valid gzip */
+long gz_length(const char* file_name);
+
+/* Hands [start, end) of the uncompressed stream to sink, inflating from the last checkpoint before start.
+   Returns -1 if the file couldn't be read to end */
+int gz_stream(const char* file_name, long start, long end, gz_sink sink, void* user);
+
+/* pread on the uncompressed stream */
+ssize_t gz_pread(const char* file_name, void* buffer, size_t len, long offset);
+
+/* Master only. Builds the missing side indexes and replaces the size of every compressed file with the length
+   of its uncompressed stream, so the planner cuts it like any other file. Files that aren't valid gzip are
+   dropped. Returns how many compressed files there are. */
+size_t gz_resolve_sizes(File_vector** files, size_t* total_size);
+
+/* Frees the indexes loaded by this process */
+void gz_free_indexes(void);
+
+#endif
@@ -3,9 +3,9 @@
 #include <stdlib.h> /* malloc/calloc */
 #include <stdint.h> /* uint32_t */
 #include <string.h> /* memcpy/memcmp */
-#ifdef __x86_64__
-   #include <xmmintrin.h>
-#else
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#elif defined(__ARM_NEON)
   #include <arm_neon.h>
 #endif
 
@@ -14,25 +14,52 @@ typedef int (*enumFunc)(void *key, int count, int *value, void *user);
 #define HASHDICT_VALUE_TYPE int
 #define KEY_LENGTH_TYPE uint8_t
 
-struct keynode {
-	struct keynode *next;
+/* Slots are probed one group at a time: the control bytes of a whole group are
+ * matched against the 7-bit tag of the hash with a single SIMD compare. */
+#define HASHDICT_GROUP 16
+#define HASHDICT_EMPTY ((int8_t)-128)
+
+/* Groups moved from the old table to the new one by every insert while growing. The new table has twice the
+ * slots, so at 2 groups per insert the old one is empty long before the new one fills up. */
+#define HASHDICT_MIGRATE 2
+
+struct keyslot {
 	char *key;
+	uint32_t hash;
 	KEY_LENGTH_TYPE len;
 	HASHDICT_VALUE_TYPE value;
 };
-		
+
+/* Keys are bump-allocated in big blocks, so adding a word costs no malloc */
+struct keyarena {
+	struct keyarena *next;
+	size_t used, size;
+	char data[];
+};
+
 struct dictionary {
-	struct keynode **table;
+	int8_t *ctrl;
+	struct keyslot *slots;
 	int length, count;
 	double growth_treshold;
 	double growth_factor;
 	HASHDICT_VALUE_TYPE *value;
+	struct keyarena *arena;
+	struct keyarena *spare;		/* Blocks emptied by dic_clear, used again before allocating new ones */
+	/* While growing: the previous table, whose groups before migrated have been moved already */
+	int8_t *old_ctrl;
+	struct keyslot *old_slots;
+	int old_length, migrated;
 };
 
 /* See README.md */
 
 struct dictionary* dic_new(int initial_size);
 void dic_delete(struct dictionary* dic);
+/* Removes every key, keeping the table and the key blocks for the next ones */
+void dic_clear(struct dictionary* dic);
+/* Makes room for nkeys keys, so adding them won't grow the table */
+void dic_reserve(struct dictionary* dic, int nkeys);
 int dic_add(struct dictionary* dic, void *key, int keyn);
 int dic_find(struct dictionary* dic, void *key, int keyn);
 void dic_forEach(struct dictionary* dic, enumFunc f, void *user);
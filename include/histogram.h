@@ -1,21 +1,63 @@
 #ifndef HISTOGRAM_H
 #define HISTOGRAM_H
 
+#include <stdint.h>
 #include "mpi.h"
 #include "hashdict.h"
 #include "chnkcnt.h"
 
+/**************************************
+ * Packed histogram, as sent on the wire:
+ *
+ *   uint32_t  nwords
+ *   uint32_t  blob_size
+ *   uint8_t   lengths[nwords]
+ *   char      blob[blob_size]    words back to back, no terminators
+ *   varint    counts[nwords]     zigzag LEB128
+ *
+ * A 4-letter word seen a few hundred times costs 7 bytes.
+ * ************************************/
 typedef struct{
-    int count;
-    char word[WORD_MAX];
-    // Possible optimization: add an "actual_word_length" field, to avoid calling strlen later.
-    // It would be easily taken from the hashdict "keylen" attribute @todo
-} histogram_element;
+    unsigned char*  data;
+    size_t          size;
+    size_t          capacity;
+} packed_histogram;
 
-long get_local_histogram(histogram_element* local_elements, struct dictionary* dic);
+#define HISTOGRAM_HEADER (2 * sizeof(uint32_t))
 
-void merge_dict(struct dictionary* dic, histogram_element** process_histograms, long* localszs, int wsize);
+#define REDUCE_FLAT 0
+#define REDUCE_TREE 1
+#define REDUCE_SHUFFLE 2
+#define REDUCE_IDS 3
 
-int MPI_Type_create_histogram(MPI_Datatype* histogram_element_dt);
+/* Hash buckets per process in the shuffle, the unit of load balancing */
+#define SHUFFLE_BUCKETS 16
+
+/* Largest single message: byte buffers past what an int can count or address go in pieces of this size */
+#define MESSAGE_PIECE (1 << 30)
+
+#define REDUCE_TAG 1
+#define SHUFFLE_TAG 7
+
+/* Point to point messages of any size: the length goes first, then the bytes in pieces of MESSAGE_PIECE */
+void send_large(const void* data, size_t size, int dest, int tag, MPI_Comm comm);
+
+/* Receives what send_large sent, from source or MPI_ANY_SOURCE, in a new buffer of *size bytes */
+unsigned char* recv_large(int source, int tag, MPI_Comm comm, size_t* size);
+
+void pack_histogram(packed_histogram* packed, struct dictionary* dic);
+
+void free_packed_histogram(packed_histogram* packed);
+
+long merge_dict(struct dictionary* dic, const unsigned char* data, size_t size);
+
+void merge_dictionary(struct dictionary* dic, struct dictionary* other);
+
+void reduce_histograms(struct dictionary* dic, int reduction, int root, MPI_Comm comm);
+
+/* Agrees on a global ID for every word, then reduces the counts as dense vectors with MPI_Reduce */
+void reduce_word_ids(struct dictionary* dic, int root, MPI_Comm comm);
+
+struct dictionary* shuffle_histograms(struct dictionary* dic, MPI_Comm comm);
 
 #endif
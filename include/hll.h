@@ -0,0 +1,51 @@
+#ifndef HLL_H
+#define HLL_H
+
+#include <stddef.h>
+#include "mpi.h"
+#include "workload.h"
+
+/* 2^14 one-byte registers: 16 KiB per sketch, for a standard error of 1.04/sqrt(2^14) = 0.81% */
+#define HLL_PRECISION 14
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+
+/**************************************
+ * HyperLogLog sketch of a set of words.
+ * Every register keeps the longest run
+ * of leading zeros seen among the hashes
+ * that fall in it, so the sketch of the
+ * union of two sets is the register-wise
+ * max of their sketches.
+ * ************************************/
+typedef struct{
+    unsigned char   registers[HLL_REGISTERS];
+} Hll_sketch;
+
+/* Bytes of the input sketched by hll_vocabulary_hint, spread over the chunks */
+#define HLL_HINT_SAMPLE (1L << 20)
+/* Below this much input the sample would be a good part of it, and a table growing as it goes costs less */
+#define HLL_HINT_MIN_INPUT (16 * HLL_HINT_SAMPLE)
+/* Heaps' law: a text of n words has about K * n^beta distinct words. beta is about 0.5 for English prose */
+#define HEAPS_BETA 0.5
+
+void hll_init(Hll_sketch* sketch);
+
+/* A token_sink: adds word to the sketch */
+void hll_add(const char* word, size_t len, void* user);
+
+double hll_estimate(const Hll_sketch* sketch);
+
+/* Adds every word of the chunks to the sketch. Chunks are trimmed with own_words, so split words are never seen in pieces */
+void hll_sketch_chunks(Hll_sketch* sketch, Chunk_vector* chunks);
+
+/* Estimates the vocabulary of the chunks from a sample of HLL_HINT_SAMPLE bytes, extrapolated with Heaps' law.
+   Cheap enough to size a dictionary up front when the full pass of hll_sketch_chunks isn't worth it.
+   Returns 0, without reading anything, for chunks adding up to less than HLL_HINT_MIN_INPUT */
+double hll_vocabulary_hint(Chunk_vector* chunks);
+
+/* Merges the sketches of every process into the one of root (hll_reduce) or into all of them (hll_allreduce) */
+void hll_reduce(Hll_sketch* sketch, int root, MPI_Comm comm);
+
+void hll_allreduce(Hll_sketch* sketch, MPI_Comm comm);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef RESCACHE_H
+#define RESCACHE_H
+
+#include <stdint.h>
+#include "mpi.h"
+#include "hashdict.h"
+#include "futils.h"
+#include "workload.h"
+
+#define CACHE_TAG 4
+
+#define CACHE_MAGIC "WCCACHE2"
+
+/* Bytes hashed at the start, in the middle and at the end of a file for its content hash */
+#define CACHE_SAMPLE (64 << 10)
+
+/* What a cached histogram is valid for: a file that changed has a different key (almost certainly),
+   and so does the same file read with a different character set */
+typedef struct{
+    uint64_t    size;
+    int64_t     mtime_sec;
+    int64_t     mtime_nsec;
+    uint64_t    content_hash;
+    int64_t     charset;
+} Cache_key;
+
+typedef struct{
+    const char* dir;
+    Cache_key*  keys;       /* Key of every file left to count, in file vector order. Master only until count_and_cache */
+    char*       keyed;      /* Whether that key could be computed: files without one are counted, never stored */
+} Result_cache;
+
+/* Master only. Merges the histograms of the unchanged files into dic and removes those files from the vector,
+   so only new and changed files get a workload. Returns how many files came from the cache. */
+size_t cache_lookup(Result_cache* cache, File_vector** files, size_t* total_size, struct dictionary* dic);
+
+/* Counts the chunks of this process (chunks_proc is the workload of every process) with a histogram per file, stores
+   the files it holds whole in the cache and merges them into dic; the pieces of split files go to root, which does the
+   same for them. dic still has to be reduced afterwards. Collective over comm. */
+void count_and_cache(Result_cache* cache, File_vector* files, Chunk_vector** chunks_proc, int nthreads, struct dictionary* dic, int root, MPI_Comm comm);
+
+void free_result_cache(Result_cache* cache);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef SORTOUT_H
+#define SORTOUT_H
+
+#include "mpi.h"
+#include "hashdict.h"
+
+#define SORT_NONE 0
+#define SORT_WORD 1     /* Bytewise, a word before every longer word it's a prefix of */
+#define SORT_COUNT 2    /* Highest count first, ties by word */
+
+/* Samples every process contributes to pick the splitters */
+#define SORT_SAMPLES 64
+
+/* Largest piece of output written by a single MPI_File_write_at_all, whose count is an int */
+#define SORT_WRITE_BLOCK (1 << 30)
+
+/**************************************
+ * Sorted output, by a sample sort over
+ * all processes: every process ends up
+ * with a contiguous range of the sorted
+ * vocabulary and writes it at its own
+ * offset of a single output file.
+ * ************************************/
+
+/* Collective over comm. dic must hold exact counts for words no other process has (as after shuffle_histograms).
+   Without an output file the master prints the ranges, in rank order, to stdout. Returns -1 on every process if the
+   output file couldn't be opened */
+int write_sorted(struct dictionary* dic, int key, const char* output_file, int root, MPI_Comm comm);
+
+#endif
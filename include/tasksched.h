@@ -0,0 +1,17 @@
+#ifndef TASKSCHED_H
+#define TASKSCHED_H
+
+#include "mpi.h"
+#include "hashdict.h"
+#include "workload.h"
+
+/* Default size of a task in dynamic scheduling */
+#define TASK_SIZE (4 << 20)
+
+#define SCHEDULE_STATIC 0
+#define SCHEDULE_DYNAMIC 1
+
+/* Counts the tasks claimed by this process, until there are none left. Collective over comm */
+void count_tasks(Chunk_vector* tasks, int nthreads, struct dictionary* dic, MPI_Comm comm);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef TOKENIZE_H
+#define TOKENIZE_H
+
+#include <stddef.h>
+
+/* Longest word we store is WORD_MAX-1 characters: longer ones are clamped */
+#define WORD_MAX 256
+
+/* Raw bytes of a word running into the end of a buffer kept by Token_stream. With UTF-8 a run of word bytes may hold
+   many words: once it fills up the carry, only the word still going on is kept */
+#define TOKEN_CARRY (4 * WORD_MAX)
+
+/* Character sets, chosen at run time with tokenize_set_charset */
+#define TOK_ASCII 0     /* Words are runs of [A-Za-z0-9], every other byte is a delimiter */
+#define TOK_LATIN1 1    /* Plus the letters of ISO-8859-1 */
+#define TOK_UTF8 2      /* Plus the letters (and combining marks) of UTF-8 encoded text */
+
+/* Tokens are processed in windows of this many bytes: each window is classified and lowercased in SIMD registers
+   into a scratch buffer, and then its word spans are extracted from the boundary bitmasks. */
+#define TOKEN_WINDOW 8192
+
+/* Receives every word found by the tokenizer, already lowercased and clamped to WORD_MAX-1 characters */
+typedef void (*token_sink)(const char* word, size_t len, void* user);
+
+/* Byte classes and case folding of the current character set (isalnum/tolower in the C locale for TOK_ASCII).
+   With TOK_UTF8 every byte >= 0x80 is a word byte here: whether it's part of a letter only shows when decoding.
+   Anything cutting the input at a non-word byte can't split a word, nor a multibyte character. */
+extern unsigned char tok_class[256];
+extern unsigned char tok_fold[256];
+
+#define tok_isword(c) (tok_class[(unsigned char)(c)])
+#define tok_lower(c) (tok_fold[(unsigned char)(c)])
+
+/* Tokenizer state for input that arrives in consecutive buffers: a word running into the end of a buffer
+   is carried over and completed with the head of the next one. */
+typedef struct{
+    char    carry[TOKEN_CARRY];  /* Raw head of the run of word bytes being carried (UTF-8: its last word, folded, then raw) */
+    size_t  carry_len;
+    int     in_word;
+} Token_stream;
+
+/* Not thread safe: called once, before any tokenizing */
+void tokenize_set_charset(int charset);
+
+int tokenize_charset(void);
+
+void tokenize_span(const char* buffer, size_t len, token_sink sink, void* user);
+
+void tokenize_stream_init(Token_stream* stream);
+
+void tokenize_stream(Token_stream* stream, const char* buffer, size_t len, token_sink sink, void* user);
+
+void tokenize_stream_end(Token_stream* stream, token_sink sink, void* user);
+
+/* Length of the piece of word at the start of buffer, found as tokenize_edge_head does but never clamped: the leading
+   run of word bytes, with TOK_UTF8 up to the first character that isn't a letter. open is set when the piece may go
+   on past the buffer; the length then leaves out a character cut short by its end */
+size_t tokenize_word_head(const char* buffer, size_t len, int* open);
+
+/* Longest piece of word on the edge of a cut, as given by tokenize_edge_head/tail, with its terminator */
+#define TOKEN_EDGE (WORD_MAX + 4)
+
+/* The piece of word at the start (head) or at the end (tail) of buffer, for a cut that may go through a word: the
+   leading (trailing) run of word bytes, lowercased and clamped. With TOK_UTF8 a run holds any number of words and a
+   cut may split a character, so the piece ends at the first (starts after the last) character that isn't a letter,
+   and keeps the bytes of a character cut in two raw. Either way the piece is written to edge, unterminated, in a
+   form that tokenizes to the words counted for it, and joining the tail before a cut with the head after it
+   tokenizes to the words of the whole. Returns its length, less than TOKEN_EDGE */
+size_t tokenize_edge_head(const char* buffer, size_t len, char* edge);
+
+size_t tokenize_edge_tail(const char* buffer, size_t len, char* edge);
+
+const char* tokenizer_kernel(void);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <stdio.h>
+#include "mpi.h"
+#include "tokenize.h"
+
+/* Counters kept for every word asked for: the more counters, the tighter the error bounds */
+#define TOPK_FACTOR 4
+/* But never fewer than this many: with a long tail, a handful of counters only gives loose bounds */
+#define TOPK_MIN_COUNTERS 4096
+
+#define TOPK_TAG 5
+
+/**************************************
+ * Space-Saving summary: at most capacity
+ * counters, whatever the vocabulary.
+ * A word that isn't counted yet takes
+ * the place of the smallest counter, and
+ * inherits its count as its error.
+ * The true count of every word in the
+ * summary is in [count - error, count].
+ * ************************************/
+typedef struct{
+    char            word[WORD_MAX];
+    unsigned char   len;
+    long            count;
+    long            error;
+    int             heap_pos;
+} Topk_counter;
+
+typedef struct{
+    Topk_counter*   counters;
+    int             size;
+    int             capacity;
+    int*            heap;       /* Min-heap of counter indices, by count */
+    int*            table;      /* Open addressing, counter indices or -1 */
+    int             table_mask;
+    long            floor;      /* Count a word missing from the summary might have: 0 unless it's full */
+} Topk_summary;
+
+Topk_summary* topk_new(int capacity);
+
+void topk_delete(Topk_summary* summary);
+
+/* A token_sink: counts one occurrence of word */
+void topk_add(const char* word, size_t len, void* user);
+
+/* Merges other into summary, keeping the largest counters */
+void topk_merge(Topk_summary* summary, const Topk_summary* other);
+
+/* Merges every summary into the one of root, up a binomial tree. Collective over comm */
+void topk_reduce(Topk_summary* summary, int root, MPI_Comm comm);
+
+/* Prints the k words with the highest counts, highest first */
+void topk_print(Topk_summary* summary, int k, FILE* output);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "mpi.h"
+
+/**************************************
+ * Per-rank phase tracing, exported as
+ * Chrome trace JSON (chrome://tracing,
+ * ui.perfetto.dev). Every event is a
+ * phase of one rank (pid) and thread
+ * (tid), with its byte count and the
+ * peak memory of the rank when it ended.
+ * Does nothing until trace_init enables it.
+ * ************************************/
+
+/* Collective: ranks leave a barrier together, and that's time 0 for all of them */
+void trace_init(int enabled, MPI_Comm comm);
+
+/* Seconds since time 0, from any thread */
+double trace_now(void);
+
+/* Records a phase that started at start and ends now. detail may be NULL */
+void trace_event(const char* name, const char* detail, double start, long bytes);
+
+/* Same, for a phase running on worker thread tid */
+void trace_thread_event(const char* name, const char* detail, double start, long bytes, int tid);
+
+/* Collective: gathers the events of every rank on root, which writes them to path */
+void trace_write(const char* path, int root, MPI_Comm comm);
+
+#endif
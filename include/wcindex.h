@@ -0,0 +1,71 @@
+#ifndef WCINDEX_H
+#define WCINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hashdict.h"
+
+#define WCINDEX_MAGIC "WCINDEX1"
+/* Written first, then renamed over the index */
+#define WCINDEX_TEMP_SUFFIX ".tmp"
+
+/**************************************
+ * Binary result index, meant to be used
+ * straight from an mmap of the file:
+ *
+ *   Wc_index_header  header
+ *   uint32_t  first[257]       words starting with byte b are ids [first[b], first[b+1])
+ *   uint64_t  offsets[nwords+1]  word id starts at strings + offsets[id]
+ *   int64_t   counts[nwords]
+ *   uint32_t  by_count[nwords]   ids, highest count first, ties by word
+ *   char      strings[]        words back to back, sorted bytewise
+ *
+ * Word ids are ranks in the sorted order,
+ * so lookups are binary searches within
+ * the range of their first byte. Every
+ * section starts 8-byte aligned, all
+ * integers are little endian.
+ * ************************************/
+typedef struct{
+    char        magic[8];
+    uint64_t    nwords;
+    uint64_t    total;              /* Sum of all counts */
+    uint64_t    first_offset;       /* Sections, in bytes from the start of the file */
+    uint64_t    offsets_offset;
+    uint64_t    counts_offset;
+    uint64_t    by_count_offset;
+    uint64_t    strings_offset;
+    uint64_t    strings_size;
+} Wc_index_header;
+
+typedef struct{
+    void*                   map;
+    size_t                  size;
+    const Wc_index_header*  header;
+    const uint32_t*         first;
+    const uint64_t*         offsets;
+    const int64_t*          counts;
+    const uint32_t*         by_count;
+    const char*             strings;
+} Wc_index;
+
+/* Writes the index of dic to file_name, through a temporary file renamed over it. Returns -1 on failure */
+int wc_index_write(struct dictionary* dic, const char* file_name);
+
+/* Maps an index and checks its layout. Returns -1 if it isn't one */
+int wc_index_open(Wc_index* index, const char* file_name);
+
+void wc_index_close(Wc_index* index);
+
+/* Id of word, or -1 */
+long wc_index_find(const Wc_index* index, const char* word, size_t len);
+
+/* Ids of the words starting with prefix are [*first, *first + returned value) */
+size_t wc_index_prefix(const Wc_index* index, const char* prefix, size_t len, size_t* first);
+
+static inline const char* wc_index_word(const Wc_index* index, size_t id, size_t* len){
+    *len = index->offsets[id + 1] - index->offsets[id];
+    return index->strings + index->offsets[id];
+}
+
+#endif
@@ -43,4 +43,25 @@ void print_chunk_vec(Chunk_vector **vector);
 
 void get_workload(Chunk_vector** chunks_proc, int wsize, File_vector** files, size_t total_size, size_t nofiles);
 
+/********************************************
+ * Cuts are the boundaries between the chunk
+ * vectors of two consecutive processes that
+ * fall inside a file: the last chunk of proc
+ * ends where the first one of proc+1 starts.
+ * ******************************************/
+
+int get_cut(Chunk_vector** chunks_proc, int proc, File_chunk** before, File_chunk** after);
+
+int move_cut(Chunk_vector** chunks_proc, int proc, long offset);
+
+void align_workload(Chunk_vector** chunks_proc, int wsize, long alignment);
+
+/********************************************
+ * Tasks, for dynamic scheduling: every file
+ * cut in pieces of (about) task_size bytes,
+ * claimed at run time by whoever is free.
+ * ******************************************/
+
+void get_tasks(Chunk_vector** tasks, File_vector** file_list, long task_size);
+
 #endif
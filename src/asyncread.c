@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "hashdict.h"
+#include "chnkcnt.h"
+#include "gzindex.h"
+#include "workload.h"
+#include "asyncread.h"
+#include "trace.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define ASYNC_URING 1
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+/*********************************************************************************
+ * Asynchronous input backend.
+ * The mapped reader (count_words_chunk) tokenizes while the kernel faults pages in,
+ * and stops whenever readahead falls behind; with a cold cache the CPU sits idle
+ * on every miss, and each chunk only starts being read when the previous one is
+ * done. Here the ranges of the whole chunk vector are cut in blocks of ASYNC_BLOCK
+ * bytes, and ASYNC_DEPTH buffers cycle between the reads and the tokenizer: as
+ * soon as a block has been tokenized its buffer goes back to reading the block
+ * ASYNC_DEPTH places ahead, crossing into the next chunks (and files) as needed.
+ * Blocks are handed out in order, so every chunk still goes through a single
+ * Chunk_stream and its edge words come out exactly as from count_words_chunk.
+ * Reads are submitted to an io_uring, talked to with the raw system calls so
+ * there's nothing to link. Where io_uring_setup fails (old kernels, seccomp) a
+ * reader thread runs the same reads with pread, in order, and where there can be
+ * no thread either (an MPI library without thread support) the consumer reads
+ * every block itself. Either way a failed or short read is completed with pread
+ * by the consumer, so it never gets less than the file has.
+ * *******************************************************************************/
+
+typedef struct{
+    char*           buffer;
+    struct iovec    iov;
+    int             fd;
+    size_t          range;
+    long            offset;
+    size_t          len;
+    ssize_t         result;     /* Bytes read, or -errno, once done */
+    int             done;
+} Read_slot;
+
+#ifdef ASYNC_URING
+typedef struct{
+    int                     fd;
+    void*                   sq_map;
+    void*                   cq_map;
+    size_t                  sq_map_len;
+    size_t                  cq_map_len;
+    struct io_uring_sqe*    sqes;
+    _Atomic unsigned*       sq_head;
+    _Atomic unsigned*       sq_tail;
+    unsigned*               sq_mask;
+    unsigned*               sq_array;
+    _Atomic unsigned*       cq_head;
+    _Atomic unsigned*       cq_tail;
+    unsigned*               cq_mask;
+    struct io_uring_cqe*    cqes;
+} Uring;
+#endif
+
+struct Read_pipeline{
+    const File_chunk*   ranges;
+    size_t              nranges;
+    int*                fds;            /* Per range, -1 until its first read is issued */
+    size_t              next_range;     /* Next block to issue */
+    long                next_offset;
+    size_t              issued;         /* Blocks issued so far, block b goes in slot b % ASYNC_DEPTH */
+    size_t              released;       /* Blocks handed out and given back */
+    int                 held;           /* Whether the caller holds block `released` */
+    Read_slot           slots[ASYNC_DEPTH];
+#ifdef ASYNC_URING
+    Uring               ring;
+#endif
+    int                 uring;
+    int                 threaded;       /* Whether the reader thread runs the reads */
+    pthread_t           reader;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    size_t              read_upto;      /* Blocks read by the reader thread */
+    int                 stop;
+};
+
+static int reader_allowed = 1;
+
+void read_pipeline_allow_thread(int allowed){
+    reader_allowed = allowed;
+}
+
+#ifdef ASYNC_URING
+static int uring_setup(Uring* ring, unsigned entries){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0)
+        return -1;
+
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(ring->cq_map_len > ring->sq_map_len)
+            ring->sq_map_len = ring->cq_map_len;
+        ring->cq_map_len = 0;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_map == MAP_FAILED){
+        close(ring->fd);
+        return -1;
+    }
+    ring->cq_map = ring->sq_map;
+    if(ring->cq_map_len){
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_map == MAP_FAILED){
+            munmap(ring->sq_map, ring->sq_map_len);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED){
+        if(ring->cq_map_len)
+            munmap(ring->cq_map, ring->cq_map_len);
+        munmap(ring->sq_map, ring->sq_map_len);
+        close(ring->fd);
+        return -1;
+    }
+
+    char* sq = ring->sq_map;
+    char* cq = ring->cq_map;
+    ring->sq_head = (_Atomic unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (_Atomic unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (_Atomic unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_teardown(Uring* ring){
+    munmap(ring->sqes, (*ring->sq_mask + 1) * sizeof(struct io_uring_sqe));
+    if(ring->cq_map_len)
+        munmap(ring->cq_map, ring->cq_map_len);
+    munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->fd);
+}
+
+/* Queues a readv of the slot and submits it. Returns -1 if the kernel refused it, and then the entry is gone from the queue */
+static int uring_submit(Uring* ring, Read_slot* slot, unsigned index){
+    unsigned tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    unsigned i = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = slot->fd;
+    sqe->addr = (unsigned long)&slot->iov;
+    sqe->len = 1;
+    sqe->off = slot->offset;
+    sqe->user_data = index;
+    ring->sq_array[i] = i;
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+
+    int submitted;
+    do
+        submitted = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+    while(submitted < 0 && errno == EINTR);
+    if(submitted == 1)
+        return 0;
+
+    // Refused (EAGAIN, EBUSY): left in the queue, the entry would go in with the next submission and complete
+    // into a buffer handed out again since. Unless the kernel took it anyway, and will complete it with an error
+    if(atomic_load_explicit(ring->sq_head, memory_order_acquire) == tail + 1)
+        return 0;
+    atomic_store_explicit(ring->sq_tail, tail, memory_order_release);
+    return -1;
+}
+
+/* Marks every completed read as done, waiting for at least one if wait is set */
+static void uring_reap(Uring* ring, Read_slot* slots, int wait){
+    if(wait){
+        int ret;
+        do
+            ret = syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        while(ret < 0 && errno == EINTR);
+    }
+    unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+    for(; head != tail; head++){
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        slots[cqe->user_data].result = cqe->res;
+        slots[cqe->user_data].done = 1;
+    }
+    atomic_store_explicit(ring->cq_head, head, memory_order_release);
+}
+#endif
+
+/* Reads the blocks issued to the reader thread, in order */
+static void* read_blocks(void* arg){
+    Read_pipeline* rp = arg;
+    pthread_mutex_lock(&rp->lock);
+    while(!rp->stop){
+        if(rp->read_upto == rp->issued){
+            pthread_cond_wait(&rp->cond, &rp->lock);
+            continue;
+        }
+        Read_slot* slot = &rp->slots[rp->read_upto % ASYNC_DEPTH];
+        pthread_mutex_unlock(&rp->lock);
+        ssize_t result = pread(slot->fd, slot->buffer, slot->len, slot->offset);
+        pthread_mutex_lock(&rp->lock);
+        slot->result = result < 0 ? -errno : result;
+        slot->done = 1;
+        rp->read_upto++;
+        pthread_cond_broadcast(&rp->cond);
+    }
+    pthread_mutex_unlock(&rp->lock);
+    return NULL;
+}
+
+/* Starts reading blocks until every buffer is busy or there's nothing left to read */
+static void issue_blocks(Read_pipeline* rp){
+    while(rp->issued - rp->released < ASYNC_DEPTH){
+        while(rp->next_range < rp->nranges && rp->next_offset >= rp->ranges[rp->next_range].end){
+            rp->next_range++;
+            if(rp->next_range < rp->nranges)
+                rp->next_offset = rp->ranges[rp->next_range].start;
+        }
+        if(rp->next_range == rp->nranges)
+            return;
+
+        const File_chunk* range = &rp->ranges[rp->next_range];
+        if(rp->fds[rp->next_range] < 0){
+            rp->fds[rp->next_range] = open(range->file_name, O_RDONLY);
+            if(rp->fds[rp->next_range] < 0){
+                fprintf(stderr, "\nUnable to open file %s.\n", range->file_name);
+                fprintf(stderr, "Please check if file exists and you have read privilege.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        unsigned index = rp->issued % ASYNC_DEPTH;
+        Read_slot* slot = &rp->slots[index];
+        slot->fd = rp->fds[rp->next_range];
+        slot->range = rp->next_range;
+        slot->offset = rp->next_offset;
+        slot->len = range->end - rp->next_offset < ASYNC_BLOCK ? (size_t)(range->end - rp->next_offset) : ASYNC_BLOCK;
+        slot->iov.iov_base = slot->buffer;
+        slot->iov.iov_len = slot->len;
+        slot->result = 0;
+        slot->done = 0;
+        rp->next_offset += slot->len;
+
+#ifdef ASYNC_URING
+        if(rp->uring){
+            // Left to the consumer, who'll read it with pread
+            if(uring_submit(&rp->ring, slot, index))
+                slot->done = 1;
+            rp->issued++;
+            continue;
+        }
+#endif
+        if(!rp->threaded){
+            // Nobody to read it ahead: the consumer reads it when it gets there
+            slot->done = 1;
+            rp->issued++;
+            continue;
+        }
+        pthread_mutex_lock(&rp->lock);
+        rp->issued++;
+        pthread_cond_signal(&rp->cond);
+        pthread_mutex_unlock(&rp->lock);
+    }
+}
+
+static void wait_block(Read_pipeline* rp, Read_slot* slot){
+#ifdef ASYNC_URING
+    if(rp->uring){
+        uring_reap(&rp->ring, rp->slots, 0);
+        while(!slot->done)
+            uring_reap(&rp->ring, rp->slots, 1);
+        return;
+    }
+#endif
+    if(!rp->threaded)
+        return;
+    pthread_mutex_lock(&rp->lock);
+    while(!slot->done)
+        pthread_cond_wait(&rp->cond, &rp->lock);
+    pthread_mutex_unlock(&rp->lock);
+}
+
+Read_pipeline* read_pipeline_open(const File_chunk* ranges, size_t nranges){
+    Read_pipeline* rp = malloc(sizeof(*rp));
+    rp->ranges = ranges;
+    rp->nranges = nranges;
+    rp->fds = malloc(sizeof(*rp->fds) * (nranges ? nranges : 1));
+    for(size_t i = 0; i < nranges; i++)
+        rp->fds[i] = -1;
+    rp->next_range = 0;
+    rp->next_offset = nranges ? ranges[0].start : 0;
+    rp->issued = rp->released = 0;
+    rp->held = 0;
+    rp->read_upto = 0;
+    rp->stop = 0;
+    for(int i = 0; i < ASYNC_DEPTH; i++)
+        rp->slots[i].buffer = malloc(sizeof(*rp->slots[i].buffer) * ASYNC_BLOCK);
+
+    rp->uring = 0;
+#ifdef ASYNC_URING
+    rp->uring = !uring_setup(&rp->ring, ASYNC_DEPTH);
+#endif
+    rp->threaded = !rp->uring && reader_allowed;
+    if(rp->threaded){
+        pthread_mutex_init(&rp->lock, NULL);
+        pthread_cond_init(&rp->cond, NULL);
+        pthread_create(&rp->reader, NULL, read_blocks, rp);
+    }
+
+    issue_blocks(rp);
+    return rp;
+}
+
+int read_pipeline_next(Read_pipeline* rp, const char** buffer, size_t* len, size_t* range){
+    if(rp->held){
+        // Giving the buffer back, and the file too once its range has been read to the end
+        Read_slot* slot = &rp->slots[rp->released % ASYNC_DEPTH];
+        if(slot->offset + (long)slot->len == rp->ranges[slot->range].end){
+            close(rp->fds[slot->range]);
+            rp->fds[slot->range] = -1;
+        }
+        rp->released++;
+        rp->held = 0;
+        issue_blocks(rp);
+    }
+    if(rp->released == rp->issued)
+        return 0;
+
+    Read_slot* slot = &rp->slots[rp->released % ASYNC_DEPTH];
+    if(!slot->done){
+        double start = trace_now();
+        wait_block(rp, slot);
+        trace_event("read wait", rp->ranges[slot->range].file_name, start, slot->len);
+    }
+
+    // Completing a failed or short read by hand
+    size_t got = slot->result > 0 ? (size_t)slot->result : 0;
+    while(got < slot->len){
+        ssize_t bytesread = pread(slot->fd, slot->buffer + got, slot->len - got, slot->offset + got);
+        if(bytesread <= 0)
+            break;
+        got += bytesread;
+    }
+
+    *buffer = slot->buffer;
+    *len = got;
+    *range = slot->range;
+    rp->held = 1;
+    return 1;
+}
+
+void read_pipeline_close(Read_pipeline* rp){
+    // Reads still in flight have to land before their buffers go away
+    for(size_t b = rp->released; b < rp->issued; b++)
+        wait_block(rp, &rp->slots[b % ASYNC_DEPTH]);
+#ifdef ASYNC_URING
+    if(rp->uring)
+        uring_teardown(&rp->ring);
+#endif
+    if(rp->threaded){
+        pthread_mutex_lock(&rp->lock);
+        rp->stop = 1;
+        pthread_cond_signal(&rp->cond);
+        pthread_mutex_unlock(&rp->lock);
+        pthread_join(rp->reader, NULL);
+        pthread_mutex_destroy(&rp->lock);
+        pthread_cond_destroy(&rp->cond);
+    }
+    for(size_t i = 0; i < rp->nranges; i++)
+        if(rp->fds[i] >= 0)
+            close(rp->fds[i]);
+    for(int i = 0; i < ASYNC_DEPTH; i++)
+        free(rp->slots[i].buffer);
+    free(rp->fds);
+    free(rp);
+}
+
+void count_chunk_vector_async(Chunk_vector* chunks, struct dictionary* dic){
+    if(!chunks)
+        return;
+
+    // Compressed chunks are inflated as usual, the others go through the pipeline
+    File_chunk* ranges = malloc(sizeof(*ranges) * (chunks->size ? chunks->size : 1));
+    size_t nranges = 0;
+    for(size_t i = 0; i < chunks->size; i++){
+        File_chunk* chunk = &chunks->chunks[i];
+        if(gz_is_compressed(chunk->file_name)){
+            char* first_word = NULL;
+            double start = trace_now();
+            free(count_words_chunk(chunk->file_name, chunk->start, chunk->end, dic, &first_word));
+            free(first_word);
+            trace_event("count", chunk->file_name, start, chunk->end - chunk->start);
+        }
+        else if(chunk->end > chunk->start)
+            ranges[nranges++] = *chunk;
+    }
+
+    Read_pipeline* rp = read_pipeline_open(ranges, nranges);
+    Chunk_stream cs;
+    size_t current = nranges;
+    double start = 0;
+    const char* buffer;
+    size_t len, range;
+    while(read_pipeline_next(rp, &buffer, &len, &range)){
+        if(range != current){
+            // Edge words are taken care of by the boundary exchange, like with count_words_chunk
+            if(current < nranges){
+                char* first_word = NULL;
+                free(chunk_stream_end(&cs, &first_word));
+                free(first_word);
+                trace_event("count", ranges[current].file_name, start, ranges[current].end - ranges[current].start);
+            }
+            current = range;
+            start = trace_now();
+            chunk_stream_init(&cs, dic);
+        }
+        chunk_stream_feed(&cs, buffer, len);
+    }
+    if(current < nranges){
+        char* first_word = NULL;
+        free(chunk_stream_end(&cs, &first_word));
+        free(first_word);
+        trace_event("count", ranges[current].file_name, start, ranges[current].end - ranges[current].start);
+    }
+
+    read_pipeline_close(rp);
+    free(ranges);
+}
@@ -1,78 +1,260 @@
-#include <ctype.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "hashdict.h"
 #include "chnkcnt.h"
+#include "tokenize.h"
+#include "gzindex.h"
 #include "mpi.h"
 
-char* count_words(char* buffer, struct dictionary* dic, size_t* lwlen){
-    char current_word[WORD_MAX];
-    size_t i = 0;
-    while(*buffer){
-        i = 0;
-        while(isalnum(*buffer)){
-            current_word[i] = tolower(*buffer);
-            i++;
-            buffer++;
-        }
+static void count_token(const char* word, size_t len, void* user){
+    struct dictionary* dic = user;
+    if(dic_find(dic, (void*)word, len))
+        *dic->value = *dic->value + 1;
+    else {
+        dic_add(dic, (void*)word, len);
+        *dic->value = 1;
+    }
+}
 
-        current_word[i] = '\0';
+/* pread, on the uncompressed stream for compressed input */
+static ssize_t read_at(const char* file_name, int fd, void* buffer, size_t len, long offset){
+    if(gz_is_compressed(file_name))
+        return gz_pread(file_name, buffer, len, offset);
+    return pread(fd, buffer, len, offset);
+}
 
-        if(i != 0 && dic_find(dic, current_word, i))
-            *dic->value = *dic->value + 1;
-        
-        else if(i != 0){
-            dic_add(dic, current_word, i);
-            *dic->value = 1;
-        }
-        if(!*buffer)
+long find_word_boundary(const char* file_name, long offset, long end){
+    char window[BOUNDARY_WINDOW];
+    int fd = open(file_name, O_RDONLY);
+    if(fd < 0)
+        return -1;
+
+    long boundary = -1;
+    size_t len = end - offset > BOUNDARY_WINDOW ? BOUNDARY_WINDOW : end - offset;
+    ssize_t bytesread = read_at(file_name, fd, window, len, offset);
+    for(ssize_t i = 0; i < bytesread; i++){
+        if(!tok_isword(window[i])){
+            boundary = offset + i;
             break;
+        }
+    }
+
+    close(fd);
+    return boundary;
+}
 
-        buffer++;
+/* End of the word offset falls in, or limit if the word runs until there. With TOK_UTF8 a run of word bytes can hold
+   any number of words, and the word ends at the first character that isn't a letter */
+static long skip_word(const char* file_name, int fd, long offset, long limit){
+    char window[BOUNDARY_WINDOW];
+    while(offset < limit){
+        long len = limit - offset > BOUNDARY_WINDOW ? BOUNDARY_WINDOW : limit - offset;
+        ssize_t bytesread = read_at(file_name, fd, window, len, offset);
+        if(bytesread <= 0)
+            return limit;
+        int open;
+        size_t head = tokenize_word_head(window, bytesread, &open);
+        if(!open)
+            return offset + head;
+        if(!head)
+            return limit;
+        offset += head;
     }
-    // Go back! If the buffer ended with a character there's a high chance the last word is truncated
-    // So we need to return it. In this way the caller can use his knowledge of the next buffer
-    // to understand if the last word is truncated (it will be then merged with the first character of the next buffer)
-    buffer--;
-    char* return_word = NULL;
+    return limit;
+}
 
-    if(isalnum(*buffer)){
-        return_word = strdup(current_word);
-        *lwlen = i;
+void own_words(File_chunk* chunk){
+    int fd = open(chunk->file_name, O_RDONLY);
+    struct stat file_status;
+    if(fd < 0 || fstat(fd, &file_status) < 0){
+        if(fd >= 0)
+            close(fd);
+        return;
     }
 
-    return return_word;
+    char edge[2];
+    long size = gz_is_compressed(chunk->file_name) ? gz_length(chunk->file_name) : file_status.st_size;
+    if(chunk->start > 0 && read_at(chunk->file_name, fd, edge, 2, chunk->start - 1) == 2 && tok_isword(edge[0]) && tok_isword(edge[1]))
+        chunk->start = skip_word(chunk->file_name, fd, chunk->start, chunk->end);
+    if(chunk->end > chunk->start && chunk->end < size && read_at(chunk->file_name, fd, edge, 2, chunk->end - 1) == 2 && tok_isword(edge[0]) && tok_isword(edge[1]))
+        chunk->end = skip_word(chunk->file_name, fd, chunk->end, size);
+
+    close(fd);
 }
 
-char* recover_missing_word(char* buffer, char* previous_portion, size_t lwlen, size_t* b4_space){
-        char* spacer = buffer;
+long find_nearest_boundary(const char* file_name, long offset, long lo, long hi){
+    char window[BOUNDARY_WINDOW];
+    long from = offset - BOUNDARY_WINDOW / 2 > lo ? offset - BOUNDARY_WINDOW / 2 : lo + 1;
+    long to = offset + BOUNDARY_WINDOW / 2 < hi ? offset + BOUNDARY_WINDOW / 2 : hi;
+    if(from >= to)
+        return -1;
+
+    int fd = open(file_name, O_RDONLY);
+    if(fd < 0)
+        return -1;
+    ssize_t bytesread = read_at(file_name, fd, window, to - from, from);
+    close(fd);
+
+    // Looking on both sides of offset at the same time, the first non-word byte found is the nearest
+    long pos = offset - from;
+    for(long d = 0; d < bytesread; d++){
+        if(pos + d < bytesread && !tok_isword(window[pos + d]))
+            return from + pos + d;
+        if(pos - d >= 0 && pos - d < bytesread && !tok_isword(window[pos - d]))
+            return from + pos - d;
+        if(pos + d >= bytesread && pos - d < 0)
+            break;
+    }
+    return -1;
+}
 
-        while(isalnum(*spacer)){
-            *spacer = tolower(*spacer);
-            *b4_space = *b4_space + 1;
-            spacer++;
-        }
+/*********************************************************************************
+ * Moves every cut between two processes to the nearest non-word byte, so no word
+ * is split between two processes and there's nothing to synchronize afterwards.
+ * Each process only looks at the cut at the end of its own chunk vector, reading
+ * a small window around it, and the new offsets are then shared with everyone.
+ * needs_sync[p] is set if the cut between p and p+1 still has to be synchronized:
+ * either there was no non-word byte around it (a word longer than half the window)
+ * or moving it would have emptied a chunk.
+ * *******************************************************************************/
+void align_cuts_to_words(Chunk_vector** chunks_proc, int rank, int wsize, char* needs_sync, MPI_Comm comm){
+    long* cuts = malloc(sizeof(*cuts) * wsize);
+    long my_cut = -1;
+    File_chunk *before, *after;
+
+    if(rank < wsize - 1 && get_cut(chunks_proc, rank, &before, &after))
+        my_cut = find_nearest_boundary(before->file_name, before->end, before->start, after->end);
+
+    MPI_Allgather(&my_cut, 1, MPI_LONG, cuts, 1, MPI_LONG, comm);
+
+    for(int p = 0; p < wsize; p++){
+        needs_sync[p] = 0;
+        if(p < wsize - 1 && get_cut(chunks_proc, p, &before, &after))
+            needs_sync[p] = cuts[p] < 0 || move_cut(chunks_proc, p, cuts[p]);
+    }
+    free(cuts);
+}
 
-        char* missing_word = malloc(sizeof(*missing_word) * (lwlen + *b4_space + 1));
-        memcpy(missing_word, previous_portion, lwlen);
-        memcpy(missing_word+lwlen, buffer, *b4_space);
-        missing_word[lwlen + *b4_space] = '\0';
+/* Copies the first len bytes of word, lowercased, in a new heap string.
+    Words are clamped to WORD_MAX-1 characters, which is also the longest key the dictionary can hold. */
+static char* dup_lower(const char* word, size_t len){
+    if(len >= WORD_MAX)
+        len = WORD_MAX - 1;
+    char* copy = malloc(sizeof(*copy) * (len + 1));
+    for(size_t i = 0; i < len; i++)
+        copy[i] = tok_lower(word[i]);
+    copy[len] = '\0';
+    return copy;
+}
 
-        return missing_word;
+static void count_chunk_token(const char* word, size_t len, void* user){
+    Chunk_stream* cs = user;
+    if(cs->want_first){
+        cs->first_word = dup_lower(word, len);
+        cs->want_first = 0;
+    }
+    count_token(word, len, cs->dic);
 }
 
-char* get_if_first_word(char* buffer){
-    char first_word_buf[256];
-    size_t len = 0;
-    while(*buffer && isalnum(*buffer)){
-        first_word_buf[len] = tolower(*buffer);
-        len++;
-        buffer++;
+void chunk_stream_init(Chunk_stream* cs, struct dictionary* dic){
+    cs->dic = dic;
+    cs->first_word = NULL;
+    cs->started = 0;
+    cs->want_first = 0;
+    tokenize_stream_init(&cs->stream);
+}
+
+void chunk_stream_feed(Chunk_stream* cs, const char* buffer, size_t len){
+    if(!len)
+        return;
+    if(!cs->started){
+        /* If the chunk starts with a word, the first token we emit is its (possibly partial) first word */
+        cs->started = 1;
+        cs->want_first = tok_isword(buffer[0]);
     }
-    first_word_buf[len] = '\0';
-    return len ? strdup(first_word_buf) : NULL;
+    tokenize_stream(&cs->stream, buffer, len, count_chunk_token, cs);
+}
+
+char* chunk_stream_end(Chunk_stream* cs, char** first_word){
+    /* If the chunk ends with a word, it's still being carried by the tokenizer */
+    char* last_word = cs->stream.in_word ? dup_lower(cs->stream.carry, cs->stream.carry_len) : NULL;
+    tokenize_stream_end(&cs->stream, count_chunk_token, cs);
+    *first_word = cs->first_word;
+    return last_word;
+}
+
+void count_words_span(const char* buffer, size_t len, struct dictionary* dic){
+    tokenize_span(buffer, len, count_token, dic);
+}
+
+/* Maps [start, end) of the file and counts it in a single pass. Since the whole chunk is visible at once,
+    there's no need to repair words across block edges: the only partial words left are the ones on the
+    chunk's edges, which get returned (first_word and return value) for the synchronization with the neighbours.
+    Returns -1 if the chunk couldn't be mapped, so the caller can fall back to the buffered reader. */
+static int count_words_mapped(int fd, long start, long end, struct dictionary* dic, char** first_word, char** last_word){
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    long map_start = start - (start % page_size);   /* mmap offsets must be page aligned */
+    size_t map_len = end - map_start;
+    char* map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, map_start);
+    if(map == MAP_FAILED)
+        return -1;
+
+    /* We're going to read it once, front to back: ask for aggressive readahead and early page release */
+    madvise(map, map_len, MADV_SEQUENTIAL);
+    madvise(map, map_len, MADV_WILLNEED);
+
+    const char* chunk = map + (start - map_start);
+    size_t chnk_sz = end - start;
+
+    size_t fw_len = 0;
+    while(fw_len < chnk_sz && tok_isword(chunk[fw_len]))
+        fw_len++;
+    *first_word = fw_len ? dup_lower(chunk, fw_len) : NULL;
+
+    size_t lw_len = 0;
+    while(lw_len < chnk_sz && tok_isword(chunk[chnk_sz - lw_len - 1]))
+        lw_len++;
+    *last_word = lw_len ? dup_lower(chunk + chnk_sz - lw_len, lw_len) : NULL;
+
+    count_words_span(chunk, chnk_sz, dic);
+
+    munmap(map, map_len);
+    return 0;
+}
+
+static void feed_chunk_stream(const char* buffer, size_t len, void* user){
+    chunk_stream_feed(user, buffer, len);
 }
 
 char* count_words_chunk(char* file_name, long start, long end, struct dictionary* dic, char** first_word){
+    *first_word = NULL;
+    if(end <= start)
+        return NULL;
+
+    /* Compressed input can't be mapped: it's inflated from the checkpoint before start, block by block */
+    if(gz_is_compressed(file_name)){
+        Chunk_stream cs;
+        chunk_stream_init(&cs, dic);
+        if(gz_stream(file_name, start, end, feed_chunk_stream, &cs)){
+            fprintf(stderr, "\nUnable to read %s as gzip.\n", file_name);
+            exit(EXIT_FAILURE);
+        }
+        return chunk_stream_end(&cs, first_word);
+    }
+
+    int fd = open(file_name, O_RDONLY);
+    if(fd >= 0){
+        char* last_word = NULL;
+        int mapped = count_words_mapped(fd, start, end, dic, first_word, &last_word);
+        close(fd);
+        if(!mapped)
+            return last_word;
+    }
+
     FILE * file;
     file = fopen(file_name, "r");
 
@@ -85,123 +267,170 @@ char* count_words_chunk(char* file_name, long start, long end, struct dictionary
         exit(EXIT_FAILURE);
     }
     long chnk_sz = end - start;     /* Size of the current chunk */
-    size_t bytes2read = BLOCKSIZE > chnk_sz ? chnk_sz: BLOCKSIZE; /* How many bytes we have to read for each iteration */
     size_t bytesread;               /* How many characters we actually read for each iteration */
     long total_bytes_read = 0;      /* How many characters we've read so far */
-    char buffer[bytes2read+1];      /* Where we store what we read in each iteration */
+    char buffer[BLOCKSIZE];         /* Where we store what we read in each iteration */
+    Chunk_stream cs;
 
     fseek(file, start, SEEK_SET);   /* Positioning the cursor at the start of the interval */
+    chunk_stream_init(&cs, dic);
 
-    char* last_word = NULL;         /* The last word in the previous block */
-    size_t lwlen = 0;               /* The length of the previous word, in order to avoid calling strlen needlessly */
-    size_t b4_space;                /* How many characters before the first space in the current block */
-    int i = 0;
-
-    while(total_bytes_read < chnk_sz && (bytesread = fread (buffer, sizeof(char), bytes2read, file))){
-        b4_space = 0;
-        /* We are updating total_bytes inside the iteration because it could happen that, for example, we have read
-            n-x bytes, where n is basically the chunk size, up to this point. We then read y bytes, with y > x.
-            We have surpassed the limit of the chunk, but interrupting the cycle would make us lose x bytes. */
+    while(total_bytes_read < chnk_sz && (bytesread = fread(buffer, sizeof(char), BLOCKSIZE, file))){
+        /* The last block may go past the end of the chunk */
+        if(total_bytes_read + (long)bytesread > chnk_sz)
+            bytesread = chnk_sz - total_bytes_read;
         total_bytes_read += bytesread;
-        if(total_bytes_read > chnk_sz){
-            bytesread -= (total_bytes_read - chnk_sz);
-            total_bytes_read = chnk_sz;
-        }
-        buffer[bytesread] = '\0';
+        chunk_stream_feed(&cs, buffer, bytesread);
+    }
 
-        if(i==0){
-            *first_word = get_if_first_word(buffer);
-        }
-        i++;
-
-        /* Basically if the previous block ended with a word, there's a chance that word could continue at the beginning
-            of this block. In that case we merge the two words and remove the occurence of the partial word discoverd earlier. */
-        if(last_word && isalnum(buffer[0])){
-            char* missing_word = recover_missing_word(buffer, last_word, lwlen, &b4_space);
-
-            if(dic_find(dic, missing_word, lwlen+b4_space))
-                *dic->value = *dic->value + 1;
-        
-            else {
-                dic_add(dic, missing_word, lwlen+b4_space);
-                *dic->value = 1;
-            }
-
-            dic_find(dic, last_word, lwlen);
-            if(*dic->value > 0)
-                *dic->value = *dic->value - 1;
-            else
-                *dic->value = 0;
-
-            free(last_word);
+    fclose(file);
+    return chunk_stream_end(&cs, first_word);
+}
+
+typedef struct{
+    Token_stream    stream;
+    token_sink      sink;
+    void*           user;
+} Token_feed;
+
+static void feed_token_stream(const char* buffer, size_t len, void* user){
+    Token_feed* feed = user;
+    tokenize_stream(&feed->stream, buffer, len, feed->sink, feed->user);
+}
+
+void tokenize_chunk(const char* file_name, long start, long end, token_sink sink, void* user){
+    if(end <= start)
+        return;
+
+    if(gz_is_compressed(file_name)){
+        Token_feed feed = { .sink = sink, .user = user };
+        tokenize_stream_init(&feed.stream);
+        if(gz_stream(file_name, start, end, feed_token_stream, &feed)){
+            fprintf(stderr, "\nUnable to read %s as gzip.\n", file_name);
+            exit(EXIT_FAILURE);
         }
+        tokenize_stream_end(&feed.stream, sink, user);
+        return;
+    }
 
-        last_word = count_words(buffer+b4_space, dic, &lwlen);
+    int fd = open(file_name, O_RDONLY);
+    if(fd < 0){
+        fprintf(stderr, "\nUnable to open file %s.\n", file_name);
+        exit(EXIT_FAILURE);
     }
-    
-    fclose(file);
-    return isalnum(buffer[bytesread-1]) ? last_word : NULL;
-}
-
-void sync_with_next(char* last_word, int rank, struct dictionary* dic, MPI_Comm comm){
-    MPI_Status status;
-    char fw_recv[256];
-    long lw_len = -1;
-    if(last_word)
-        lw_len = strlen(last_word);
-    long fw_len;
-    int response = 1;
-
-    MPI_Recv(&fw_len, 1, MPI_LONG, rank+1, 0, comm, &status);
-    if(fw_len){
-        MPI_Recv(fw_recv, fw_len+1, MPI_CHAR, rank+1, 0, comm, &status);
-        if(last_word){
-            char* missing_word = malloc(sizeof(*missing_word)*(lw_len+fw_len+1));
-            memcpy(missing_word, last_word, lw_len);
-            memcpy(missing_word+lw_len, fw_recv, fw_len);
-            missing_word[fw_len+lw_len] = '\0';
-
-            // Make it a function so it's less verbose. It's practically everywhere @todo
-            if(dic_find(dic, missing_word, fw_len+lw_len))
-                *dic->value = *dic->value + 1;
-            else {
-                dic_add(dic, missing_word, fw_len+lw_len);
-                *dic->value = 1;
-            }
-
-            // Eliminating last word
-            dic_find(dic, last_word, lw_len);
-            *dic->value = *dic->value -1;
-
-            response = 0;
-            // Signaling next one
-            MPI_Send(&response, 1, MPI_INT, rank+1, 0, comm);
-
-            free(missing_word);
-        }
-        else {
-            MPI_Send(&response, 1, MPI_INT, rank+1, 0, comm);
-        }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    long map_start = start - (start % page_size);
+    size_t map_len = end - map_start;
+    char* map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, map_start);
+    if(map != MAP_FAILED){
+        madvise(map, map_len, MADV_SEQUENTIAL);
+        tokenize_span(map + (start - map_start), end - start, sink, user);
+        munmap(map, map_len);
+        close(fd);
+        return;
     }
-    else {
-        MPI_Send(&response, 1, MPI_INT, rank+1, 0, comm);
+
+    /* Same fallback as count_words_chunk: blocks, with the tokenizer carrying words across them */
+    char buffer[BLOCKSIZE];
+    Token_stream stream;
+    tokenize_stream_init(&stream);
+    for(long offset = start; offset < end; ){
+        ssize_t bytesread = pread(fd, buffer, end - offset > BLOCKSIZE ? BLOCKSIZE : end - offset, offset);
+        if(bytesread <= 0)
+            break;
+        tokenize_stream(&stream, buffer, bytesread, sink, user);
+        offset += bytesread;
     }
+    tokenize_stream_end(&stream, sink, user);
+    close(fd);
 }
 
-void sync_with_prev(char* fw_word, int rank, struct dictionary* dic, MPI_Comm comm){
-    MPI_Status status;
-    long fw_len = fw_word ? strlen(fw_word): 0;
-    int response = 1;
+void read_chunk_edges(const char* file_name, long start, long end, char* first_word, char* last_word){
+    char window[BOUNDARY_WINDOW];
+    first_word[0] = last_word[0] = '\0';
+
+    int fd = open(file_name, O_RDONLY);
+    if(fd < 0)
+        return;
 
-    MPI_Send(&fw_len, 1, MPI_LONG, rank-1, 0, comm); // Send to the previous in line your first word.
-    if(fw_len)
-        MPI_Send(fw_word, fw_len+1, MPI_CHAR, rank-1, 0, comm);
+    // First word: the piece of word the chunk starts with
+    long len = end - start < BOUNDARY_WINDOW ? end - start : BOUNDARY_WINDOW;
+    ssize_t bytesread = read_at(file_name, fd, window, len, start);
+    first_word[bytesread > 0 ? tokenize_edge_head(window, bytesread, first_word) : 0] = '\0';
 
-    MPI_Recv(&response, 1, MPI_INT, rank-1, 0, comm, &status);
+    // Last word: the piece of word the chunk ends with. What got counted is its head, so that's what we keep
+    bytesread = read_at(file_name, fd, window, len, end - len);
+    last_word[bytesread > 0 ? tokenize_edge_tail(window, bytesread, last_word) : 0] = '\0';
 
-    if(!response){
-        dic_find(dic, fw_word, fw_len);
-        *dic->value = *dic->value -1;
+    close(fd);
+}
+
+/*********************************************************************************
+ * Boundary exchange with the neighbouring processes.
+ * The words on the edges of the chunk vector are known before counting starts
+ * (read_chunk_edges only reads a few bytes on each side), so they're posted right
+ * away with MPI_Isend/MPI_Irecv and the exchange completes while we count.
+ * Both neighbours send each other their edge word, so each side can decide alone:
+ * when the previous process ends with a word and the next one starts with one,
+ * the word was split. The previous process then counts the whole word and drops
+ * its partial last word, while the next one drops its partial first word.
+ * One message each way per cut, no replies, and nobody waits for anybody before
+ * counting: there's no chain running through the processes anymore.
+ * *******************************************************************************/
+void boundary_post(Boundary_exchange* bx, Chunk_vector* chunks, int rank, int sync_prev, int sync_next, MPI_Comm comm){
+    bx->with_prev = bx->with_next = 0;
+    for(int r = 0; r < 4; r++)
+        bx->requests[r] = MPI_REQUEST_NULL;
+    if(!chunks || !chunks->size)
+        return;
+
+    File_chunk* head = &chunks->chunks[0];
+    File_chunk* tail = &chunks->chunks[chunks->size - 1];
+    bx->with_prev = sync_prev && (head->special_position == LAST || head->special_position == REGULAR);
+    bx->with_next = sync_next && (tail->special_position == FIRST || tail->special_position == REGULAR);
+
+    if(bx->with_prev){
+        char unused[TOKEN_EDGE];
+        read_chunk_edges(head->file_name, head->start, head->end, bx->first_word, head == tail ? bx->last_word : unused);
+        MPI_Isend(bx->first_word, strlen(bx->first_word) + 1, MPI_CHAR, rank - 1, BOUNDARY_TAG, comm, &bx->requests[0]);
+        MPI_Irecv(bx->prev_last, TOKEN_EDGE, MPI_CHAR, rank - 1, BOUNDARY_TAG, comm, &bx->requests[1]);
+    }
+    if(bx->with_next){
+        char unused[TOKEN_EDGE];
+        if(!(bx->with_prev && head == tail))
+            read_chunk_edges(tail->file_name, tail->start, tail->end, unused, bx->last_word);
+        MPI_Isend(bx->last_word, strlen(bx->last_word) + 1, MPI_CHAR, rank + 1, BOUNDARY_TAG, comm, &bx->requests[2]);
+        MPI_Irecv(bx->next_first, TOKEN_EDGE, MPI_CHAR, rank + 1, BOUNDARY_TAG, comm, &bx->requests[3]);
     }
 }
 
+static void drop_token(const char* word, size_t len, void* user){
+    struct dictionary* dic = user;
+    if(dic_find(dic, (void*)word, len) && *dic->value > 0)
+        *dic->value = *dic->value - 1;
+}
+
+/* With TOK_UTF8 an edge piece can be the two halves of a multibyte character with no word in between, so what was
+   counted for it is whatever the tokenizer makes of it */
+static void drop_word(struct dictionary* dic, char* word){
+    tokenize_span(word, strlen(word), drop_token, dic);
+}
+
+void boundary_complete(Boundary_exchange* bx, struct dictionary* dic){
+    MPI_Waitall(4, bx->requests, MPI_STATUSES_IGNORE);
+
+    if(bx->with_prev && bx->prev_last[0] && bx->first_word[0])
+        drop_word(dic, bx->first_word);
+
+    if(bx->with_next && bx->last_word[0] && bx->next_first[0]){
+        // Clamped by the tokenizer: cutting the raw bytes here could split a character
+        size_t lw_len = strlen(bx->last_word);
+        size_t fw_len = strlen(bx->next_first);
+        char missing_word[2 * TOKEN_EDGE];
+        memcpy(missing_word, bx->last_word, lw_len);
+        memcpy(missing_word + lw_len, bx->next_first, fw_len);
+        tokenize_span(missing_word, lw_len + fw_len, count_token, dic);
+        drop_word(dic, bx->last_word);
+    }
+}
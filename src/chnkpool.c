@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "hashdict.h"
+#include "chnkcnt.h"
+#include "histogram.h"
+#include "chnkpool.h"
+#include "trace.h"
+
+/*********************************************************************************
+ * Counting the chunk vector of a process with a pool of threads.
+ * Chunks are split in pieces, each thread claims the next piece with an atomic
+ * counter and counts it in a dictionary of its own, so threads never contend on
+ * anything but that counter. Dictionaries are merged once all pieces are done.
+ * Pieces are only ever cut at a non-word byte (see find_word_boundary), so no word
+ * straddles two pieces and there's nothing to repair between them. The only
+ * partial words left are the ones on the edges of the chunks, exactly as with a
+ * single thread, and those are handled by the boundary exchange (boundary_post).
+ * *******************************************************************************/
+
+typedef struct{
+    Chunk_piece*    pieces;
+    size_t          npieces;
+    atomic_size_t   next;
+} Piece_queue;
+
+typedef struct{
+    Piece_queue*        queue;
+    struct dictionary*  dic;
+    int                 index;
+    pthread_t           thread;
+} Worker;
+
+static int piece_push_back(Chunk_piece** pieces, size_t* size, char* file_name, long start, long end, size_t chunk){
+    size_t x = *size, y = x + 1;
+    if((x & y) == 0){
+        void *temp = realloc(*pieces, (x + y) * sizeof **pieces);
+        if (!temp) {return 1; }
+        *pieces = temp;
+    }
+    (*pieces)[x].file_name = file_name;
+    (*pieces)[x].start = start;
+    (*pieces)[x].end = end;
+    (*pieces)[x].chunk = chunk;
+    *size = y;
+    return 0;
+}
+
+/* Splits every chunk in pieces of roughly piece_size bytes, moving each cut forward to the next non-word byte */
+static size_t split_chunks(Chunk_vector* chunks, long piece_size, Chunk_piece** pieces){
+    size_t npieces = 0;
+    for(size_t i = 0; i < chunks->size; i++){
+        File_chunk* chunk = &chunks->chunks[i];
+        long start = chunk->start;
+
+        while(chunk->end - start > piece_size + piece_size / 2){
+            long cut = find_word_boundary(chunk->file_name, start + piece_size, chunk->end);
+            if(cut < 0 || cut >= chunk->end)
+                break;
+            piece_push_back(pieces, &npieces, chunk->file_name, start, cut, i);
+            start = cut;
+        }
+        piece_push_back(pieces, &npieces, chunk->file_name, start, chunk->end, i);
+    }
+    return npieces;
+}
+
+static void* count_pieces(void* arg){
+    Worker* worker = arg;
+    Piece_queue* queue = worker->queue;
+    size_t i;
+
+    while((i = atomic_fetch_add(&queue->next, 1)) < queue->npieces){
+        Chunk_piece* piece = &queue->pieces[i];
+        char* first_word = NULL;
+        double start = trace_now();
+        free(count_words_chunk(piece->file_name, piece->start, piece->end, worker->dic, &first_word));
+        free(first_word);
+        trace_thread_event("count", piece->file_name, start, piece->end - piece->start, worker->index);
+    }
+    return NULL;
+}
+
+void count_chunk_vector(Chunk_vector* chunks, int nthreads, struct dictionary* dic){
+    Piece_queue queue;
+    queue.pieces = NULL;
+    queue.npieces = 0;
+    atomic_init(&queue.next, 0);
+
+    if(nthreads > 1){
+        long total = 0;
+        for(size_t i = 0; i < chunks->size; i++)
+            total += chunks->chunks[i].end - chunks->chunks[i].start;
+        long piece_size = total / ((long)nthreads * PIECES_PER_THREAD);
+        if(piece_size < PIECE_MIN)
+            piece_size = PIECE_MIN;
+        queue.npieces = split_chunks(chunks, piece_size, &queue.pieces);
+    }
+    else {
+        for(size_t i = 0; i < chunks->size; i++){
+            File_chunk* chunk = &chunks->chunks[i];
+            piece_push_back(&queue.pieces, &queue.npieces, chunk->file_name, chunk->start, chunk->end, i);
+        }
+    }
+
+    if(nthreads > (int)queue.npieces)
+        nthreads = queue.npieces ? queue.npieces : 1;
+
+    // The calling thread is worker 0 and counts straight into dic
+    Worker* workers = malloc(sizeof(*workers) * nthreads);
+    for(int t = 0; t < nthreads; t++){
+        workers[t].queue = &queue;
+        workers[t].dic = t ? dic_new(0) : dic;
+        workers[t].index = t;
+        if(t)
+            pthread_create(&workers[t].thread, NULL, count_pieces, &workers[t]);
+    }
+    count_pieces(&workers[0]);
+
+    for(int t = 1; t < nthreads; t++){
+        pthread_join(workers[t].thread, NULL);
+        double start = trace_now();
+        merge_dictionary(dic, workers[t].dic);
+        dic_delete(workers[t].dic);
+        trace_event("merge threads", NULL, start, 0);
+    }
+
+    free(workers);
+    free(queue.pieces);
+}
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpi.h"
+#include "hashdict.h"
+#include "chnkcnt.h"
+#include "workload.h"
+#include "collread.h"
+#include "trace.h"
+
+/*********************************************************************************
+ * MPI-IO input backend, meant for shared parallel file systems (Lustre, GPFS).
+ * Instead of every process reading its byte ranges on its own, the processes
+ * sharing a file read it together with MPI_File_read_at_all, so the MPI-IO layer
+ * can use collective buffering and turn many small requests into a few large,
+ * stripe aligned ones.
+ * The processes sharing a file are always consecutive, and a process shares at
+ * most two files: the one its chunk vector starts with and the one it ends with.
+ * Numbering the shared files in order, two neighbouring groups always have a
+ * different parity, so two MPI_Comm_split calls (even and odd files) give every
+ * process a communicator for each of its shared files, with no chain of group
+ * creations running through all the processes.
+ * Shared files are read in rounds of MPIIO_BLOCK bytes. A round is started on both
+ * shared files with the non blocking MPI_File_iread_at_all, so a process never
+ * waits for one neighbour before joining the collective of the other. Every
+ * process knows the whole workload, hence how many rounds each group needs.
+ * Files that only one process reads go through MPI_COMM_SELF.
+ * *******************************************************************************/
+
+typedef struct{
+    File_chunk*     chunk;
+    int             rounds;     /* Rounds of the whole group */
+    MPI_Comm        comm;
+    MPI_File        fh;
+    Chunk_stream    cs;
+    char*           buffer;
+} Shared_read;
+
+static int blocks(long bytes){
+    return (bytes + MPIIO_BLOCK - 1) / MPIIO_BLOCK;
+}
+
+static MPI_Info make_hints(long stripe){
+    MPI_Info info;
+    char value[32];
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "romio_cb_read", "enable");
+    sprintf(value, "%d", MPIIO_BLOCK);
+    MPI_Info_set(info, "cb_buffer_size", value);
+    sprintf(value, "%ld", stripe);
+    MPI_Info_set(info, "striping_unit", value);
+    return info;
+}
+
+static MPI_File open_or_die(MPI_Comm comm, char* file_name, MPI_Info info){
+    MPI_File fh;
+    if(MPI_File_open(comm, file_name, MPI_MODE_RDONLY, info, &fh) != MPI_SUCCESS){
+        fprintf(stderr, "\nUnable to open file %s.\n", file_name);
+        fprintf(stderr, "Please check if file exists and you have read privilege.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    return fh;
+}
+
+void count_chunk_vector_mpiio(Chunk_vector** chunks_proc, int rank, int wsize, long stripe, struct dictionary* dic){
+    Chunk_vector* chunks = chunks_proc[rank];
+    MPI_Info info = make_hints(stripe);
+    Shared_read shared[2];
+    int nshared = 0;
+    int color[2] = { MPI_UNDEFINED, MPI_UNDEFINED };
+
+    // Numbering the shared files and finding the rounds each group needs
+    int* rounds = calloc(wsize + 1, sizeof(*rounds));
+    int ordinal = -1;
+    for(int p = 0; p < wsize; p++){
+        for(size_t i = 0; chunks_proc[p] && i < chunks_proc[p]->size; i++){
+            File_chunk* chunk = &chunks_proc[p]->chunks[i];
+            if(chunk->special_position == UNIQUE)
+                continue;
+            if(chunk->special_position == FIRST)
+                ordinal++;
+            if(blocks(chunk->end - chunk->start) > rounds[ordinal])
+                rounds[ordinal] = blocks(chunk->end - chunk->start);
+            if(p == rank){
+                shared[nshared].chunk = chunk;
+                shared[nshared].rounds = ordinal;     /* Fixed below, once every member has been seen */
+                color[ordinal % 2] = ordinal;
+                nshared++;
+            }
+        }
+    }
+
+    for(int parity = 0; parity < 2; parity++){
+        MPI_Comm comm;
+        MPI_Comm_split(MPI_COMM_WORLD, color[parity], rank, &comm);
+        for(int s = 0; s < nshared; s++)
+            if(shared[s].rounds % 2 == parity)
+                shared[s].comm = comm;
+    }
+
+    for(int s = 0; s < nshared; s++){
+        shared[s].rounds = rounds[shared[s].rounds];
+        shared[s].fh = open_or_die(shared[s].comm, shared[s].chunk->file_name, info);
+        shared[s].buffer = malloc(sizeof(*shared[s].buffer) * MPIIO_BLOCK);
+        chunk_stream_init(&shared[s].cs, dic);
+    }
+    free(rounds);
+
+    // Shared files, one round at a time on both of them
+    int nrounds = 0;
+    for(int s = 0; s < nshared; s++)
+        if(shared[s].rounds > nrounds)
+            nrounds = shared[s].rounds;
+
+    double start = trace_now();
+    for(int round = 0; round < nrounds; round++){
+        MPI_Request requests[2];
+        int counts[2];
+        for(int s = 0; s < nshared; s++){
+            requests[s] = MPI_REQUEST_NULL;
+            counts[s] = 0;
+            if(round >= shared[s].rounds)
+                continue;
+            long offset = shared[s].chunk->start + (long)round * MPIIO_BLOCK;
+            long left = shared[s].chunk->end - offset;
+            counts[s] = left <= 0 ? 0 : (left > MPIIO_BLOCK ? MPIIO_BLOCK : left);
+            MPI_File_iread_at_all(shared[s].fh, left > 0 ? offset : shared[s].chunk->start, shared[s].buffer, counts[s], MPI_CHAR, &requests[s]);
+        }
+        MPI_Waitall(nshared, requests, MPI_STATUSES_IGNORE);
+        for(int s = 0; s < nshared; s++)
+            chunk_stream_feed(&shared[s].cs, shared[s].buffer, counts[s]);
+    }
+
+    for(int s = 0; s < nshared; s++){
+        char* first_word;
+        free(chunk_stream_end(&shared[s].cs, &first_word));
+        free(first_word);
+        trace_event("count", shared[s].chunk->file_name, start, shared[s].chunk->end - shared[s].chunk->start);
+        MPI_File_close(&shared[s].fh);
+        MPI_Comm_free(&shared[s].comm);
+        free(shared[s].buffer);
+    }
+
+    // Files nobody else reads
+    char* buffer = malloc(sizeof(*buffer) * MPIIO_BLOCK);
+    for(size_t i = 0; chunks && i < chunks->size; i++){
+        File_chunk* chunk = &chunks->chunks[i];
+        if(chunk->special_position != UNIQUE)
+            continue;
+
+        start = trace_now();
+        MPI_File fh = open_or_die(MPI_COMM_SELF, chunk->file_name, info);
+        Chunk_stream cs;
+        chunk_stream_init(&cs, dic);
+        for(long offset = chunk->start; offset < chunk->end; offset += MPIIO_BLOCK){
+            int count = chunk->end - offset > MPIIO_BLOCK ? MPIIO_BLOCK : chunk->end - offset;
+            MPI_File_read_at_all(fh, offset, buffer, count, MPI_CHAR, MPI_STATUS_IGNORE);
+            chunk_stream_feed(&cs, buffer, count);
+        }
+        char* first_word;
+        free(chunk_stream_end(&cs, &first_word));
+        free(first_word);
+        MPI_File_close(&fh);
+        trace_event("count", chunk->file_name, start, chunk->end - chunk->start);
+    }
+    free(buffer);
+
+    MPI_Info_free(&info);
+}
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "mpi.h"
+#include "daemon.h"
+
+/*********************************************************************************
+ * Resident mode.
+ * Launching the processes and starting the MPI world cost more than counting a
+ * small corpus, so a resident run keeps the world up and takes one job after the
+ * other, with the same options and the same dictionary. The master waits for jobs,
+ * either on a FIFO (blocking in read, a writer at a time) or by polling a spool
+ * directory every DAEMON_POLL_MS; claiming a job file is renaming it, so two
+ * daemons can share a spool. Every job is then sent to the other processes,
+ * which wait on an MPI_Ibcast, sleeping between tests: MPI libraries spin while
+ * waiting, and an idle daemon would keep every core it runs on busy.
+ * *******************************************************************************/
+
+int job_source_open(Job_source* source, const char* path){
+    struct stat st;
+    if(stat(path, &st) || (!S_ISDIR(st.st_mode) && !S_ISFIFO(st.st_mode)))
+        return -1;
+    source->path = path;
+    source->fifo = S_ISFIFO(st.st_mode);
+    source->stream = NULL;
+    return 0;
+}
+
+void job_source_close(Job_source* source){
+    if(source->stream)
+        fclose(source->stream);
+    source->stream = NULL;
+}
+
+void job_free(Daemon_job* job){
+    free(job->input_dir);
+    free(job->output_file);
+    free(job->spool_file);
+    job->input_dir = job->output_file = job->spool_file = NULL;
+}
+
+/* Parses a job line. Returns 1 for a job, 0 for stop, -1 for a line with nothing in it */
+static int parse_job(char* line, Daemon_job* job){
+    line[strcspn(line, "\r\n")] = '\0';
+    if(!strcmp(line, DAEMON_STOP))
+        return 0;
+    char* tab = strchr(line, '\t');
+    if(tab)
+        *tab++ = '\0';
+    if(!*line)
+        return -1;
+    job->input_dir = strdup(line);
+    job->output_file = tab && *tab ? strdup(tab) : NULL;
+    return 1;
+}
+
+static char* spool_path(const char* dir, const char* base, const char* suffix){
+    char* path = malloc(strlen(dir) + strlen(base) + strlen(suffix) + 2);
+    sprintf(path, "%s/%s%s", dir, base, suffix);
+    return path;
+}
+
+static int is_job_file(const struct dirent* entry){
+    size_t len = strlen(entry->d_name), suffix = strlen(JOB_SUFFIX);
+    return len > suffix && !strcmp(entry->d_name + len - suffix, JOB_SUFFIX);
+}
+
+/* Claims the first job file of the spool, in name order. Returns what parse_job does, or -2 if there's none */
+static int claim_spooled(Job_source* source, Daemon_job* job){
+    struct dirent** names;
+    int n = scandir(source->path, &names, is_job_file, alphasort);
+    if(n < 0)
+        return -2;
+
+    int result = -2;
+    for(int i = 0; i < n && result == -2; i++){
+        char* base = strndup(names[i]->d_name, strlen(names[i]->d_name) - strlen(JOB_SUFFIX));
+        char* queued = spool_path(source->path, base, JOB_SUFFIX);
+        char* running = spool_path(source->path, base, JOB_RUNNING_SUFFIX);
+
+        // Whoever renames it first owns it
+        FILE* file = NULL;
+        if(!rename(queued, running))
+            file = fopen(running, "r");
+        if(file){
+            char* line = NULL;
+            size_t capacity = 0;
+            job->spool_file = base;
+            base = NULL;
+            result = getline(&line, &capacity, file) > 0 ? parse_job(line, job) : -1;
+            free(line);
+            fclose(file);
+            // Nothing to run, but the file is taken: it's marked right away
+            if(result <= 0)
+                job_finish(source, job, result < 0);
+        }
+        free(base);
+        free(queued);
+        free(running);
+    }
+
+    for(int i = 0; i < n; i++)
+        free(names[i]);
+    free(names);
+    return result;
+}
+
+int job_next(Job_source* source, Daemon_job* job){
+    job->input_dir = job->output_file = job->spool_file = NULL;
+
+    for(;;){
+        if(source->fifo){
+            // Opening blocks until a writer shows up, and reading ends when the last writer closes it
+            if(!source->stream && !(source->stream = fopen(source->path, "r")))
+                return 0;
+            char* line = NULL;
+            size_t capacity = 0;
+            int result = -1;
+            if(getline(&line, &capacity, source->stream) > 0)
+                result = parse_job(line, job);
+            else
+                job_source_close(source);
+            free(line);
+            if(result >= 0)
+                return result;
+        }
+        else {
+            int result = claim_spooled(source, job);
+            if(result >= 0)
+                return result;
+            if(result == -2){
+                struct timespec pause = { 0, DAEMON_POLL_MS * 1000000L };
+                nanosleep(&pause, NULL);
+            }
+        }
+    }
+}
+
+int job_check(const Daemon_job* job){
+    struct stat st;
+    if(stat(job->input_dir, &st) || !S_ISDIR(st.st_mode)){
+        fprintf(stderr, "\nCould not read %s\n", job->input_dir);
+        return -1;
+    }
+    if(!job->output_file)
+        return 0;
+
+    // The file itself may not be there yet (and shards are next to it): its directory has to take new files
+    char* copy = strdup(job->output_file);
+    int writable = !access(dirname(copy), W_OK | X_OK)
+        && (stat(job->output_file, &st) ? 1 : !S_ISDIR(st.st_mode) && !access(job->output_file, W_OK));
+    free(copy);
+    if(!writable){
+        fprintf(stderr, "\nUnable to write %s\n", job->output_file);
+        return -1;
+    }
+    return 0;
+}
+
+void job_finish(Job_source* source, Daemon_job* job, int failed){
+    if(!job->spool_file)
+        return;
+    char* running = spool_path(source->path, job->spool_file, JOB_RUNNING_SUFFIX);
+    char* finished = spool_path(source->path, job->spool_file, failed ? JOB_FAILED_SUFFIX : JOB_DONE_SUFFIX);
+    rename(running, finished);
+    free(running);
+    free(finished);
+}
+
+int job_share(Daemon_job* job, int running, int root, MPI_Comm comm){
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    // "input\0output\0", or a negative length to stop
+    int length = -1;
+    char* buffer = NULL;
+    if(rank == root && running){
+        size_t in = strlen(job->input_dir) + 1;
+        size_t out = job->output_file ? strlen(job->output_file) + 1 : 0;
+        length = in + out;
+        buffer = malloc(sizeof(*buffer) * length);
+        memcpy(buffer, job->input_dir, in);
+        if(out)
+            memcpy(buffer + in, job->output_file, out);
+    }
+
+    MPI_Request request;
+    MPI_Ibcast(&length, 1, MPI_INT, root, comm, &request);
+    int done = 0;
+    while(!done){
+        MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+        if(!done){
+            struct timespec pause = { 0, DAEMON_IDLE_US * 1000L };
+            nanosleep(&pause, NULL);
+        }
+    }
+    if(length < 0)
+        return 0;
+
+    if(rank != root)
+        buffer = malloc(sizeof(*buffer) * length);
+    MPI_Bcast(buffer, length, MPI_CHAR, root, comm);
+    if(rank != root){
+        size_t in = strlen(buffer) + 1;
+        job->input_dir = strdup(buffer);
+        job->output_file = (int)in < length ? strdup(buffer + in) : NULL;
+        job->spool_file = NULL;
+    }
+    free(buffer);
+    return 1;
+}
@@ -4,7 +4,12 @@
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mpi.h"
 #include "futils.h"
+#include "gzindex.h"
 
 /*********************************************************************************
  * The following library encompassess all functions related to discovering the
@@ -154,48 +159,303 @@ int file_push_back(File_vector **vector, char* file_name, long file_size){
         *vector = temp;
     }
 
+    if(!x)
+        vector[0]->names = NULL;
     vector[0]->files[x].file_name = file_name;
     vector[0]->files[x].file_size = file_size;
     vector[0]->size = y;
     return 0;
 }
 
-void get_file_vec(File_vector **vector, size_t* total_size, char* dir_path, char* executable_name){
-    struct dirent *de;
-    *total_size = 0; /* In bytes */
-    DIR *dr = opendir(dir_path); /* Current directory */
+/**********************************************************************************
+ * Discovery runs on the master only (see share_file_vec), and walks the whole tree
+ * below the input directory with a small pool of threads: directories waiting to
+ * be read go on a shared stack, and every thread pops one, reads it with
+ * fstatat relative to the directory's own descriptor (no path lookup from the
+ * root for every file), and pushes the subdirectories it finds. On a network
+ * file system the metadata round trips of different directories overlap.
+ * Every thread collects files in a vector of its own, and the vectors are joined
+ * and sorted by name at the end, so the order doesn't depend on the file system
+ * or on thread timing.
+ * *******************************************************************************/
 
-    if (dr == NULL)
-    {
-        printf("Could not open current directory" );
-        exit(1);
+typedef struct{
+    char**          dirs;           /* Directories waiting to be read */
+    size_t          ndirs, capacity;
+    int             busy;           /* Threads reading a directory, which may push more */
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    const char*     executable_name;
+} Scan_queue;
+
+typedef struct{
+    Scan_queue*     queue;
+    File_vector*    files;
+    size_t          total_size;
+    pthread_t       thread;
+} Scanner;
+
+static char* join_path(const char* dir_path, const char* name){
+    size_t dir_len = strlen(dir_path), name_len = strlen(name);
+    char* path = malloc(sizeof(*path) * (dir_len + name_len + 2));
+    memcpy(path, dir_path, dir_len);
+    if(dir_len && dir_path[dir_len - 1] != '/')
+        path[dir_len++] = '/';
+    memcpy(path + dir_len, name, name_len + 1);
+    return path;
+}
+
+static void push_dir(Scan_queue* queue, char* dir_path){
+    pthread_mutex_lock(&queue->lock);
+    if(queue->ndirs == queue->capacity){
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+        queue->dirs = realloc(queue->dirs, sizeof(*queue->dirs) * queue->capacity);
     }
+    queue->dirs[queue->ndirs++] = dir_path;
+    pthread_cond_signal(&queue->wake);
+    pthread_mutex_unlock(&queue->lock);
+}
 
-    size_t dir_path_len = strlen(dir_path);
-    char rel_path[256];
-    rel_path[0] ='\0';
-    strcat(rel_path, dir_path);
-    if(rel_path[dir_path_len-1] != '/'){
-        strcat(rel_path, "/");
-        dir_path_len++;
+/* Side indexes of compressed files (and the ones being written) are ours, not input */
+static int is_side_index(const char* name){
+    const char* suffix = strstr(name, GZ_INDEX_SUFFIX);
+    return suffix && (!strcmp(suffix, GZ_INDEX_SUFFIX) || !strcmp(suffix, GZ_INDEX_SUFFIX ".tmp"));
+}
+
+static void scan_dir(Scanner* scanner, char* dir_path){
+    int dir_fd = openat(AT_FDCWD, dir_path, O_RDONLY | O_DIRECTORY);
+    if(dir_fd < 0){
+        fprintf(stderr, "Could not open directory %s\n", dir_path);
+        return;
+    }
+    DIR *dr = fdopendir(dir_fd);
+    if(!dr){
+        close(dir_fd);
+        return;
     }
 
-    int i = 0;
-    while ((de = readdir(dr)) != NULL && i < MAX_FILES)
-        /* Only regular files and if it's not the executable */
-        if(de->d_type == DT_REG && strcmp(de->d_name, executable_name)){ 
-            strcat(rel_path, de->d_name);
-            long current_size = get_file_size(rel_path);
-            file_push_back(vector, strdup(rel_path), current_size);
-            *total_size+=current_size;
-            i++;
-            // Resetting rel path
-            rel_path[dir_path_len] = '\0';
+    struct dirent *de;
+    while((de = readdir(dr)) != NULL){
+        if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        /* Symbolic links are followed to files, but never to directories, so the walk can't loop */
+        struct stat file_status;
+        int type = de->d_type;
+        if(type == DT_UNKNOWN || type == DT_LNK || type == DT_REG){
+            if(fstatat(dir_fd, de->d_name, &file_status, 0) < 0)
+                continue;
+            if(S_ISREG(file_status.st_mode))
+                type = DT_REG;
+            else if(S_ISDIR(file_status.st_mode) && de->d_type == DT_UNKNOWN)
+                type = DT_DIR;
+            else
+                continue;
         }
 
+        if(type == DT_DIR)
+            push_dir(scanner->queue, join_path(dir_path, de->d_name));
+        else if(type == DT_REG && strcmp(de->d_name, scanner->queue->executable_name) && !is_side_index(de->d_name)){
+            file_push_back(&scanner->files, join_path(dir_path, de->d_name), file_status.st_size);
+            scanner->total_size += file_status.st_size;
+        }
+    }
     closedir(dr);
 }
 
+static void* scan_tree(void* arg){
+    Scanner* scanner = arg;
+    Scan_queue* queue = scanner->queue;
+
+    pthread_mutex_lock(&queue->lock);
+    for(;;){
+        while(!queue->ndirs && queue->busy)
+            pthread_cond_wait(&queue->wake, &queue->lock);
+        if(!queue->ndirs)
+            break;
+        char* dir_path = queue->dirs[--queue->ndirs];
+        queue->busy++;
+        pthread_mutex_unlock(&queue->lock);
+
+        scan_dir(scanner, dir_path);
+        free(dir_path);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->busy--;
+    }
+    /* Nothing left and nobody who could push more: wake up everybody else so they can leave too */
+    pthread_cond_broadcast(&queue->wake);
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+static int compare_files(const void* a, const void* b){
+    return strcmp(((const File_info*)a)->file_name, ((const File_info*)b)->file_name);
+}
+
+/* Joins the vectors found by the scanners, sorted by name */
+static void join_file_vecs(File_vector **vector, size_t* total_size, Scanner* scanners, int nthreads){
+    *total_size = 0;
+    for(int t = 0; t < nthreads; t++){
+        for(size_t i = 0; scanners[t].files && i < scanners[t].files->size; i++)
+            file_push_back(vector, scanners[t].files->files[i].file_name, scanners[t].files->files[i].file_size);
+        *total_size += scanners[t].total_size;
+        free(scanners[t].files);
+    }
+    if(!*vector)
+        *vector = calloc(1, sizeof(**vector));
+    qsort(vector[0]->files, vector[0]->size, sizeof(vector[0]->files[0]), compare_files);
+}
+
+int get_file_vec(File_vector **vector, size_t* total_size, char* dir_path, char* executable_name, int nthreads){
+    struct stat dir_status;
+    if(stat(dir_path, &dir_status) < 0 || !S_ISDIR(dir_status.st_mode))
+        return -1;
+
+    const char* base_name = strrchr(executable_name, '/');
+    Scan_queue queue = { .dirs = NULL, .ndirs = 0, .capacity = 0, .busy = 0,
+                         .executable_name = base_name ? base_name + 1 : executable_name };
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.wake, NULL);
+    push_dir(&queue, strdup(dir_path));
+
+    if(nthreads < 1)
+        nthreads = 1;
+    Scanner* scanners = malloc(sizeof(*scanners) * nthreads);
+    for(int t = 0; t < nthreads; t++){
+        scanners[t].queue = &queue;
+        scanners[t].files = NULL;
+        scanners[t].total_size = 0;
+        if(t)
+            pthread_create(&scanners[t].thread, NULL, scan_tree, &scanners[t]);
+    }
+    scan_tree(&scanners[0]);
+    for(int t = 1; t < nthreads; t++)
+        pthread_join(scanners[t].thread, NULL);
+
+    join_file_vecs(vector, total_size, scanners, nthreads);
+
+    free(scanners);
+    free(queue.dirs);
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.wake);
+    return 0;
+}
+
+/* A manifest lists one path per line, optionally followed by a tab and its size in bytes.
+   Lines with a size skip the stat, which for millions of files on a shared file system is the expensive part. */
+int read_manifest(File_vector **vector, size_t* total_size, char* manifest_path){
+    FILE* manifest = fopen(manifest_path, "r");
+    if(!manifest)
+        return -1;
+
+    *total_size = 0;
+    char* line = NULL;
+    size_t line_capacity = 0;
+    ssize_t len;
+    while((len = getline(&line, &line_capacity, manifest)) != -1){
+        while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if(!len)
+            continue;
+
+        long file_size = -1;
+        char* tab = strrchr(line, '\t');
+        if(tab){
+            char* size_end;
+            *tab = '\0';
+            file_size = strtol(tab + 1, &size_end, 10);
+            if(size_end == tab + 1 || *size_end)
+                file_size = -1;
+        }
+        if(file_size < 0 && (file_size = get_file_size(line)) < 0){
+            fprintf(stderr, "Skipping %s: can't stat it\n", line);
+            continue;
+        }
+        file_push_back(vector, strdup(line), file_size);
+        *total_size += file_size;
+    }
+    free(line);
+    fclose(manifest);
+
+    if(!*vector)
+        *vector = calloc(1, sizeof(**vector));
+    return 0;
+}
+
+/**********************************************************************************
+ * The master serializes the file vector as the array of sizes followed by all the
+ * names, NUL terminated, and broadcasts it. The other processes keep the names in
+ * the received buffer (File_vector.names) rather than allocating each one.
+ * MPI counts are ints, so very large vectors are broadcast in slices.
+ * *******************************************************************************/
+
+void bcast_bytes(char* buffer, long size, int root, MPI_Comm comm){
+    for(long offset = 0; offset < size; offset += BCAST_SLICE)
+        MPI_Bcast(buffer + offset, size - offset > BCAST_SLICE ? BCAST_SLICE : size - offset, MPI_BYTE, root, comm);
+}
+
+void share_file_vec(File_vector **vector, size_t* total_size, int root, MPI_Comm comm){
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    // Number of files, bytes of names and total size
+    long header[3] = { 0, 0, 0 };
+    if(rank == root){
+        header[0] = vector[0]->size;
+        for(size_t i = 0; i < vector[0]->size; i++)
+            header[1] += strlen(vector[0]->files[i].file_name) + 1;
+        header[2] = *total_size;
+    }
+    MPI_Bcast(header, 3, MPI_LONG, root, comm);
+
+    long nfiles = header[0], names_size = header[1];
+    long* sizes = malloc(sizeof(*sizes) * (nfiles ? nfiles : 1));
+    char* names = malloc(sizeof(*names) * (names_size ? names_size : 1));
+    if(rank == root){
+        char* name = names;
+        for(long i = 0; i < nfiles; i++){
+            size_t len = strlen(vector[0]->files[i].file_name) + 1;
+            memcpy(name, vector[0]->files[i].file_name, len);
+            name += len;
+            sizes[i] = vector[0]->files[i].file_size;
+        }
+    }
+    bcast_bytes((char*)sizes, sizeof(*sizes) * nfiles, root, comm);
+    bcast_bytes(names, names_size, root, comm);
+
+    if(rank != root){
+        // Sized like file_push_back would have, so the vector can still grow
+        size_t capacity = 0;
+        while(capacity < (size_t)nfiles)
+            capacity = capacity * 2 + 1;
+        *vector = malloc(sizeof(**vector) + capacity * sizeof(vector[0]->files[0]));
+        vector[0]->size = nfiles;
+        vector[0]->names = names;
+        char* name = names;
+        for(long i = 0; i < nfiles; i++){
+            vector[0]->files[i].file_name = name;
+            vector[0]->files[i].file_size = sizes[i];
+            name += strlen(name) + 1;
+        }
+        *total_size = header[2];
+    }
+    else
+        free(names);
+    free(sizes);
+}
+
+void free_file_vec(File_vector *vector){
+    if(!vector)
+        return;
+    if(vector->names)
+        free(vector->names);
+    else
+        for(size_t i = 0; i < vector->size; i++)
+            free(vector->files[i].file_name);
+    free(vector);
+}
+
 void print_file_vec(File_vector **vector){
         fprintf(stderr, "\n\tFile vector contains %zu files:\t\n", vector[0]->size);
         fprintf(stderr, "\t-------------------------------\t\n");
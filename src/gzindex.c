@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "futils.h"
+#include "gzindex.h"
+
+/*********************************************************************************
+ * Random access to gzip input, after zlib's zran example.
+ * Inflating the whole file once, the index records a checkpoint at a deflate
+ * block boundary every GZ_SPAN uncompressed bytes: where the block starts in the
+ * compressed file (down to the bit) and the 32 KiB of output before it, which is
+ * all the history a deflate stream can refer back to. Any range of the
+ * uncompressed stream is then read by restarting a raw inflate at the last
+ * checkpoint before it, with that history as its dictionary, and throwing away at
+ * most GZ_SPAN bytes of output. The planner sees the length of the uncompressed
+ * stream as the size of the file, so a compressed file is cut among processes and
+ * threads like any other, and every one of them only inflates its own range.
+ * Concatenated gzip members are followed, zero padding or garbage after the last
+ * one is ignored.
+ * The index goes next to the file (<file>.gz.zidx), and it's rebuilt whenever
+ * the file changes. The master builds the missing ones during discovery, so the
+ * other processes just load them; where they can't be written every process
+ * builds its own, in memory.
+ * *******************************************************************************/
+
+static pthread_mutex_t indexes_lock = PTHREAD_MUTEX_INITIALIZER;
+static Gz_index** indexes = NULL;
+static size_t nindexes = 0;
+static Gz_index* last_used = NULL;
+
+int gz_is_compressed(const char* file_name){
+    size_t len = strlen(file_name);
+    return len > strlen(GZ_SUFFIX) && !strcmp(file_name + len - strlen(GZ_SUFFIX), GZ_SUFFIX);
+}
+
+static char* index_path(const char* file_name, const char* suffix){
+    char* path = malloc(sizeof(*path) * (strlen(file_name) + strlen(GZ_INDEX_SUFFIX) + strlen(suffix) + 1));
+    sprintf(path, "%s%s%s", file_name, GZ_INDEX_SUFFIX, suffix);
+    return path;
+}
+
+static int make_key(const char* file_name, Gz_key* key){
+    struct stat file_status;
+    memset(key, 0, sizeof(*key));
+    if(stat(file_name, &file_status) < 0)
+        return -1;
+    key->size = file_status.st_size;
+    key->mtime_sec = file_status.st_mtim.tv_sec;
+    key->mtime_nsec = file_status.st_mtim.tv_nsec;
+    return 0;
+}
+
+static Gz_index* load_index(const char* file_name, const Gz_key* key){
+    char* path = index_path(file_name, "");
+    FILE* side = fopen(path, "rb");
+    free(path);
+    if(!side)
+        return NULL;
+
+    char magic[sizeof(GZ_INDEX_MAGIC) - 1];
+    Gz_key stored;
+    int64_t length, npoints;
+    struct stat side_status;
+    Gz_index* index = NULL;
+    if(fread(magic, sizeof(magic), 1, side) != 1 || memcmp(magic, GZ_INDEX_MAGIC, sizeof(magic))
+       || fread(&stored, sizeof(stored), 1, side) != 1 || memcmp(&stored, key, sizeof(stored))
+       || fread(&length, sizeof(length), 1, side) != 1 || fread(&npoints, sizeof(npoints), 1, side) != 1
+       || fstat(fileno(side), &side_status) < 0 || npoints < 0
+       || (uint64_t)side_status.st_size != GZ_INDEX_HEADER + (uint64_t)npoints * (GZ_WINDOW + sizeof(Gz_point)))
+        goto done;
+
+    index = malloc(sizeof(*index));
+    index->file_name = strdup(file_name);
+    index->length = length;
+    index->npoints = npoints;
+    index->points = malloc(sizeof(*index->points) * (npoints ? npoints : 1));
+    index->windows = NULL;
+    if(fseek(side, GZ_INDEX_HEADER + npoints * GZ_WINDOW, SEEK_SET) || fread(index->points, sizeof(*index->points), npoints, side) != (size_t)npoints){
+        free(index->points);
+        free(index->file_name);
+        free(index);
+        index = NULL;
+    }
+
+done:
+    fclose(side);
+    return index;
+}
+
+/* Saves the most recent GZ_WINDOW bytes of output, which wrap around in window: left bytes are yet to be written */
+static int add_point(Gz_index* index, FILE* side, const unsigned char* window, unsigned left, int bits, long in, long out){
+    unsigned char* history = malloc(sizeof(*history) * GZ_WINDOW);
+    if(left)
+        memcpy(history, window + GZ_WINDOW - left, left);
+    if(left < GZ_WINDOW)
+        memcpy(history + left, window, GZ_WINDOW - left);
+
+    size_t n = index->npoints++;
+    index->points = realloc(index->points, sizeof(*index->points) * index->npoints);
+    index->points[n].out = out;
+    index->points[n].in = in;
+    index->points[n].bits = bits;
+    index->points[n].unused = 0;
+
+    int written = 1;
+    if(side)
+        written = fwrite(history, GZ_WINDOW, 1, side) == 1;
+    else {
+        index->windows = realloc(index->windows, sizeof(*index->windows) * GZ_WINDOW * index->npoints);
+        memcpy(index->windows + n * GZ_WINDOW, history, GZ_WINDOW);
+    }
+    free(history);
+    return written ? 0 : -1;
+}
+
+/* Inflates the whole file, writing the windows to side as they come, or keeping them in memory without one.
+   Returns NULL if the file isn't valid gzip, or if side couldn't be written (*side_failed is set then) */
+static Gz_index* build_index(const char* file_name, FILE* side, int* side_failed){
+    int fd = open(file_name, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+
+    Gz_index* index = malloc(sizeof(*index));
+    index->file_name = strdup(file_name);
+    index->length = 0;
+    index->npoints = 0;
+    index->points = NULL;
+    index->windows = NULL;
+
+    unsigned char* input = malloc(sizeof(*input) * GZ_CHUNK);
+    unsigned char* window = malloc(sizeof(*window) * GZ_WINDOW);
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    int ok = inflateInit2(&strm, 47) == Z_OK;  /* 15 bits of window, gzip or zlib header */
+    long in_offset = 0, totin = 0, totout = 0, last = 0;
+    int ended = 0;
+
+    while(ok){
+        if(!strm.avail_in){
+            ssize_t bytesread = pread(fd, input, GZ_CHUNK, in_offset);
+            if(bytesread < 0 || (bytesread == 0 && !ended && in_offset))
+                ok = 0;
+            if(bytesread <= 0)
+                break;
+            in_offset += bytesread;
+            strm.next_in = input;
+            strm.avail_in = bytesread;
+        }
+        if(ended){
+            // Another member, or just padding after the last one
+            if(strm.next_in[0] != 0x1f)
+                break;
+            inflateReset(&strm);
+            ended = 0;
+        }
+        if(!strm.avail_out){
+            strm.next_out = window;
+            strm.avail_out = GZ_WINDOW;
+        }
+
+        // Z_BLOCK stops at the end of every deflate block, where a checkpoint can go
+        totin += strm.avail_in;
+        totout += strm.avail_out;
+        int ret = inflate(&strm, Z_BLOCK);
+        totin -= strm.avail_in;
+        totout -= strm.avail_out;
+        if(ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR){
+            ok = 0;
+            break;
+        }
+        if(ret == Z_STREAM_END){
+            ended = 1;
+            continue;
+        }
+
+        // data_type: bit 7 at a block boundary, bit 6 after the last block, bits 0-2 left unused in the last byte
+        if((strm.data_type & 128) && !(strm.data_type & 64) && (totout == 0 || totout - last > GZ_SPAN)){
+            if(add_point(index, side, window, strm.avail_out, strm.data_type & 7, totin, totout)){
+                *side_failed = 1;
+                ok = 0;
+            }
+            last = totout;
+        }
+    }
+
+    inflateEnd(&strm);
+    free(window);
+    free(input);
+    close(fd);
+    index->length = totout;
+    if(!ok){
+        free(index->points);
+        free(index->windows);
+        free(index->file_name);
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+/* Builds the index of file_name and writes it next to the file, through a temporary one renamed over.
+   Where that fails, the index is built again with its windows in memory */
+static Gz_index* build_and_save(const char* file_name, const Gz_key* key){
+    char* path = index_path(file_name, "");
+    char* temp_path = index_path(file_name, ".tmp");
+    FILE* side = fopen(temp_path, "wb");
+    int side_failed = side == NULL;
+    Gz_index* index = NULL;
+
+    if(side && fseek(side, GZ_INDEX_HEADER, SEEK_SET))
+        side_failed = 1;
+    else if(side){
+        index = build_index(file_name, side, &side_failed);
+        int64_t length = index ? index->length : 0, npoints = index ? (int64_t)index->npoints : 0;
+        if(index && !(fwrite(index->points, sizeof(*index->points), npoints, side) == (size_t)npoints
+           && !fseek(side, 0, SEEK_SET)
+           && fwrite(GZ_INDEX_MAGIC, sizeof(GZ_INDEX_MAGIC) - 1, 1, side) == 1
+           && fwrite(key, sizeof(*key), 1, side) == 1
+           && fwrite(&length, sizeof(length), 1, side) == 1
+           && fwrite(&npoints, sizeof(npoints), 1, side) == 1))
+            side_failed = 1;
+    }
+    if(side && fclose(side))
+        side_failed = 1;
+    if(index && !side_failed && rename(temp_path, path))
+        side_failed = 1;
+    if(side && (side_failed || !index))
+        unlink(temp_path);
+    if(side_failed){
+        if(index){
+            free(index->points);
+            free(index->file_name);
+            free(index);
+        }
+        fprintf(stderr, "Could not write the index of %s, building it in memory\n", file_name);
+        index = build_index(file_name, NULL, &side_failed);
+    }
+
+    free(temp_path);
+    free(path);
+    return index;
+}
+
+/* The index of file_name, loaded (or built) the first time it's asked for. Safe to call from any thread */
+static Gz_index* get_index(const char* file_name){
+    pthread_mutex_lock(&indexes_lock);
+    Gz_index* index = last_used && !strcmp(last_used->file_name, file_name) ? last_used : NULL;
+    for(size_t i = 0; !index && i < nindexes; i++)
+        if(!strcmp(indexes[i]->file_name, file_name))
+            index = indexes[i];
+
+    if(!index){
+        Gz_key key;
+        if(!make_key(file_name, &key)){
+            index = load_index(file_name, &key);
+            if(!index)
+                index = build_and_save(file_name, &key);
+        }
+        if(index){
+            indexes = realloc(indexes, sizeof(*indexes) * (nindexes + 1));
+            indexes[nindexes++] = index;
+        }
+    }
+    if(index)
+        last_used = index;
+    pthread_mutex_unlock(&indexes_lock);
+    return index;
+}
+
+static int load_window(const Gz_index* index, size_t point, unsigned char* window){
+    if(index->windows){
+        memcpy(window, index->windows + point * GZ_WINDOW, GZ_WINDOW);
+        return 0;
+    }
+    char* path = index_path(index->file_name, "");
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if(fd < 0)
+        return -1;
+    ssize_t bytesread = pread(fd, window, GZ_WINDOW, GZ_INDEX_HEADER + point * GZ_WINDOW);
+    close(fd);
+    return bytesread == GZ_WINDOW ? 0 : -1;
+}
+
+long gz_length(const char* file_name){
+    Gz_index* index = get_index(file_name);
+    return index ? index->length : -1;
+}
+
+/* Moves the input forward by n bytes, reading more of it as needed. Returns -1 at the end of the file */
+static int skip_input(z_stream* strm, int fd, unsigned char* input, long* in_offset, long n){
+    while(n > 0 || !strm->avail_in){
+        if(!strm->avail_in){
+            ssize_t bytesread = pread(fd, input, GZ_CHUNK, *in_offset);
+            if(bytesread <= 0)
+                return -1;
+            *in_offset += bytesread;
+            strm->next_in = input;
+            strm->avail_in = bytesread;
+        }
+        long step = n < (long)strm->avail_in ? n : (long)strm->avail_in;
+        strm->next_in += step;
+        strm->avail_in -= step;
+        n -= step;
+    }
+    return 0;
+}
+
+int gz_stream(const char* file_name, long start, long end, gz_sink sink, void* user){
+    Gz_index* index = get_index(file_name);
+    if(!index)
+        return -1;
+    if(end > index->length)
+        end = index->length;
+    if(end <= start || !index->npoints)
+        return end <= start ? 0 : -1;
+
+    // Last checkpoint at or before start
+    size_t lo = 0, hi = index->npoints;
+    while(hi - lo > 1){
+        size_t mid = (lo + hi) / 2;
+        if(index->points[mid].out <= start)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    const Gz_point* point = &index->points[lo];
+
+    int fd = open(file_name, O_RDONLY);
+    if(fd < 0)
+        return -1;
+    unsigned char* input = malloc(sizeof(*input) * GZ_CHUNK);
+    unsigned char* output = malloc(sizeof(*output) * GZ_CHUNK);
+    unsigned char* window = malloc(sizeof(*window) * GZ_WINDOW);
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    int ok = inflateInit2(&strm, -15) == Z_OK;  /* Raw deflate: the checkpoint is past the header */
+
+    // A block that doesn't start on a byte boundary: its first bits are in the byte before in
+    long in_offset = point->in - (point->bits ? 1 : 0);
+    if(ok && point->bits){
+        unsigned char byte;
+        ok = pread(fd, &byte, 1, in_offset++) == 1;
+        if(ok)
+            inflatePrime(&strm, point->bits, byte >> (8 - point->bits));
+    }
+    if(ok)
+        ok = !load_window(index, lo, window) && inflateSetDictionary(&strm, window, GZ_WINDOW) == Z_OK;
+
+    long skip = start - point->out, left = end - start;
+    int raw = 1;
+    while(ok && left > 0){
+        if(!strm.avail_in && skip_input(&strm, fd, input, &in_offset, 0)){
+            ok = 0;
+            break;
+        }
+        strm.next_out = output;
+        strm.avail_out = GZ_CHUNK;
+        int ret = inflate(&strm, Z_NO_FLUSH);
+        if(ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR){
+            ok = 0;
+            break;
+        }
+
+        // Output before start is only there to get to it
+        size_t have = GZ_CHUNK - strm.avail_out;
+        const unsigned char* data = output;
+        if(skip){
+            size_t skipped = (size_t)skip < have ? (size_t)skip : have;
+            data += skipped;
+            have -= skipped;
+            skip -= skipped;
+        }
+        if((long)have > left)
+            have = left;
+        if(have){
+            sink((const char*)data, have, user);
+            left -= have;
+        }
+
+        if(ret == Z_STREAM_END && left > 0){
+            // A raw stream stops before the trailer of its member, a gzip one reads it
+            if(skip_input(&strm, fd, input, &in_offset, raw ? 8 : 0) || strm.next_in[0] != 0x1f){
+                ok = 0;
+                break;
+            }
+            inflateReset2(&strm, 31);
+            raw = 0;
+        }
+    }
+
+    inflateEnd(&strm);
+    free(window);
+    free(output);
+    free(input);
+    close(fd);
+    return ok && !left ? 0 : -1;
+}
+
+typedef struct{
+    char*   buffer;
+    size_t  size;
+} Read_buffer;
+
+static void copy_out(const char* buffer, size_t len, void* user){
+    Read_buffer* out = user;
+    memcpy(out->buffer + out->size, buffer, len);
+    out->size += len;
+}
+
+ssize_t gz_pread(const char* file_name, void* buffer, size_t len, long offset){
+    Gz_index* index = get_index(file_name);
+    if(!index)
+        return -1;
+    if(offset >= index->length)
+        return 0;
+    if((long)len > index->length - offset)
+        len = index->length - offset;
+
+    Read_buffer out = { buffer, 0 };
+    if(gz_stream(file_name, offset, offset + len, copy_out, &out))
+        return -1;
+    return out.size;
+}
+
+size_t gz_resolve_sizes(File_vector** files, size_t* total_size){
+    size_t kept = 0, compressed = 0;
+    for(size_t i = 0; i < files[0]->size; i++){
+        File_info file = files[0]->files[i];
+        if(gz_is_compressed(file.file_name)){
+            long length = gz_length(file.file_name);
+            *total_size -= file.file_size;
+            if(length < 0){
+                fprintf(stderr, "\n%s is not a valid gzip file, skipping it\n", file.file_name);
+                free(file.file_name);
+                continue;
+            }
+            file.file_size = length;
+            *total_size += length;
+            compressed++;
+        }
+        files[0]->files[kept++] = file;
+    }
+    files[0]->size = kept;
+    return compressed;
+}
+
+void gz_free_indexes(void){
+    pthread_mutex_lock(&indexes_lock);
+    for(size_t i = 0; i < nindexes; i++){
+        free(indexes[i]->points);
+        free(indexes[i]->windows);
+        free(indexes[i]->file_name);
+        free(indexes[i]);
+    }
+    free(indexes);
+    indexes = NULL;
+    nindexes = 0;
+    last_used = NULL;
+    pthread_mutex_unlock(&indexes_lock);
+}
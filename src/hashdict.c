@@ -1,6 +1,25 @@
 #include "hashdict.h"
 #define hash_func meiyan
 
+/*********************************************************************************
+ * Open addressing hashtable, in the style of Swiss tables.
+ * Slots live in a flat array, split in groups of HASHDICT_GROUP slots. Each slot
+ * has a control byte: HASHDICT_EMPTY or, if it's taken, the low 7 bits of the
+ * hash of its key (its tag). A lookup compares all the control bytes of a group
+ * with the tag at once, and only touches the slots whose tag matches: most of the
+ * time that's just the slot it was looking for. The full hash is stored in the
+ * slot as well, so memcmp only runs on an actual match and resizing never has to
+ * hash the keys again.
+ * There are no removals, so a group containing an empty slot ends the probe.
+ * Growing doesn't stop the world: a table twice as big is allocated, and every
+ * insert moves the next HASHDICT_MIGRATE groups of the old table to it. Until the
+ * old table is empty lookups check both, the new one first. The old table is never
+ * written to, so its probe sequences stay intact: a key found there, in a group that
+ * was moved already, would have been found in the new table first.
+ * *******************************************************************************/
+
+#define ARENA_BLOCK 65536
+
 static inline uint32_t meiyan(const char *key, int count) {
 	typedef uint32_t* P;
 	uint32_t h = 0x811c9dc5;
@@ -17,131 +36,240 @@ static inline uint32_t meiyan(const char *key, int count) {
 	return h ^ (h >> 16);
 }
 
-struct keynode *keynode_new(char*k, int l) {
-	struct keynode *node = malloc(sizeof(struct keynode));
-	node->len = l;
-	node->key = malloc(l);
-	memcpy(node->key, k, l);
-	node->next = 0;
-	node->value = -1;
-	return node;
+/* Bitmask with one bit (SSE2, scalar) or one nibble (NEON) for every byte of the group equal to tag */
+#if defined(__SSE2__)
+typedef uint32_t groupmask;
+#define MASK_SHIFT 0
+static inline groupmask group_match(const int8_t *ctrl, int8_t tag) {
+	__m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+	return (groupmask)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+}
+#elif defined(__ARM_NEON)
+typedef uint64_t groupmask;
+#define MASK_SHIFT 2
+static inline groupmask group_match(const int8_t *ctrl, int8_t tag) {
+	uint8x16_t eq = vceqq_s8(vld1q_s8(ctrl), vdupq_n_s8(tag));
+	uint64_t m = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+	return m & 0x8888888888888888ull;
+}
+#else
+typedef uint32_t groupmask;
+#define MASK_SHIFT 0
+static inline groupmask group_match(const int8_t *ctrl, int8_t tag) {
+	groupmask m = 0;
+	for (int i = 0; i < HASHDICT_GROUP; i++)
+		m |= (groupmask)(ctrl[i] == tag) << i;
+	return m;
+}
+#endif
+
+#define mask_first(m) (__builtin_ctzll(m) >> MASK_SHIFT)
+
+static char *arena_copy(struct dictionary* dic, const char *k, int l) {
+	struct keyarena *a = dic->arena;
+	if (!a || a->used + l > a->size) {
+		if (dic->spare && dic->spare->size >= (size_t)l) {
+			a = dic->spare;
+			dic->spare = a->next;
+		} else {
+			size_t size = l > ARENA_BLOCK ? (size_t)l : ARENA_BLOCK;
+			a = malloc(sizeof(*a) + size);
+			a->size = size;
+		}
+		a->next = dic->arena;
+		a->used = 0;
+		dic->arena = a;
+	}
+	char *key = a->data + a->used;
+	memcpy(key, k, l);
+	a->used += l;
+	return key;
 }
 
-void keynode_delete(struct keynode *node) {
-	free(node->key);
-	if (node->next) keynode_delete(node->next);
-	free(node);
+static void dic_alloc_table(struct dictionary* dic, int length) {
+	dic->length = length;
+	dic->ctrl = malloc(sizeof(*dic->ctrl) * length);
+	memset(dic->ctrl, HASHDICT_EMPTY, sizeof(*dic->ctrl) * length);
+	dic->slots = malloc(sizeof(*dic->slots) * length);
 }
 
 struct dictionary* dic_new(int initial_size) {
 	struct dictionary* dic = malloc(sizeof(struct dictionary));
 	if (initial_size == 0) initial_size = 1024;
-	dic->length = initial_size;
+	int length = HASHDICT_GROUP;
+	while (length < initial_size) length <<= 1;
+	dic_alloc_table(dic, length);
 	dic->count = 0;
-	dic->table = calloc(sizeof(struct keynode*), initial_size);
-	dic->growth_treshold = 2.0;
-	dic->growth_factor = 10;
+	dic->growth_treshold = 0.875;
+	dic->growth_factor = 2;
+	dic->value = NULL;
+	dic->arena = NULL;
+	dic->spare = NULL;
+	dic->old_ctrl = NULL;
+	dic->old_slots = NULL;
+	dic->old_length = dic->migrated = 0;
 	return dic;
 }
 
-void dic_delete(struct dictionary* dic) {
-	for (int i = 0; i < dic->length; i++) {
-		if (dic->table[i])
-			keynode_delete(dic->table[i]);
+static void arena_free(struct keyarena *a) {
+	while (a) {
+		struct keyarena *next = a->next;
+		free(a);
+		a = next;
 	}
-	free(dic->table);
-	dic->table = 0;
+}
+
+void dic_delete(struct dictionary* dic) {
+	arena_free(dic->arena);
+	arena_free(dic->spare);
+	free(dic->old_ctrl);
+	free(dic->old_slots);
+	free(dic->ctrl);
+	free(dic->slots);
+	dic->slots = 0;
 	free(dic);
 }
 
-void dic_reinsert_when_resizing(struct dictionary* dic, struct keynode *k2) {
-	int n = hash_func(k2->key, k2->len) % dic->length;
-	if (dic->table[n] == 0) {
-		dic->table[n] = k2;
-		dic->value = &dic->table[n]->value;
-		return;
-	}
-	struct keynode *k = dic->table[n];
-	k2->next = k;
-	dic->table[n] = k2;
-	dic->value = &k2->value;
-}
-
-void dic_resize(struct dictionary* dic, int newsize) {
-	int o = dic->length;
-	struct keynode **old = dic->table;
-	dic->table = calloc(sizeof(struct keynode*), newsize);
-	dic->length = newsize;
-	for (int i = 0; i < o; i++) {
-		struct keynode *k = old[i];
-		while (k) {
-			struct keynode *next = k->next;
-			k->next = 0;
-			dic_reinsert_when_resizing(dic, k);
-			k = next;
+/* Returns the slot of the table holding key, or NULL */
+static struct keyslot *table_lookup(const int8_t *ctrls, struct keyslot *slots, int length, const char *key, int keyn, uint32_t h) {
+	size_t mask = length / HASHDICT_GROUP - 1;
+	size_t g = (h >> 7) & mask;
+	int8_t tag = h & 0x7f;
+	for (size_t step = 1;; step++) {
+		const int8_t *ctrl = ctrls + g * HASHDICT_GROUP;
+		groupmask m = group_match(ctrl, tag);
+		while (m) {
+			struct keyslot *k = &slots[g * HASHDICT_GROUP + mask_first(m)];
+			if (k->hash == h && k->len == keyn && !memcmp(k->key, key, keyn))
+				return k;
+			m &= m - 1;
 		}
+		if (group_match(ctrl, HASHDICT_EMPTY))
+			return NULL;
+		/* Triangular probing visits every group, since the number of groups is a power of two */
+		g = (g + step) & mask;
 	}
-	free(old);
 }
 
-int dic_add(struct dictionary* dic, void *key, int keyn) {
-	int n = hash_func((const char*)key, keyn) % dic->length;
-	if (dic->table[n] == 0) {
-		double f = (double)dic->count / (double)dic->length;
-		if (f > dic->growth_treshold) {
-			dic_resize(dic, dic->length * dic->growth_factor);
-			return dic_add(dic, key, keyn);
+static struct keyslot *dic_lookup(struct dictionary* dic, const char *key, int keyn, uint32_t h) {
+	struct keyslot *k = table_lookup(dic->ctrl, dic->slots, dic->length, key, keyn, h);
+	if (!k && dic->old_ctrl)
+		k = table_lookup(dic->old_ctrl, dic->old_slots, dic->old_length, key, keyn, h);
+	return k;
+}
+
+/* Places a new slot for hash h in the first empty position of its probe sequence */
+static struct keyslot *dic_place(struct dictionary* dic, uint32_t h) {
+	size_t mask = dic->length / HASHDICT_GROUP - 1;
+	size_t g = (h >> 7) & mask;
+	for (size_t step = 1;; step++) {
+		int8_t *ctrl = dic->ctrl + g * HASHDICT_GROUP;
+		groupmask m = group_match(ctrl, HASHDICT_EMPTY);
+		if (m) {
+			size_t i = g * HASHDICT_GROUP + mask_first(m);
+			dic->ctrl[i] = h & 0x7f;
+			dic->slots[i].hash = h;
+			return &dic->slots[i];
 		}
-		dic->table[n] = keynode_new((char*)key, keyn);
-		dic->value = &dic->table[n]->value;
-		dic->count++;
-		return 0;
+		g = (g + step) & mask;
 	}
-	struct keynode *k = dic->table[n];
-	while (k) {
-		if (k->len == keyn && memcmp(k->key, key, keyn) == 0) {
-			dic->value = &k->value;
-			return 1;
-		}
-		k = k->next;
+}
+
+/* Moves up to groups groups of the old table to the new one, and frees the old table once it's empty */
+static void dic_migrate(struct dictionary* dic, int groups) {
+	int end = dic->migrated + groups * HASHDICT_GROUP;
+	if (end > dic->old_length) end = dic->old_length;
+	for (int i = dic->migrated; i < end; i++) {
+		if (dic->old_ctrl[i] == HASHDICT_EMPTY)
+			continue;
+		struct keyslot *k = dic_place(dic, dic->old_slots[i].hash);
+		*k = dic->old_slots[i];
+	}
+	dic->migrated = end;
+	if (end == dic->old_length) {
+		free(dic->old_ctrl);
+		free(dic->old_slots);
+		dic->old_ctrl = NULL;
+		dic->old_slots = NULL;
+		dic->old_length = dic->migrated = 0;
+	}
+}
+
+/* Starts moving to a table of newsize slots. With incremental set, inserts carry the move on */
+static void dic_resize(struct dictionary* dic, int newsize, int incremental) {
+	if (dic->old_ctrl)
+		dic_migrate(dic, dic->old_length / HASHDICT_GROUP);
+	dic->old_ctrl = dic->ctrl;
+	dic->old_slots = dic->slots;
+	dic->old_length = dic->length;
+	dic->migrated = 0;
+	dic_alloc_table(dic, newsize);
+	if (!incremental)
+		dic_migrate(dic, dic->old_length / HASHDICT_GROUP);
+}
+
+void dic_reserve(struct dictionary* dic, int nkeys) {
+	int length = dic->length;
+	while (nkeys > length * dic->growth_treshold) length <<= 1;
+	if (length > dic->length)
+		dic_resize(dic, length, 0);
+}
+
+void dic_clear(struct dictionary* dic) {
+	free(dic->old_ctrl);
+	free(dic->old_slots);
+	dic->old_ctrl = NULL;
+	dic->old_slots = NULL;
+	dic->old_length = dic->migrated = 0;
+	memset(dic->ctrl, HASHDICT_EMPTY, sizeof(*dic->ctrl) * dic->length);
+	dic->count = 0;
+	dic->value = NULL;
+	while (dic->arena) {
+		struct keyarena *a = dic->arena;
+		dic->arena = a->next;
+		a->next = dic->spare;
+		dic->spare = a;
 	}
+}
+
+int dic_add(struct dictionary* dic, void *key, int keyn) {
+	uint32_t h = hash_func((const char*)key, keyn);
+	struct keyslot *k = dic_lookup(dic, key, keyn, h);
+	if (k) {
+		dic->value = &k->value;
+		return 1;
+	}
+	if (dic->old_ctrl)
+		dic_migrate(dic, HASHDICT_MIGRATE);
+	if (dic->count + 1 > dic->length * dic->growth_treshold)
+		dic_resize(dic, dic->length * dic->growth_factor, 1);
+	k = dic_place(dic, h);
+	k->key = arena_copy(dic, key, keyn);
+	k->len = keyn;
+	k->value = -1;
+	dic->value = &k->value;
 	dic->count++;
-	struct keynode *k2 = keynode_new((char*)key, keyn);
-	k2->next = dic->table[n];
-	dic->table[n] = k2;
-	dic->value = &k2->value;
 	return 0;
 }
 
 int dic_find(struct dictionary* dic, void *key, int keyn) {
-	int n = hash_func((const char*)key, keyn) % dic->length;
-    #if defined(__MINGW32__) || defined(__MINGW64__)
-	__builtin_prefetch(gc->table[n]);
-    #endif
-    
-    #if defined(_WIN32) || defined(_WIN64)
-    _mm_prefetch((char*)gc->table[n], _MM_HINT_T0);
-    #endif
-	struct keynode *k = dic->table[n];
+	struct keyslot *k = dic_lookup(dic, key, keyn, hash_func((const char*)key, keyn));
 	if (!k) return 0;
-	while (k) {
-		if (k->len == keyn && !memcmp(k->key, key, keyn)) {
-			dic->value = &k->value;
-			return 1;
-		}
-		k = k->next;
-	}
-	return 0;
+	dic->value = &k->value;
+	return 1;
 }
 
 void dic_forEach(struct dictionary* dic, enumFunc f, void *user) {
+	for (int i = dic->migrated; i < dic->old_length; i++) {
+		if (dic->old_ctrl[i] != HASHDICT_EMPTY) {
+			struct keyslot *k = &dic->old_slots[i];
+			if (!f(k->key, k->len, &k->value, user)) return;
+		}
+	}
 	for (int i = 0; i < dic->length; i++) {
-		if (dic->table[i] != 0) {
-			struct keynode *k = dic->table[i];
-			while (k) {
-				if (!f(k->key, k->len, &k->value, user)) return;
-				k = k->next;
-			}
+		if (dic->ctrl[i] != HASHDICT_EMPTY) {
+			struct keyslot *k = &dic->slots[i];
+			if (!f(k->key, k->len, &k->value, user)) return;
 		}
 	}
 }
@@ -1,66 +1,707 @@
 #include <string.h>
+#include <limits.h>
 #include "mpi.h"
 #include "hashdict.h"
 #include "histogram.h"
+#include "trace.h"
 
+static inline unsigned char* put_varint(unsigned char* out, int value){
+	uint32_t v = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);	/* zigzag: small negatives stay small */
+	while(v >= 0x80){
+		*out++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*out++ = v;
+	return out;
+}
+
+static inline const unsigned char* get_varint(const unsigned char* in, int* value){
+	uint32_t v = 0;
+	int shift = 0;
+	while(*in & 0x80){
+		v |= (uint32_t)(*in++ & 0x7f) << shift;
+		shift += 7;
+	}
+	v |= (uint32_t)*in++ << shift;
+	*value = (int)((v >> 1) ^ -(v & 1));
+	return in;
+}
+
+/* Merges a packed histogram in dic, returns how many words it contained.
+   Word lengths come from the lengths array, so there's no strlen and no terminator to look for. */
+long merge_dict(struct dictionary* dic, const unsigned char* data, size_t size){
+	if(size < HISTOGRAM_HEADER)
+		return 0;
+
+	uint32_t nwords, blob_size;
+	memcpy(&nwords, data, sizeof(nwords));
+	memcpy(&blob_size, data + sizeof(nwords), sizeof(blob_size));
+
+	const unsigned char* lengths = data + HISTOGRAM_HEADER;
+	const char* cur_word = (const char*)lengths + nwords;
+	const unsigned char* counts = lengths + nwords + blob_size;
+
+	for(uint32_t j = 0; j < nwords; j++){
+		size_t cur_len = lengths[j];
+		int cur_value;
+		counts = get_varint(counts, &cur_value);
+
+		if(dic_find(dic, (void*)cur_word, cur_len)){
+			*dic->value = *dic->value + cur_value;
+		}
+		else{
+			dic_add(dic, (void*)cur_word, cur_len);
+			*dic->value = cur_value;
+		}
+		cur_word += cur_len;
+	}
+	return nwords;
+}
+
+static int merge_word(void *key, int count, int *value, void *user){
+	struct dictionary* dic = user;
+	if(dic_find(dic, key, count))
+		*dic->value = *dic->value + *value;
+	else {
+		dic_add(dic, key, count);
+		*dic->value = *value;
+	}
+	return 1;
+}
+
+/* Adds every count of other to dic */
+void merge_dictionary(struct dictionary* dic, struct dictionary* other){
+	dic_forEach(other, merge_word, dic);
+}
+
+struct pack_cursor {
+	unsigned char* lengths;
+	char* blob;
+	unsigned char* counts;
+	uint32_t nwords;
+};
+
+static int measure_word(void *key, int count, int *value, void *user){
+	(void)key;
+	size_t* sizes = user;
+	if(*value){
+		sizes[0]++;
+		sizes[1] += count;
+	}
+	return 1;
+}
+
+static int pack_word(void *key, int count, int *value, void *user){
+	struct pack_cursor* cursor = user;
+	if(*value){
+		cursor->lengths[cursor->nwords++] = count;
+		memcpy(cursor->blob, key, count);
+		cursor->blob += count;
+		cursor->counts = put_varint(cursor->counts, *value);
+	}
+	return 1;
+}
+
+/* Lays out a packed histogram of nwords words and blob_size bytes at out, returning the cursor for pack_word */
+static struct pack_cursor start_section(unsigned char* out, uint32_t nwords, uint32_t blob_size){
+	memcpy(out, &nwords, sizeof(nwords));
+	memcpy(out + sizeof(nwords), &blob_size, sizeof(blob_size));
+
+	struct pack_cursor cursor;
+	cursor.lengths = out + HISTOGRAM_HEADER;
+	cursor.blob = (char*)cursor.lengths + nwords;
+	cursor.counts = cursor.lengths + nwords + blob_size;
+	cursor.nwords = 0;
+	return cursor;
+}
+
+/* Worst case size of a section: 5 bytes for every varint */
+#define SECTION_BOUND(nwords, blob_size) (HISTOGRAM_HEADER + (nwords) + (blob_size) + 5 * (size_t)(nwords))
+
+void pack_histogram(packed_histogram* packed, struct dictionary* dic){
+	size_t sizes[2] = { 0, 0 };		/* words, blob bytes */
+	dic_forEach(dic, measure_word, sizes);
+
+	size_t needed = SECTION_BOUND(sizes[0], sizes[1]);
+	if(packed->capacity < needed){
+		free(packed->data);
+		packed->data = malloc(sizeof(*packed->data) * needed);
+		packed->capacity = needed;
+	}
+
+	struct pack_cursor cursor = start_section(packed->data, sizes[0], sizes[1]);
+	dic_forEach(dic, pack_word, &cursor);
+
+	packed->size = cursor.counts - packed->data;
+}
+
+void free_packed_histogram(packed_histogram* packed){
+	free(packed->data);
+	packed->data = NULL;
+	packed->size = packed->capacity = 0;
+}
+
+void send_large(const void* data, size_t size, int dest, int tag, MPI_Comm comm){
+	uint64_t length = size;
+	MPI_Send(&length, 1, MPI_UINT64_T, dest, tag, comm);
+	for(size_t offset = 0; offset < size; offset += MESSAGE_PIECE){
+		int len = size - offset < MESSAGE_PIECE ? (int)(size - offset) : MESSAGE_PIECE;
+		MPI_Send((const unsigned char*)data + offset, len, MPI_BYTE, dest, tag, comm);
+	}
+}
+
+/* The first message from a sender is its length: once that's matched, the pieces come from the same sender, in order */
+unsigned char* recv_large(int source, int tag, MPI_Comm comm, size_t* size){
+	uint64_t length;
+	MPI_Status status;
+	MPI_Recv(&length, 1, MPI_UINT64_T, source, tag, comm, &status);
+	unsigned char* data = malloc(sizeof(*data) * (length ? length : 1));
+	for(uint64_t offset = 0; offset < length; offset += MESSAGE_PIECE){
+		int len = length - offset < MESSAGE_PIECE ? (int)(length - offset) : MESSAGE_PIECE;
+		MPI_Recv(data + offset, len, MPI_BYTE, status.MPI_SOURCE, tag, comm, MPI_STATUS_IGNORE);
+	}
+	*size = length;
+	return data;
+}
+
+/* Receives count histograms from whoever sends them first, merging each one as soon as it arrives */
+static void merge_incoming(struct dictionary* dic, int count, MPI_Comm comm){
+	for(int i = 0; i < count; i++){
+		size_t size;
+		double start = trace_now();
+		unsigned char* incoming = recv_large(MPI_ANY_SOURCE, REDUCE_TAG, comm, &size);
+		trace_event("gather", NULL, start, size);
+
+		start = trace_now();
+		merge_dict(dic, incoming, size);
+		trace_event("merge", NULL, start, size);
+		free(incoming);
+	}
+}
+
+static void send_histogram(struct dictionary* dic, int dest, MPI_Comm comm){
+	packed_histogram packed = { NULL, 0, 0 };
+	double start = trace_now();
+	pack_histogram(&packed, dic);
+	trace_event("histogram build", NULL, start, packed.size);
+
+	start = trace_now();
+	send_large(packed.data, packed.size, dest, REDUCE_TAG, comm);
+	trace_event("gather", NULL, start, packed.size);
+	free_packed_histogram(&packed);
+}
+
+/*********************************************************************************
+ * Reduces every local dictionary into the dictionary of root.
+ * REDUCE_FLAT: every process sends its histogram straight to root, which merges
+ * them alone.
+ * REDUCE_TREE: binomial tree. In the i-th round, processes whose (relative) rank
+ * has bit i set send what they've merged so far to rank - 2^i, and are done.
+ * Every internal node merges its children before forwarding, so root only merges
+ * log2(wsize) histograms and the merging work is spread over the whole tree.
+ * In both modes histograms are merged in the order they arrive.
+ * REDUCE_IDS: no histogram is sent at all, see reduce_word_ids.
+ * *******************************************************************************/
+void reduce_histograms(struct dictionary* dic, int reduction, int root, MPI_Comm comm){
+	int rank, wsize;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &wsize);
+
+	if(reduction == REDUCE_IDS){
+		reduce_word_ids(dic, root, comm);
+		return;
+	}
+
+	if(reduction == REDUCE_FLAT){
+		if(rank == root)
+			merge_incoming(dic, wsize - 1, comm);
+		else
+			send_histogram(dic, root, comm);
+		return;
+	}
+
+	int relrank = (rank - root + wsize) % wsize;
+	int children = 0, parent = -1;
+	for(int mask = 1; mask < wsize; mask <<= 1){
+		if(relrank & mask){
+			parent = (relrank - mask + root) % wsize;
+			break;
+		}
+		if(relrank + mask < wsize)
+			children++;
+	}
+
+	merge_incoming(dic, children, comm);
+	if(parent >= 0)
+		send_histogram(dic, parent, comm);
+}
+
+/*********************************************************************************
+ * Hash partitioned shuffle.
+ * Instead of funneling the whole vocabulary to root, every word gets an owner and
+ * each process ends up with the complete counts of the words it owns, after a
+ * single MPI_Alltoallv.
+ * Words are hashed in SHUFFLE_BUCKETS buckets per process, and buckets (not words)
+ * are assigned to owners. Every process measures how many bytes each bucket would
+ * cost it to send, the measures are summed with an Allreduce, and buckets are then
+ * handed out greedily, heaviest first, to the least loaded owner. Frequent words,
+ * the ones that show up in the histogram of every process, are what makes a bucket
+ * heavy: weighing buckets by what's actually shipped, rather than by how many
+ * words hash there, keeps a handful of them from piling up on the same owner.
+ * Every process runs the same deterministic assignment, so there's nothing else
+ * to agree on.
+ * *******************************************************************************/
+
+static inline uint32_t shuffle_hash(const char* key, int len){
+	uint32_t h = 0x811c9dc5;	/* FNV-1a, independent from the hashtable's own hash */
+	for(int i = 0; i < len; i++)
+		h = (h ^ (unsigned char)key[i]) * 0x01000193;
+	return h;
+}
+
+struct partition_cursor {
+	int nbuckets;
+	const int* owner;			/* owner of every bucket */
+	long* load;					/* bytes per bucket, when measuring */
+	size_t (*sizes)[2];			/* words and blob bytes per destination, when measuring */
+	struct pack_cursor* sections;	/* one section per destination, when packing */
+};
+
+static int measure_partition(void *key, int count, int *value, void *user){
+	struct partition_cursor* cursor = user;
+	if(*value){
+		int bucket = shuffle_hash(key, count) % cursor->nbuckets;
+		if(cursor->load)
+			cursor->load[bucket] += count + 2;
+		else {
+			cursor->sizes[cursor->owner[bucket]][0]++;
+			cursor->sizes[cursor->owner[bucket]][1] += count;
+		}
+	}
+	return 1;
+}
+
+static int pack_partition(void *key, int count, int *value, void *user){
+	struct partition_cursor* cursor = user;
+	if(*value){
+		int bucket = shuffle_hash(key, count) % cursor->nbuckets;
+		pack_word(key, count, value, &cursor->sections[cursor->owner[bucket]]);
+	}
+	return 1;
+}
 
-void merge_dict(struct dictionary* dic, histogram_element** process_histograms, long* localszs, int wsize){
-	for(int i = 1; i < wsize; i++){
-		for(int j = 0; j < localszs[i]; j++){
-			char* cur_word = process_histograms[i][j].word;
-			size_t cur_len = strlen(process_histograms[i][j].word);
-			int cur_value = process_histograms[i][j].count;
-
-			if(dic_find(dic, cur_word, cur_len)){
-        		*dic->value = *dic->value + cur_value;
-        	}
-    		else{
-        		dic_add(dic, process_histograms[i][j].word, cur_len);
-        		*dic->value = cur_value;
-    		}
+static void assign_buckets(int* owner, const long* load, int nbuckets, int wsize){
+	int* order = malloc(sizeof(*order) * nbuckets);
+	long* assigned = calloc(wsize, sizeof(*assigned));
+	for(int i = 0; i < nbuckets; i++)
+		order[i] = i;
+
+	/* Heaviest bucket first (insertion sort: there are only a few per process, ties broken by index) */
+	for(int i = 1; i < nbuckets; i++){
+		int b = order[i], j = i;
+		while(j > 0 && load[order[j - 1]] < load[b]){
+			order[j] = order[j - 1];
+			j--;
 		}
+		order[j] = b;
+	}
+
+	for(int i = 0; i < nbuckets; i++){
+		int lightest = 0;
+		for(int p = 1; p < wsize; p++)
+			if(assigned[p] < assigned[lightest])
+				lightest = p;
+		owner[order[i]] = lightest;
+		assigned[lightest] += load[order[i]];
+	}
+
+	free(order);
+	free(assigned);
+}
+
+/* MPI_Alltoallv of byte sections, for when the sizes or the offsets don't fit in an int: one message per peer and
+   MESSAGE_PIECE bytes. Messages between two processes with the same tag arrive in order, so the pieces line up */
+static void exchange_sections(const unsigned char* sendbuf, const uint64_t* sendcounts, const size_t* sdispls,
+		unsigned char* recvbuf, const uint64_t* recvcounts, const size_t* rdispls, MPI_Comm comm){
+	int wsize;
+	MPI_Comm_size(comm, &wsize);
+
+	size_t npieces = 0;
+	for(int p = 0; p < wsize; p++)
+		npieces += (sendcounts[p] + MESSAGE_PIECE - 1) / MESSAGE_PIECE + (recvcounts[p] + MESSAGE_PIECE - 1) / MESSAGE_PIECE;
+	MPI_Request* requests = malloc(sizeof(*requests) * (npieces ? npieces : 1));
+
+	int n = 0;
+	for(int p = 0; p < wsize; p++)
+		for(uint64_t offset = 0; offset < recvcounts[p]; offset += MESSAGE_PIECE){
+			int len = recvcounts[p] - offset < MESSAGE_PIECE ? (int)(recvcounts[p] - offset) : MESSAGE_PIECE;
+			MPI_Irecv(recvbuf + rdispls[p] + offset, len, MPI_BYTE, p, SHUFFLE_TAG, comm, &requests[n++]);
+		}
+	for(int p = 0; p < wsize; p++)
+		for(uint64_t offset = 0; offset < sendcounts[p]; offset += MESSAGE_PIECE){
+			int len = sendcounts[p] - offset < MESSAGE_PIECE ? (int)(sendcounts[p] - offset) : MESSAGE_PIECE;
+			MPI_Isend(sendbuf + sdispls[p] + offset, len, MPI_BYTE, p, SHUFFLE_TAG, comm, &requests[n++]);
+		}
+	MPI_Waitall(n, requests, MPI_STATUSES_IGNORE);
+	free(requests);
+}
+
+/* MPI_Alltoallv of bytes, with 64 bit sizes and offsets. MPI_Alltoallv counts and addresses bytes with ints: past
+   INT_MAX bytes on any process, everybody goes through exchange_sections instead. Collective over comm */
+static void alltoallv_bytes(const void* sendbuf, const uint64_t* sendcounts, const size_t* sdispls,
+		void* recvbuf, const uint64_t* recvcounts, const size_t* rdispls, MPI_Comm comm){
+	int wsize;
+	MPI_Comm_size(comm, &wsize);
+
+	int large = 0;
+	for(int p = 0; p < wsize; p++)
+		large |= sdispls[p] + sendcounts[p] > INT_MAX || rdispls[p] + recvcounts[p] > INT_MAX;
+	MPI_Allreduce(MPI_IN_PLACE, &large, 1, MPI_INT, MPI_LOR, comm);
+	if(large){
+		exchange_sections(sendbuf, sendcounts, sdispls, recvbuf, recvcounts, rdispls, comm);
+		return;
 	}
+
+	int* counts = malloc(sizeof(*counts) * 4 * wsize);
+	for(int p = 0; p < wsize; p++){
+		counts[p] = sendcounts[p];
+		counts[wsize + p] = sdispls[p];
+		counts[2 * wsize + p] = recvcounts[p];
+		counts[3 * wsize + p] = rdispls[p];
+	}
+	MPI_Alltoallv(sendbuf, counts, counts + wsize, MPI_BYTE, recvbuf, counts + 2 * wsize, counts + 3 * wsize, MPI_BYTE, comm);
+	free(counts);
 }
 
-long get_local_histogram(histogram_element* local_elements, struct dictionary* dic){
-	long j = 0;
-	for (int i = 0; i < dic->length; i++) {
-	    if (dic->table[i] != 0) {
-	        struct keynode *k = dic->table[i];
-	        while (k) {
-	            if(k->value){
-	            	// Making sure they are contiguous
-	            	memcpy(local_elements[j].word, k->key, k->len);
-	            	local_elements[j].count = k->value;
-	            	j++;
-	            }
-	            k = k->next;
-	        }
-	    }
+/* MPI_Gatherv of bytes to root, in rank order, with 64 bit sizes. Root sees every size first and tells everybody
+   whether the whole fits a single MPI_Gatherv, or has to go point to point in pieces. Returns root's buffer */
+static unsigned char* gather_bytes(const void* data, size_t size, int root, MPI_Comm comm, size_t* total){
+	int rank, wsize;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &wsize);
+
+	uint64_t length = size;
+	uint64_t* lengths = rank == root ? malloc(sizeof(*lengths) * wsize) : NULL;
+	size_t* displs = rank == root ? malloc(sizeof(*displs) * wsize) : NULL;
+	MPI_Gather(&length, 1, MPI_UINT64_T, lengths, 1, MPI_UINT64_T, root, comm);
+
+	unsigned char* all = NULL;
+	int large = 0;
+	*total = 0;
+	if(rank == root){
+		for(int p = 0; p < wsize; p++){
+			displs[p] = *total;
+			*total += lengths[p];
+		}
+		all = malloc(sizeof(*all) * (*total ? *total : 1));
+		large = *total > INT_MAX;
 	}
-	return j;
+	MPI_Bcast(&large, 1, MPI_INT, root, comm);
+
+	if(!large){
+		int* counts = rank == root ? malloc(sizeof(*counts) * 2 * wsize) : NULL;
+		for(int p = 0; rank == root && p < wsize; p++){
+			counts[p] = lengths[p];
+			counts[wsize + p] = displs[p];
+		}
+		MPI_Gatherv(data, size, MPI_BYTE, all, counts, counts ? counts + wsize : NULL, MPI_BYTE, root, comm);
+		free(counts);
+	}
+	else if(rank != root){
+		for(size_t offset = 0; offset < size; offset += MESSAGE_PIECE){
+			int len = size - offset < MESSAGE_PIECE ? (int)(size - offset) : MESSAGE_PIECE;
+			MPI_Send((const unsigned char*)data + offset, len, MPI_BYTE, root, SHUFFLE_TAG, comm);
+		}
+	}
+	else {
+		memcpy(all + displs[root], data, size);
+		for(int p = 0; p < wsize; p++)
+			for(uint64_t offset = 0; p != root && offset < lengths[p]; offset += MESSAGE_PIECE){
+				int len = lengths[p] - offset < MESSAGE_PIECE ? (int)(lengths[p] - offset) : MESSAGE_PIECE;
+				MPI_Recv(all + displs[p] + offset, len, MPI_BYTE, p, SHUFFLE_TAG, comm, MPI_STATUS_IGNORE);
+			}
+	}
+
+	free(displs);
+	free(lengths);
+	return all;
 }
 
-int MPI_Type_create_histogram(MPI_Datatype* histogram_element_dt){
-	int count = 2;
+struct dictionary* shuffle_histograms(struct dictionary* dic, MPI_Comm comm){
+	int wsize;
+	MPI_Comm_size(comm, &wsize);
+
+	int nbuckets = wsize * SHUFFLE_BUCKETS;
+	int* owner = malloc(sizeof(*owner) * nbuckets);
+	long* load = calloc(nbuckets, sizeof(*load));
 
-	int block_length[2] = {
-		1,
-		256
-	};
+	// Measuring and balancing the buckets
+	double start = trace_now();
+	struct partition_cursor cursor = { nbuckets, owner, load, NULL, NULL };
+	dic_forEach(dic, measure_partition, &cursor);
+	MPI_Allreduce(MPI_IN_PLACE, load, nbuckets, MPI_LONG, MPI_SUM, comm);
+	assign_buckets(owner, load, nbuckets, wsize);
 
-	MPI_Aint displacements[2] = {
-		offsetof(histogram_element, count),
-		offsetof(histogram_element, word)
-	};
+	// Sizing one packed section per destination, all in the same send buffer
+	size_t (*sizes)[2] = calloc(wsize, sizeof(*sizes));
+	cursor.load = NULL;
+	cursor.sizes = sizes;
+	dic_forEach(dic, measure_partition, &cursor);
 
-	MPI_Datatype types[2] = {
-		MPI_INT,
-		MPI_CHAR
-	};
+	// Sizes and offsets are 64 bits wide: a large vocabulary packs to more than 2 GiB per process
+	uint64_t* sendcounts = malloc(sizeof(*sendcounts) * wsize);
+	size_t* sdispls = malloc(sizeof(*sdispls) * wsize);
+	uint64_t* recvcounts = malloc(sizeof(*recvcounts) * wsize);
+	size_t* rdispls = malloc(sizeof(*rdispls) * wsize);
+	struct pack_cursor* sections = malloc(sizeof(*sections) * wsize);
+
+	size_t total = 0;
+	for(int p = 0; p < wsize; p++){
+		sdispls[p] = total;
+		total += SECTION_BOUND(sizes[p][0], sizes[p][1]);
+	}
+	unsigned char* sendbuf = malloc(sizeof(*sendbuf) * (total ? total : 1));
+	for(int p = 0; p < wsize; p++)
+		sections[p] = start_section(sendbuf + sdispls[p], sizes[p][0], sizes[p][1]);
 
-	MPI_Type_create_struct(count, block_length, displacements, types, histogram_element_dt);
+	cursor.sections = sections;
+	dic_forEach(dic, pack_partition, &cursor);
+	for(int p = 0; p < wsize; p++)
+		sendcounts[p] = sections[p].counts - (sendbuf + sdispls[p]);
+	trace_event("histogram build", NULL, start, total);
 
-	return MPI_Type_commit(histogram_element_dt);
+	// Exchanging partitions
+	start = trace_now();
+	MPI_Alltoall(sendcounts, 1, MPI_UINT64_T, recvcounts, 1, MPI_UINT64_T, comm);
+	size_t recv_total = 0;
+	for(int p = 0; p < wsize; p++){
+		rdispls[p] = recv_total;
+		recv_total += recvcounts[p];
+	}
+	unsigned char* recvbuf = malloc(sizeof(*recvbuf) * (recv_total ? recv_total : 1));
+
+	alltoallv_bytes(sendbuf, sendcounts, sdispls, recvbuf, recvcounts, rdispls, comm);
+	free(sendbuf);
+	trace_event("gather", NULL, start, recv_total);
+
+	// Reducing the owned slice of the vocabulary
+	start = trace_now();
+	struct dictionary* owned = dic_new(0);
+	for(int p = 0; p < wsize; p++)
+		merge_dict(owned, recvbuf + rdispls[p], recvcounts[p]);
+	dic_delete(dic);
+	trace_event("merge", NULL, start, recv_total);
+
+	free(recvbuf);
+	free(sections);
+	free(sendcounts);
+	free(sdispls);
+	free(recvcounts);
+	free(rdispls);
+	free(sizes);
+	free(load);
+	free(owner);
+	return owned;
+}
+
+/*********************************************************************************
+ * Global word IDs.
+ * The vocabulary is mostly shared between processes, so with a flat or a tree
+ * reduction root receives and merges the same strings up to wsize times. Here
+ * root receives every word once and only sums counts. Words still travel to agree
+ * on an ID (a word every process has is sent by every process, to its owner), but
+ * that load is spread over all the owners instead of piling up on root.
+ * Phase 1, a distributed merge of the key sets: every word is sent, without its
+ * count, to an owner picked by hash. Owners drop duplicates and number the words
+ * they got, an MPI_Exscan over how many each one has turns those numbers into
+ * global IDs (owner by owner, in rank order), and a second MPI_Alltoallv sends the
+ * IDs back, in the same order the words came in.
+ * Phase 2: every process lays its counts in a dense vector indexed by ID, and one
+ * MPI_Reduce sums the vectors on root. Root gets the words themselves from the
+ * owners, already in ID order, and only needs them once.
+ * *******************************************************************************/
+
+struct key_cursor {
+	int wsize;
+	size_t* sizes;				/* words and bytes per destination, when measuring */
+	unsigned char** out;		/* write position per destination, when packing */
+	int*** values;				/* write position per destination in the list of counts, when packing */
+};
+
+static int measure_keys(void *key, int count, int *value, void *user){
+	struct key_cursor* cursor = user;
+	if(*value){
+		int dest = shuffle_hash(key, count) % cursor->wsize;
+		cursor->sizes[2 * dest]++;
+		cursor->sizes[2 * dest + 1] += 1 + count;
+	}
+	return 1;
 }
 
+/* Wire format of a key: uint8 len, the word */
+static int pack_key(void *key, int count, int *value, void *user){
+	struct key_cursor* cursor = user;
+	if(*value){
+		int dest = shuffle_hash(key, count) % cursor->wsize;
+		*cursor->out[dest]++ = count;
+		memcpy(cursor->out[dest], key, count);
+		cursor->out[dest] += count;
+		*cursor->values[dest]++ = value;
+	}
+	return 1;
+}
+
+void reduce_word_ids(struct dictionary* dic, int root, MPI_Comm comm){
+	int rank, wsize;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &wsize);
+
+	// Sizes and offsets in bytes, 64 bits wide: the keys of a large vocabulary pack to more than 2 GiB
+	uint64_t* sendcounts = malloc(sizeof(*sendcounts) * wsize);
+	size_t* sdispls = malloc(sizeof(*sdispls) * wsize);
+	uint64_t* recvcounts = malloc(sizeof(*recvcounts) * wsize);
+	size_t* rdispls = malloc(sizeof(*rdispls) * wsize);
+	uint64_t* id_sendcounts = malloc(sizeof(*id_sendcounts) * wsize);
+	size_t* id_sdispls = malloc(sizeof(*id_sdispls) * wsize);
+	uint64_t* id_recvcounts = malloc(sizeof(*id_recvcounts) * wsize);
+	size_t* id_rdispls = malloc(sizeof(*id_rdispls) * wsize);
+
+	// Packing the keys, grouped by owner, and remembering where every count is
+	double start = trace_now();
+	size_t* sizes = calloc(2 * wsize, sizeof(*sizes));
+	struct key_cursor cursor = { wsize, sizes, NULL, NULL };
+	dic_forEach(dic, measure_keys, &cursor);
+
+	size_t total = 0, nkeys = 0;
+	for(int p = 0; p < wsize; p++){
+		sdispls[p] = total;
+		sendcounts[p] = sizes[2 * p + 1];
+		total += sizes[2 * p + 1];
+		id_rdispls[p] = nkeys * sizeof(int32_t);
+		id_recvcounts[p] = sizes[2 * p] * sizeof(int32_t);
+		nkeys += sizes[2 * p];
+	}
+	unsigned char* sendbuf = malloc(sizeof(*sendbuf) * (total ? total : 1));
+	int** values = malloc(sizeof(*values) * (nkeys ? nkeys : 1));
+	unsigned char** out = malloc(sizeof(*out) * wsize);
+	int*** value_out = malloc(sizeof(*value_out) * wsize);
+	for(int p = 0; p < wsize; p++){
+		out[p] = sendbuf + sdispls[p];
+		value_out[p] = values + id_rdispls[p] / sizeof(int32_t);
+	}
+	cursor.out = out;
+	cursor.values = value_out;
+	dic_forEach(dic, pack_key, &cursor);
+	free(value_out);
+	free(out);
+	trace_event("histogram build", NULL, start, total);
+
+	// Phase 1: every owner gets the words that hash to it
+	start = trace_now();
+	MPI_Alltoall(sendcounts, 1, MPI_UINT64_T, recvcounts, 1, MPI_UINT64_T, comm);
+	size_t recv_total = 0;
+	for(int p = 0; p < wsize; p++){
+		rdispls[p] = recv_total;
+		recv_total += recvcounts[p];
+	}
+	unsigned char* recvbuf = malloc(sizeof(*recvbuf) * (recv_total ? recv_total : 1));
+	alltoallv_bytes(sendbuf, sendcounts, sdispls, recvbuf, recvcounts, rdispls, comm);
+	free(sendbuf);
+
+	// Numbering the distinct words received, in order of first appearance
+	struct dictionary* owned = dic_new(0);
+	int32_t* ids = malloc(sizeof(*ids) * (recv_total ? recv_total : 1));
+	unsigned char** owned_words = malloc(sizeof(*owned_words) * (recv_total ? recv_total : 1));
+	int nowned = 0;
+	size_t nreceived = 0;
+	for(int p = 0; p < wsize; p++){
+		const unsigned char* in = recvbuf + rdispls[p];
+		const unsigned char* end = in + recvcounts[p];
+		id_sdispls[p] = nreceived * sizeof(*ids);
+		while(in < end){
+			int len = *in;
+			if(dic_find(owned, (void*)(in + 1), len))
+				ids[nreceived++] = *owned->value;
+			else {
+				dic_add(owned, (void*)(in + 1), len);
+				*owned->value = nowned;
+				owned_words[nowned] = (unsigned char*)in;
+				ids[nreceived++] = nowned++;
+			}
+			in += 1 + len;
+		}
+		id_sendcounts[p] = nreceived * sizeof(*ids) - id_sdispls[p];
+	}
+	dic_delete(owned);
+
+	int base = 0, vocabulary = 0;
+	MPI_Exscan(&nowned, &base, 1, MPI_INT, MPI_SUM, comm);
+	if(rank == 0)
+		base = 0;
+	MPI_Allreduce(&nowned, &vocabulary, 1, MPI_INT, MPI_SUM, comm);
+	for(size_t i = 0; i < nreceived; i++)
+		ids[i] += base;
+
+	// IDs go back to whoever sent the words, in the order they were sent
+	int32_t* my_ids = malloc(sizeof(*my_ids) * (nkeys ? nkeys : 1));
+	alltoallv_bytes(ids, id_sendcounts, id_sdispls, my_ids, id_recvcounts, id_rdispls, comm);
+	free(ids);
+	trace_event("word ids", NULL, start, vocabulary);
+
+	// Phase 2: a plain vector sum
+	start = trace_now();
+	int* dense = calloc(vocabulary ? vocabulary : 1, sizeof(*dense));
+	for(size_t i = 0; i < nkeys; i++)
+		dense[my_ids[i]] = *values[i];
+	free(my_ids);
+	free(values);
+	int* summed = rank == root ? malloc(sizeof(*summed) * (vocabulary ? vocabulary : 1)) : NULL;
+	MPI_Reduce(dense, summed, vocabulary, MPI_INT, MPI_SUM, root, comm);
+	free(dense);
+	trace_event("gather", NULL, start, (long)vocabulary * sizeof(*dense));
+
+	// Root gets every word once, from its owner, in ID order
+	start = trace_now();
+	size_t owned_bytes = 0;
+	for(int i = 0; i < nowned; i++)
+		owned_bytes += 1 + owned_words[i][0];
+	unsigned char* vocab_out = malloc(sizeof(*vocab_out) * (owned_bytes ? owned_bytes : 1));
+	unsigned char* cur = vocab_out;
+	for(int i = 0; i < nowned; i++){
+		memcpy(cur, owned_words[i], 1 + owned_words[i][0]);
+		cur += 1 + owned_words[i][0];
+	}
+	free(owned_words);
+	free(recvbuf);
+
+	unsigned char* vocab = gather_bytes(vocab_out, owned_bytes, root, comm, &recv_total);
+	free(vocab_out);
+
+	if(rank == root){
+		dic_reserve(dic, vocabulary);
+		const unsigned char* in = vocab;
+		for(int id = 0; id < vocabulary; id++){
+			int len = *in++;
+			if(dic_find(dic, (void*)in, len))
+				*dic->value = summed[id];
+			else {
+				dic_add(dic, (void*)in, len);
+				*dic->value = summed[id];
+			}
+			in += len;
+		}
+		free(vocab);
+		free(summed);
+	}
+	trace_event("merge", NULL, start, vocabulary);
+
+	free(sizes);
+	free(sendcounts);
+	free(sdispls);
+	free(recvcounts);
+	free(rdispls);
+	free(id_sendcounts);
+	free(id_sdispls);
+	free(id_recvcounts);
+	free(id_rdispls);
+}
@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "mpi.h"
+#include "chnkcnt.h"
+#include "hll.h"
+
+/*********************************************************************************
+ * Distinct words with HyperLogLog.
+ * The first HLL_PRECISION bits of the 64-bit hash of a word pick a register, and
+ * the register keeps the maximum position of the first set bit in the rest. With
+ * many words, the harmonic mean of 2^register over all registers estimates how
+ * many distinct words were seen. Sketches of different processes are merged with
+ * a plain MPI_MAX on the registers, so the whole vocabulary never moves: just
+ * 16 KiB per process.
+ * *******************************************************************************/
+
+/* FNV-1a, with the MurmurHash3 finalizer so every bit of the result depends on every byte of the word */
+static uint64_t hash_word(const char* word, size_t len){
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)word[i]) * 0x100000001b3ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+void hll_init(Hll_sketch* sketch){
+    memset(sketch->registers, 0, sizeof(sketch->registers));
+}
+
+void hll_add(const char* word, size_t len, void* user){
+    Hll_sketch* sketch = user;
+    uint64_t h = hash_word(word, len);
+    uint64_t rest = h << HLL_PRECISION;
+    unsigned char rank = rest ? __builtin_clzll(rest) + 1 : 64 - HLL_PRECISION + 1;
+    unsigned char* reg = &sketch->registers[h >> (64 - HLL_PRECISION)];
+    if(rank > *reg)
+        *reg = rank;
+}
+
+double hll_estimate(const Hll_sketch* sketch){
+    double m = HLL_REGISTERS, sum = 0;
+    int zeros = 0;
+    for(int i = 0; i < HLL_REGISTERS; i++){
+        sum += ldexp(1.0, -sketch->registers[i]);
+        zeros += !sketch->registers[i];
+    }
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+    /* Few words: most registers are still empty, and counting them (linear counting) is more accurate */
+    if(estimate <= 2.5 * m && zeros)
+        estimate = m * log(m / zeros);
+    return estimate;
+}
+
+void hll_sketch_chunks(Hll_sketch* sketch, Chunk_vector* chunks){
+    for(size_t i = 0; chunks && i < chunks->size; i++){
+        File_chunk owned = chunks->chunks[i];
+        own_words(&owned);
+        tokenize_chunk(owned.file_name, owned.start, owned.end, hll_add, sketch);
+    }
+}
+
+double hll_vocabulary_hint(Chunk_vector* chunks){
+    long total = 0, sampled = 0;
+    for(size_t i = 0; chunks && i < chunks->size; i++)
+        total += chunks->chunks[i].end - chunks->chunks[i].start;
+    if(total < HLL_HINT_MIN_INPUT)
+        return 0;
+
+    // The beginning of every chunk, in proportion to its size: one big file doesn't hide the vocabulary of the others
+    Hll_sketch* sketch = malloc(sizeof(*sketch));
+    hll_init(sketch);
+    for(size_t i = 0; i < chunks->size; i++){
+        File_chunk owned = chunks->chunks[i];
+        own_words(&owned);
+        long share = (double)(owned.end - owned.start) * HLL_HINT_SAMPLE / total + 1;
+        if(owned.end - owned.start > share)
+            owned.end = owned.start + share;
+        if(owned.end > owned.start){
+            tokenize_chunk(owned.file_name, owned.start, owned.end, hll_add, sketch);
+            sampled += owned.end - owned.start;
+        }
+    }
+    double estimate = hll_estimate(sketch);
+    free(sketch);
+
+    if(sampled < total && sampled > 0)
+        estimate *= pow((double)total / sampled, HEAPS_BETA);
+    return estimate;
+}
+
+void hll_reduce(Hll_sketch* sketch, int root, MPI_Comm comm){
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    if(rank == root)
+        MPI_Reduce(MPI_IN_PLACE, sketch->registers, HLL_REGISTERS, MPI_UNSIGNED_CHAR, MPI_MAX, root, comm);
+    else
+        MPI_Reduce(sketch->registers, NULL, HLL_REGISTERS, MPI_UNSIGNED_CHAR, MPI_MAX, root, comm);
+}
+
+void hll_allreduce(Hll_sketch* sketch, MPI_Comm comm){
+    MPI_Allreduce(MPI_IN_PLACE, sketch->registers, HLL_REGISTERS, MPI_UNSIGNED_CHAR, MPI_MAX, comm);
+}
@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "mpi.h"
+#include "hashdict.h"
+#include "chnkcnt.h"
+#include "chnkpool.h"
+#include "histogram.h"
+#include "rescache.h"
+
+/*********************************************************************************
+ * Persistent cache of per-file histograms.
+ * Every file that has been counted once has an entry in the cache directory,
+ * named after the hash of its path, holding:
+ *
+ *   char       magic[8]        CACHE_MAGIC
+ *   Cache_key  key             size, mtime and content hash of the file, character set
+ *   uint32_t   path_len
+ *   char       path[path_len]  to tell apart two paths with the same hash
+ *   ...        the packed histogram of the file (see histogram.h)
+ *
+ * The content hash only samples the file (CACHE_SAMPLE bytes at the start, in the
+ * middle and at the end): hashing it all would cost as much as counting it. Size
+ * and mtime catch the rest.
+ * To store per-file histograms the files are counted with the word ownership rule
+ * of own_words instead of the boundary exchange: every chunk gets a histogram that
+ * is exact on its own, and the histograms of the chunks of a file add up to the
+ * histogram of the file.
+ * A file counted by a single process is stored and merged by that process, and
+ * reduced with everything else. Only the pieces of the files split between
+ * processes go to root, which stores each file as soon as its last piece is in.
+ * *******************************************************************************/
+
+static uint64_t fnv1a(uint64_t h, const unsigned char* data, size_t len){
+    for(size_t i = 0; i < len; i++)
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+static int make_key(const char* file_name, Cache_key* key){
+    memset(key, 0, sizeof(*key));
+    int fd = open(file_name, O_RDONLY);
+    struct stat file_status;
+    if(fd < 0 || fstat(fd, &file_status) < 0){
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+    key->size = file_status.st_size;
+    key->mtime_sec = file_status.st_mtim.tv_sec;
+    key->mtime_nsec = file_status.st_mtim.tv_nsec;
+    key->charset = tokenize_charset();
+
+    unsigned char* sample = malloc(sizeof(*sample) * CACHE_SAMPLE);
+    long offsets[3] = { 0, (long)(key->size / 2), (long)key->size - CACHE_SAMPLE };
+    uint64_t h = fnv1a(FNV_OFFSET, (const unsigned char*)&key->size, sizeof(key->size));
+    int failed = 0;
+    for(int i = 0; i < 3 && !failed; i++){
+        ssize_t bytesread = pread(fd, sample, CACHE_SAMPLE, offsets[i] > 0 ? offsets[i] : 0);
+        if(bytesread < 0)
+            failed = 1;
+        else
+            h = fnv1a(h, sample, bytesread);
+    }
+    key->content_hash = h;
+
+    free(sample);
+    close(fd);
+    return failed ? -1 : 0;
+}
+
+static char* entry_path(const char* dir, const char* file_name, const char* suffix){
+    char* path = malloc(sizeof(*path) * (strlen(dir) + 64));
+    uint64_t h = fnv1a(FNV_OFFSET, (const unsigned char*)file_name, strlen(file_name));
+    sprintf(path, "%s/%016" PRIx64 "%s", dir, h, suffix);
+    return path;
+}
+
+/* merge_dict trusts its input: an entry is checked before merging it, so a truncated or corrupted one is a miss */
+static int valid_histogram(const unsigned char* data, size_t size){
+    if(size < HISTOGRAM_HEADER)
+        return 0;
+    uint32_t nwords, blob_size;
+    memcpy(&nwords, data, sizeof(nwords));
+    memcpy(&blob_size, data + sizeof(nwords), sizeof(blob_size));
+    if(HISTOGRAM_HEADER + (size_t)nwords + blob_size > size)
+        return 0;
+
+    size_t total = 0;
+    for(uint32_t j = 0; j < nwords; j++)
+        total += data[HISTOGRAM_HEADER + j];
+    if(total != blob_size)
+        return 0;
+
+    const unsigned char* counts = data + HISTOGRAM_HEADER + nwords + blob_size;
+    const unsigned char* end = data + size;
+    for(uint32_t j = 0; j < nwords; j++){
+        int shift = 0;
+        do {
+            if(counts == end || shift > 28)
+                return 0;
+            shift += 7;
+        } while(*counts++ & 0x80);
+    }
+    return counts == end;
+}
+
+/* Merges the cached histogram of file_name in dic, if there's one for this very key. Returns 1 on a hit */
+static int load_entry(const char* dir, const char* file_name, const Cache_key* key, struct dictionary* dic){
+    char* path = entry_path(dir, file_name, "");
+    FILE* entry = fopen(path, "rb");
+    free(path);
+    if(!entry)
+        return 0;
+
+    int hit = 0;
+    char magic[sizeof(CACHE_MAGIC) - 1];
+    Cache_key stored;
+    uint32_t path_len;
+    size_t name_len = strlen(file_name);
+    unsigned char* data = NULL;
+    if(fread(magic, sizeof(magic), 1, entry) != 1 || memcmp(magic, CACHE_MAGIC, sizeof(magic)))
+        goto done;
+    if(fread(&stored, sizeof(stored), 1, entry) != 1 || memcmp(&stored, key, sizeof(stored)))
+        goto done;
+    if(fread(&path_len, sizeof(path_len), 1, entry) != 1 || path_len != name_len)
+        goto done;
+
+    struct stat entry_status;
+    if(fstat(fileno(entry), &entry_status) < 0)
+        goto done;
+    long header = sizeof(magic) + sizeof(stored) + sizeof(path_len) + path_len;
+    size_t size = entry_status.st_size - header;
+    if(entry_status.st_size < header)
+        goto done;
+
+    data = malloc(sizeof(*data) * (path_len + size + 1));
+    if(fread(data, 1, path_len + size, entry) != path_len + size || memcmp(data, file_name, path_len))
+        goto done;
+    if(!valid_histogram(data + path_len, size))
+        goto done;
+
+    merge_dict(dic, data + path_len, size);
+    hit = 1;
+
+done:
+    free(data);
+    fclose(entry);
+    return hit;
+}
+
+/* Writes the entry next to the old one and renames it over, so a run that dies halfway never leaves a torn entry */
+static void store_entry(const char* dir, const char* file_name, const Cache_key* key, struct dictionary* dic){
+    char* path = entry_path(dir, file_name, "");
+    char* temp_path = entry_path(dir, file_name, ".tmp");
+    packed_histogram packed = { NULL, 0, 0 };
+    pack_histogram(&packed, dic);
+
+    uint32_t path_len = strlen(file_name);
+    FILE* entry = fopen(temp_path, "wb");
+    int written = entry
+        && fwrite(CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1, 1, entry) == 1
+        && fwrite(key, sizeof(*key), 1, entry) == 1
+        && fwrite(&path_len, sizeof(path_len), 1, entry) == 1
+        && fwrite(file_name, 1, path_len, entry) == path_len
+        && fwrite(packed.data, 1, packed.size, entry) == packed.size;
+    if(entry && fclose(entry))
+        written = 0;
+    if(!written || rename(temp_path, path)){
+        fprintf(stderr, "Could not cache the histogram of %s in %s\n", file_name, dir);
+        unlink(temp_path);
+    }
+
+    free_packed_histogram(&packed);
+    free(temp_path);
+    free(path);
+}
+
+size_t cache_lookup(Result_cache* cache, File_vector** files, size_t* total_size, struct dictionary* dic){
+    if(mkdir(cache->dir, 0755) && errno != EEXIST)
+        fprintf(stderr, "Could not create the cache directory %s\n", cache->dir);
+
+    size_t nfiles = files[0]->size, kept = 0;
+    cache->keys = malloc(sizeof(*cache->keys) * (nfiles ? nfiles : 1));
+    cache->keyed = malloc(sizeof(*cache->keyed) * (nfiles ? nfiles : 1));
+    for(size_t i = 0; i < nfiles; i++){
+        File_info file = files[0]->files[i];
+        Cache_key key;
+        int keyed = !make_key(file.file_name, &key);
+        if(keyed && load_entry(cache->dir, file.file_name, &key, dic)){
+            *total_size -= file.file_size;
+            free(file.file_name);
+            continue;
+        }
+        cache->keys[kept] = key;
+        cache->keyed[kept] = keyed;
+        files[0]->files[kept++] = file;
+    }
+    files[0]->size = kept;
+    return nfiles - kept;
+}
+
+static void buffer_append(unsigned char** buffer, size_t* size, size_t* capacity, const void* data, size_t len){
+    if(*size + len > *capacity){
+        *capacity = (*size + len) * 2;
+        *buffer = realloc(*buffer, sizeof(**buffer) * *capacity);
+    }
+    memcpy(*buffer + *size, data, len);
+    *size += len;
+}
+
+/* Every process stores the files it counted whole, so every process needs their keys */
+static void share_keys(Result_cache* cache, size_t nfiles, int root, MPI_Comm comm){
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    if(rank != root){
+        cache->keys = malloc(sizeof(*cache->keys) * (nfiles ? nfiles : 1));
+        cache->keyed = malloc(sizeof(*cache->keyed) * (nfiles ? nfiles : 1));
+    }
+    bcast_bytes((char*)cache->keys, sizeof(*cache->keys) * nfiles, root, comm);
+    bcast_bytes(cache->keyed, sizeof(*cache->keyed) * nfiles, root, comm);
+}
+
+/* The histogram of a file is complete: it goes in the cache and in dic */
+static void finish_file(Result_cache* cache, File_vector* files, size_t index, struct dictionary* file_dic, struct dictionary* dic){
+    // A zeroed key would match no file, or worse the wrong one: without a key there's nothing to store
+    if(cache->keyed[index])
+        store_entry(cache->dir, files->files[index].file_name, &cache->keys[index], file_dic);
+    merge_dictionary(dic, file_dic);
+    dic_delete(file_dic);
+}
+
+/* Root only. One more piece of a split file has been merged in pending, the last one finishes the file */
+static void piece_merged(Result_cache* cache, File_vector* files, struct dictionary** pending, int* remaining, size_t index,
+        struct dictionary* dic){
+    if(--remaining[index] == 0){
+        finish_file(cache, files, index, pending[index], dic);
+        pending[index] = NULL;
+    }
+}
+
+/* Records are a uint32_t file index, a uint64_t size and a packed histogram of that size */
+static void merge_records(Result_cache* cache, File_vector* files, struct dictionary** pending, int* remaining,
+        const unsigned char* records, size_t size, struct dictionary* dic){
+    size_t offset = 0;
+    while(offset + sizeof(uint32_t) + sizeof(uint64_t) <= size){
+        uint32_t index;
+        uint64_t len;
+        memcpy(&index, records + offset, sizeof(index));
+        memcpy(&len, records + offset + sizeof(index), sizeof(len));
+        offset += sizeof(index) + sizeof(len);
+        if(index < files->size && remaining[index] > 0){
+            if(!pending[index])
+                pending[index] = dic_new(0);
+            merge_dict(pending[index], records + offset, len);
+            piece_merged(cache, files, pending, remaining, index, dic);
+        }
+        offset += len;
+    }
+}
+
+void count_and_cache(Result_cache* cache, File_vector* files, Chunk_vector** chunks_proc, int nthreads, struct dictionary* dic, int root, MPI_Comm comm){
+    int rank, wsize;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &wsize);
+    share_keys(cache, files->size, root, comm);
+
+    // Root waits for one piece of a split file from every process holding a chunk of it. The workload goes
+    // through the files in order, one process after the other, so a single pass over it finds them all
+    struct dictionary** pending = NULL;
+    int* remaining = NULL;
+    if(rank == root){
+        pending = calloc(files->size ? files->size : 1, sizeof(*pending));
+        remaining = calloc(files->size ? files->size : 1, sizeof(*remaining));
+        size_t index = 0;
+        for(int p = 0; p < wsize; p++){
+            for(size_t i = 0; chunks_proc[p] && i < chunks_proc[p]->size; i++){
+                while(index < files->size && strcmp(files->files[index].file_name, chunks_proc[p]->chunks[i].file_name))
+                    index++;
+                if(index < files->size && chunks_proc[p]->chunks[i].special_position != UNIQUE)
+                    remaining[index]++;
+            }
+        }
+
+        // Empty files have no chunks, and get an empty entry
+        for(size_t i = 0; i < files->size; i++)
+            if(files->files[i].file_size == 0)
+                finish_file(cache, files, i, dic_new(0), dic);
+    }
+
+    // Whole files are finished here, pieces of split files are finished by root
+    unsigned char* records = NULL;
+    size_t size = 0, capacity = 0;
+    packed_histogram packed = { NULL, 0, 0 };
+    Chunk_vector* chunks = chunks_proc[rank];
+    Chunk_vector* single = malloc(sizeof(*single) + sizeof(single->chunks[0]));
+    single->owner = rank;
+    single->size = 1;
+
+    uint32_t index = 0;
+    for(size_t i = 0; chunks && i < chunks->size; i++){
+        while(index < files->size && strcmp(files->files[index].file_name, chunks->chunks[i].file_name))
+            index++;
+
+        single->chunks[0] = chunks->chunks[i];
+        own_words(&single->chunks[0]);
+        struct dictionary* file_dic = dic_new(0);
+        count_chunk_vector(single, nthreads, file_dic);
+
+        if(chunks->chunks[i].special_position == UNIQUE)
+            finish_file(cache, files, index, file_dic, dic);
+        else if(rank == root){
+            if(pending[index]){
+                merge_dictionary(pending[index], file_dic);
+                dic_delete(file_dic);
+            }
+            else
+                pending[index] = file_dic;
+            piece_merged(cache, files, pending, remaining, index, dic);
+        }
+        else {
+            pack_histogram(&packed, file_dic);
+            dic_delete(file_dic);
+            uint64_t len = packed.size;
+            buffer_append(&records, &size, &capacity, &index, sizeof(index));
+            buffer_append(&records, &size, &capacity, &len, sizeof(len));
+            buffer_append(&records, &size, &capacity, packed.data, len);
+        }
+    }
+    free(single);
+    free_packed_histogram(&packed);
+
+    if(rank != root){
+        send_large(records, size, root, CACHE_TAG, comm);
+        free(records);
+        return;
+    }
+
+    // A process holds at most two split files, its first and its last: that's all root keeps at a time
+    for(int i = 1; i < wsize; i++){
+        size_t incoming_size;
+        unsigned char* incoming = recv_large(MPI_ANY_SOURCE, CACHE_TAG, comm, &incoming_size);
+        merge_records(cache, files, pending, remaining, incoming, incoming_size, dic);
+        free(incoming);
+    }
+    free(pending);
+    free(remaining);
+}
+
+void free_result_cache(Result_cache* cache){
+    free(cache->keys);
+    free(cache->keyed);
+    cache->keys = NULL;
+    cache->keyed = NULL;
+}
@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "mpi.h"
+#include "hashdict.h"
+#include "tokenize.h"
+#include "trace.h"
+#include "sortout.h"
+
+/*********************************************************************************
+ * Sorted output with a sample sort.
+ * Every process sorts its own words, and sends SORT_SAMPLES of them, evenly spaced
+ * in its sorted order, to everybody. All processes sort the samples the same way
+ * and take the same wsize-1 splitters from them, evenly spaced again: process i
+ * gets the words between splitter i-1 and splitter i. A single MPI_Alltoallv moves
+ * every word to its process, which sorts what it got and formats its lines.
+ * An MPI_Exscan over the sizes of the formatted ranges gives every process its
+ * offset in the output file, and they all write at once with MPI_File_write_at_all.
+ * Words are unique across processes (the shuffle made sure of it), so the keys are
+ * all distinct and splitters never have to break a tie.
+ * *******************************************************************************/
+
+typedef struct{
+    const char* word;
+    int         len;
+    int         count;
+} Sort_record;
+
+/* Fixed size, so the samples travel with a plain MPI_Allgatherv of bytes */
+typedef struct{
+    int32_t         count;
+    unsigned char   len;
+    char            word[WORD_MAX];
+} Sort_sample;
+
+static int by_word(const void* a, const void* b){
+    const Sort_record* x = a;
+    const Sort_record* y = b;
+    int c = memcmp(x->word, y->word, x->len < y->len ? x->len : y->len);
+    if(c)
+        return c;
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+static int by_count(const void* a, const void* b){
+    const Sort_record* x = a;
+    const Sort_record* y = b;
+    if(x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return by_word(a, b);
+}
+
+typedef struct{
+    Sort_record*    records;
+    size_t          size;
+} Record_list;
+
+static int collect_word(void *key, int count, int *value, void *user){
+    Record_list* list = user;
+    if(*value){
+        list->records[list->size].word = key;
+        list->records[list->size].len = count;
+        list->records[list->size].count = *value;
+        list->size++;
+    }
+    return 1;
+}
+
+/* Every process gets the same splitters: the samples of all processes, sorted, evenly spaced */
+static Sort_record* pick_splitters(Sort_record* records, size_t size, int (*compare)(const void*, const void*), Sort_sample** samples_out, MPI_Comm comm){
+    int wsize;
+    MPI_Comm_size(comm, &wsize);
+
+    int nsamples = size < SORT_SAMPLES ? size : SORT_SAMPLES;
+    Sort_sample* local = malloc(sizeof(*local) * (nsamples ? nsamples : 1));
+    for(int i = 0; i < nsamples; i++){
+        const Sort_record* record = &records[(size_t)i * size / nsamples];
+        local[i].count = record->count;
+        local[i].len = record->len;
+        memcpy(local[i].word, record->word, record->len);
+    }
+
+    int* counts = malloc(sizeof(*counts) * wsize);
+    int* displs = malloc(sizeof(*displs) * wsize);
+    int bytes = nsamples * sizeof(*local);
+    MPI_Allgather(&bytes, 1, MPI_INT, counts, 1, MPI_INT, comm);
+    int total = 0;
+    for(int i = 0; i < wsize; i++){
+        displs[i] = total;
+        total += counts[i];
+    }
+    Sort_sample* samples = malloc(total ? total : 1);
+    MPI_Allgatherv(local, bytes, MPI_BYTE, samples, counts, displs, MPI_BYTE, comm);
+    total /= sizeof(*samples);
+
+    Sort_record* sorted = malloc(sizeof(*sorted) * (total ? total : 1));
+    for(int i = 0; i < total; i++){
+        sorted[i].word = samples[i].word;
+        sorted[i].len = samples[i].len;
+        sorted[i].count = samples[i].count;
+    }
+    qsort(sorted, total, sizeof(*sorted), compare);
+
+    // No words anywhere, no splitters: everything (nothing) goes to rank 0
+    Sort_record* splitters = NULL;
+    if(total){
+        splitters = malloc(sizeof(*splitters) * wsize);
+        for(int i = 1; i < wsize; i++)
+            splitters[i - 1] = sorted[(long)i * total / wsize];
+    }
+
+    free(sorted);
+    free(displs);
+    free(counts);
+    free(local);
+    *samples_out = samples;
+    return splitters;
+}
+
+/* Wire format of a record: uint8 len, the word, int32 count */
+static size_t record_size(const Sort_record* record){
+    return 1 + record->len + sizeof(int32_t);
+}
+
+/* Moves every record to the process owning its range. Returns the records received, pointing into *incoming */
+static Sort_record* exchange_records(Sort_record* records, size_t size, const Sort_record* splitters, int (*compare)(const void*, const void*), unsigned char** incoming, size_t* received, MPI_Comm comm){
+    int wsize;
+    MPI_Comm_size(comm, &wsize);
+
+    // Records are sorted, so the destinations only go up and the send buffer is already in rank order
+    int* send_counts = calloc(wsize, sizeof(*send_counts));
+    int* send_displs = malloc(sizeof(*send_displs) * wsize);
+    int* recv_counts = malloc(sizeof(*recv_counts) * wsize);
+    int* recv_displs = malloc(sizeof(*recv_displs) * wsize);
+    size_t send_size = 0;
+    int dest = 0;
+    for(size_t i = 0; i < size; i++){
+        while(splitters && dest < wsize - 1 && compare(&records[i], &splitters[dest]) >= 0)
+            dest++;
+        send_counts[dest] += record_size(&records[i]);
+        send_size += record_size(&records[i]);
+    }
+
+    unsigned char* outgoing = malloc(sizeof(*outgoing) * (send_size ? send_size : 1));
+    unsigned char* cursor = outgoing;
+    for(size_t i = 0; i < size; i++){
+        int32_t count = records[i].count;
+        *cursor++ = records[i].len;
+        memcpy(cursor, records[i].word, records[i].len); cursor += records[i].len;
+        memcpy(cursor, &count, sizeof(count)); cursor += sizeof(count);
+    }
+
+    MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, comm);
+    size_t recv_size = 0;
+    for(int i = 0; i < wsize; i++){
+        send_displs[i] = i ? send_displs[i - 1] + send_counts[i - 1] : 0;
+        recv_displs[i] = recv_size;
+        recv_size += recv_counts[i];
+    }
+    *incoming = malloc(sizeof(**incoming) * (recv_size ? recv_size : 1));
+    MPI_Alltoallv(outgoing, send_counts, send_displs, MPI_BYTE, *incoming, recv_counts, recv_displs, MPI_BYTE, comm);
+    free(outgoing);
+
+    // No more records than the smallest possible record size allows
+    Sort_record* mine = malloc(sizeof(*mine) * (recv_size / (1 + sizeof(int32_t)) + 1));
+    size_t n = 0;
+    const unsigned char* in = *incoming;
+    const unsigned char* end = *incoming + recv_size;
+    while(in < end){
+        int32_t count;
+        mine[n].len = *in++;
+        mine[n].word = (const char*)in; in += mine[n].len;
+        memcpy(&count, in, sizeof(count)); in += sizeof(count);
+        mine[n].count = count;
+        n++;
+    }
+    *received = n;
+
+    free(recv_displs);
+    free(recv_counts);
+    free(send_displs);
+    free(send_counts);
+    return mine;
+}
+
+static int write_range(const char* range, size_t size, const char* output_file, int root, MPI_Comm comm){
+    int rank, wsize;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &wsize);
+
+    if(!output_file){
+        // Through the root, like the shards: mpirun would interleave the lines of different processes
+        int count = size;
+        int* counts = NULL;
+        int* displs = NULL;
+        char* all = NULL;
+        if(rank == root){
+            counts = malloc(sizeof(*counts) * wsize);
+            displs = malloc(sizeof(*displs) * wsize);
+        }
+        MPI_Gather(&count, 1, MPI_INT, counts, 1, MPI_INT, root, comm);
+        if(rank == root){
+            size_t total = 0;
+            for(int i = 0; i < wsize; i++){
+                displs[i] = total;
+                total += counts[i];
+            }
+            all = malloc(sizeof(*all) * (total ? total : 1));
+        }
+        MPI_Gatherv(range, count, MPI_CHAR, all, counts, displs, MPI_CHAR, root, comm);
+        if(rank == root){
+            fwrite(all, sizeof(*all), displs[wsize - 1] + counts[wsize - 1], stdout);
+            free(all);
+            free(displs);
+            free(counts);
+        }
+        return 0;
+    }
+
+    // Opening is collective, but not its outcome: nobody starts the collective writes unless everybody can
+    MPI_File fh;
+    int failed = MPI_File_open(comm, output_file, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS;
+    int opened = !failed;
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_LOR, comm);
+    if(failed){
+        if(opened)
+            MPI_File_close(&fh);
+        if(rank == root)
+            fprintf(stderr, "\nUnable to open file %s for writing.\n", output_file);
+        return -1;
+    }
+    MPI_File_set_size(fh, 0);
+
+    long long length = size, offset = 0;
+    MPI_Exscan(&length, &offset, 1, MPI_LONG_LONG, MPI_SUM, comm);
+    if(rank == 0)
+        offset = 0;
+
+    // Every process joins every round, even when it has nothing left to write
+    long long rounds = (length + SORT_WRITE_BLOCK - 1) / SORT_WRITE_BLOCK, max_rounds;
+    MPI_Allreduce(&rounds, &max_rounds, 1, MPI_LONG_LONG, MPI_MAX, comm);
+    for(long long i = 0; i < max_rounds; i++){
+        long long done = i * SORT_WRITE_BLOCK;
+        int block = done < length ? (length - done < SORT_WRITE_BLOCK ? length - done : SORT_WRITE_BLOCK) : 0;
+        MPI_File_write_at_all(fh, offset + (done < length ? done : length), range + (done < length ? done : length), block, MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+    MPI_File_close(&fh);
+    return 0;
+}
+
+int write_sorted(struct dictionary* dic, int key, const char* output_file, int root, MPI_Comm comm){
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    int (*compare)(const void*, const void*) = key == SORT_COUNT ? by_count : by_word;
+
+    double phase = trace_now();
+    Record_list local = { malloc(sizeof(*local.records) * (dic->count ? dic->count : 1)), 0 };
+    dic_forEach(dic, collect_word, &local);
+    qsort(local.records, local.size, sizeof(*local.records), compare);
+
+    Sort_sample* samples;
+    Sort_record* splitters = pick_splitters(local.records, local.size, compare, &samples, comm);
+
+    unsigned char* incoming;
+    size_t size;
+    Sort_record* records = exchange_records(local.records, local.size, splitters, compare, &incoming, &size, comm);
+    free(splitters);
+    free(samples);
+    free(local.records);
+
+    // Runs from different processes, each one sorted: qsort still has to interleave them
+    qsort(records, size, sizeof(*records), compare);
+    trace_event("sort", NULL, phase, size);
+
+    phase = trace_now();
+    char* range = NULL;
+    size_t range_size = 0;
+    FILE* stream = open_memstream(&range, &range_size);
+    // Rank 0 writes at offset 0, and comes first on stdout too
+    if(rank == 0)
+        fprintf(stream, "Word, Count\n");
+    for(size_t i = 0; i < size; i++)
+        fprintf(stream, "%.*s, %d\n", records[i].len, records[i].word, records[i].count);
+    fclose(stream);
+    free(records);
+    free(incoming);
+
+    int failed = write_range(range, range_size, output_file, root, comm);
+    free(range);
+    trace_event("write", NULL, phase, range_size);
+    return failed;
+}
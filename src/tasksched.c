@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "mpi.h"
+#include "hashdict.h"
+#include "chnkcnt.h"
+#include "chnkpool.h"
+#include "workload.h"
+#include "tasksched.h"
+
+/*********************************************************************************
+ * Dynamic scheduling.
+ * Every process builds the same list of tasks, and the index of the next task to
+ * hand out lives in an RMA window on rank 0. A process claims a task with
+ * MPI_Fetch_and_op (an atomic fetch-and-add on that index), counts it, and claims
+ * another one, until the index runs past the end of the list. Rank 0 doesn't run
+ * a master loop: it counts tasks like everybody else, and the MPI library
+ * serves the atomics. A slow process just ends up counting fewer tasks.
+ * Nobody knows in advance who counts the neighbours of a task, so tasks can't
+ * exchange their edge words like static chunks do. Instead a word belongs to the
+ * task it starts in: a task skips the tail of a word coming from the previous
+ * task, and reads past its end to complete its own last word. Every word is
+ * then counted exactly once, with nothing left to reconcile afterwards.
+ * *******************************************************************************/
+
+void count_tasks(Chunk_vector* tasks, int nthreads, struct dictionary* dic, MPI_Comm comm){
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    long* cursor;
+    MPI_Win win;
+    MPI_Win_allocate(rank == 0 ? sizeof(*cursor) : 0, sizeof(*cursor), MPI_INFO_NULL, comm, &cursor, &win);
+    if(rank == 0)
+        *cursor = 0;
+    // Nobody claims a task before the cursor is initialized
+    MPI_Barrier(comm);
+
+    size_t ntasks = tasks ? tasks->size : 0;
+    long one = 1, next;
+    Chunk_vector* task = malloc(sizeof(*task) + sizeof(task->chunks[0]));
+    task->owner = rank;
+    task->size = 1;
+
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+    for(;;){
+        MPI_Fetch_and_op(&one, &next, MPI_LONG, 0, 0, MPI_SUM, win);
+        MPI_Win_flush(0, win);
+        if(next >= (long)ntasks)
+            break;
+
+        task->chunks[0] = tasks->chunks[next];
+        own_words(&task->chunks[0]);
+        count_chunk_vector(task, nthreads, dic);
+    }
+    MPI_Win_unlock_all(win);
+
+    free(task);
+    MPI_Win_free(&win);
+}
@@ -0,0 +1,692 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "tokenize.h"
+#if defined(__x86_64__) && !defined(TOKENIZE_SCALAR)
+  #include <immintrin.h>
+#elif defined(__ARM_NEON) && !defined(TOKENIZE_SCALAR)
+  #include <arm_neon.h>
+#endif
+
+/*********************************************************************************
+ * Word tokenizer.
+ * A word is a maximal run of alphanumeric characters, lowercased. Instead of
+ * calling isalnum/tolower (which go through the locale) one byte at a time, each
+ * window of input is classified in SIMD registers: a range compare gives the
+ * "is alphanumeric" lane mask, which is both stored as a bitmask (one bit per
+ * byte) and used to add 0x20 to the uppercase lanes, so the lowercased window is
+ * written out with the same pass. Word spans are then read off the bitmask with
+ * count-trailing-zeros, 64 bytes at a time.
+ * The kernel is AVX2 (chosen at runtime) or SSE2 on x86_64, NEON on arm, and a
+ * table driven scalar loop everywhere else, or when building with
+ * -DTOKENIZE_SCALAR. All of them produce exactly the same words.
+ * The kernels only know ASCII, and that's the fast path of every character set:
+ * they also tell whether a window has any byte >= 0x80, and only such windows are
+ * classified again with the tables of the character set chosen at run time. With
+ * TOK_UTF8 the tables make every high byte a word byte, so runs of word bytes
+ * never split a multibyte character, and the runs with high bytes in them are
+ * decoded and split in words: characters that aren't letters (curly quotes, dashes,
+ * no-break spaces) and invalid bytes are delimiters, letters are case folded.
+ * Tokenizing a run never depends on what's around it, so anything that cuts the
+ * input at a non-word byte (pieces, tasks, aligned cuts) gets the same words, and
+ * the boundary exchange only has to tokenize again the runs on the cuts.
+ * *******************************************************************************/
+
+static int charset = TOK_ASCII;
+
+unsigned char tok_class[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+unsigned char tok_fold[256] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+    0x40, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
+    0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f,
+    0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
+    0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f,
+    0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf,
+    0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf,
+    0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf,
+    0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,
+    0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef,
+    0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff,
+};
+
+void tokenize_set_charset(int set){
+    charset = set;
+    for(int c = 0x80; c < 256; c++){
+        tok_class[c] = set == TOK_UTF8;
+        tok_fold[c] = c;
+    }
+    if(set == TOK_LATIN1){
+        for(int c = 0xc0; c < 256; c++)
+            tok_class[c] = c != 0xd7 && c != 0xf7;
+        for(int c = 0xc0; c < 0xdf; c++)
+            if(c != 0xd7)
+                tok_fold[c] = c + 0x20;
+        tok_class[0xaa] = tok_class[0xb5] = tok_class[0xba] = 1;
+    }
+}
+
+int tokenize_charset(void){
+    return charset;
+}
+
+/* Classifies n bytes of src: writes the lowercased bytes to dst and sets bit i of masks if src[i] is a word character.
+   masks must have room for n/64 + 1 words, all bits past n are cleared. The SIMD kernels only know ASCII: they
+   return nonzero if there's any byte >= 0x80 in src, and then the caller has to look at it with the tables. */
+typedef int (*classify_func)(const char* src, size_t n, char* dst, uint64_t* masks);
+
+/* Table driven classification of src[from .. n), used for the tails of the SIMD kernels too */
+static inline int classify_tail(const char* src, size_t from, size_t n, char* dst, uint64_t* masks){
+    unsigned char high = 0;
+    for(size_t i = from; i < n; i++){
+        unsigned char c = src[i];
+        high |= c;
+        dst[i] = tok_fold[c];
+        masks[i / 64] |= (uint64_t)tok_class[c] << (i % 64);
+    }
+    return high & 0x80;
+}
+
+#if !defined(__x86_64__) && !defined(__ARM_NEON) || defined(TOKENIZE_SCALAR)
+static int classify_scalar(const char* src, size_t n, char* dst, uint64_t* masks){
+    memset(masks, 0, sizeof(*masks) * (n / 64 + 1));
+    return classify_tail(src, 0, n, dst, masks);
+}
+#endif
+
+#if defined(__x86_64__) && !defined(TOKENIZE_SCALAR)
+/* Signed compares: bytes >= 0x80 are negative, so they fall outside every range and are never part of a word */
+#define SSE_IN_RANGE(v, lo, hi) _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((lo) - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8((hi) + 1)))
+
+static int classify_sse2(const char* src, size_t n, char* dst, uint64_t* masks){
+    size_t i = 0;
+    __m128i any = _mm_setzero_si128();
+    memset(masks, 0, sizeof(*masks) * (n / 64 + 1));
+    for(; i + 16 <= n; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        any = _mm_or_si128(any, v);
+        __m128i upper = SSE_IN_RANGE(v, 'A', 'Z');
+        __m128i word = _mm_or_si128(_mm_or_si128(upper, SSE_IN_RANGE(v, 'a', 'z')), SSE_IN_RANGE(v, '0', '9'));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8(0x20))));
+        masks[i / 64] |= (uint64_t)(uint16_t)_mm_movemask_epi8(word) << (i % 64);
+    }
+    return classify_tail(src, i, n, dst, masks) | _mm_movemask_epi8(any);
+}
+
+#define AVX_IN_RANGE(v, lo, hi) _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8((lo) - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), v))
+
+__attribute__((target("avx2")))
+static int classify_avx2(const char* src, size_t n, char* dst, uint64_t* masks){
+    size_t i = 0;
+    __m256i any = _mm256_setzero_si256();
+    memset(masks, 0, sizeof(*masks) * (n / 64 + 1));
+    for(; i + 32 <= n; i += 32){
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        any = _mm256_or_si256(any, v);
+        __m256i upper = AVX_IN_RANGE(v, 'A', 'Z');
+        __m256i word = _mm256_or_si256(_mm256_or_si256(upper, AVX_IN_RANGE(v, 'a', 'z')), AVX_IN_RANGE(v, '0', '9'));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_add_epi8(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20))));
+        masks[i / 64] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(word) << (i % 64);
+    }
+    return classify_tail(src, i, n, dst, masks) | _mm256_movemask_epi8(any);
+}
+#endif
+
+#if defined(__ARM_NEON) && !defined(TOKENIZE_SCALAR)
+#define NEON_IN_RANGE(v, lo, hi) vandq_u8(vcgeq_u8(v, vdupq_n_u8(lo)), vcleq_u8(v, vdupq_n_u8(hi)))
+
+static int classify_neon(const char* src, size_t n, char* dst, uint64_t* masks){
+    static const uint8_t bit[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t bits = vld1q_u8(bit);
+    uint8x16_t any = vdupq_n_u8(0);
+    size_t i = 0;
+    memset(masks, 0, sizeof(*masks) * (n / 64 + 1));
+    for(; i + 16 <= n; i += 16){
+        uint8x16_t v = vld1q_u8((const uint8_t*)(src + i));
+        any = vorrq_u8(any, v);
+        uint8x16_t upper = NEON_IN_RANGE(v, 'A', 'Z');
+        uint8x16_t word = vorrq_u8(vorrq_u8(upper, NEON_IN_RANGE(v, 'a', 'z')), NEON_IN_RANGE(v, '0', '9'));
+        vst1q_u8((uint8_t*)(dst + i), vaddq_u8(v, vandq_u8(upper, vdupq_n_u8(0x20))));
+        /* No movemask on NEON: weight every lane with its bit and add the two halves horizontally */
+        uint8x16_t weighted = vandq_u8(word, bits);
+        uint16_t m = vaddv_u8(vget_low_u8(weighted)) | (uint16_t)vaddv_u8(vget_high_u8(weighted)) << 8;
+        masks[i / 64] |= (uint64_t)m << (i % 64);
+    }
+    return classify_tail(src, i, n, dst, masks) | (vmaxvq_u8(any) & 0x80);
+}
+#endif
+
+static classify_func classify = NULL;
+static const char* kernel_name = NULL;
+/* The first call may come from any thread, with others already tokenizing */
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void select_kernel(void){
+#if defined(__x86_64__) && !defined(TOKENIZE_SCALAR)
+    if(__builtin_cpu_supports("avx2")){
+        kernel_name = "avx2";
+        classify = classify_avx2;
+        return;
+    }
+    kernel_name = "sse2";
+    classify = classify_sse2;
+#elif defined(__ARM_NEON) && !defined(TOKENIZE_SCALAR)
+    kernel_name = "neon";
+    classify = classify_neon;
+#else
+    kernel_name = "scalar";
+    classify = classify_scalar;
+#endif
+}
+
+const char* tokenizer_kernel(void){
+    pthread_once(&kernel_once, select_kernel);
+    return kernel_name;
+}
+
+/* Decodes the character at s, with n bytes left. Returns its length, or 0 if it isn't valid UTF-8
+   (a stray continuation byte, an overlong form, a surrogate, or a sequence cut short) */
+static size_t utf8_decode(const unsigned char* s, size_t n, uint32_t* cp){
+    size_t len;
+    uint32_t min;
+    if(s[0] >= 0xc2 && s[0] <= 0xdf){
+        len = 2; min = 0x80; *cp = s[0] & 0x1f;
+    }
+    else if(s[0] >= 0xe0 && s[0] <= 0xef){
+        len = 3; min = 0x800; *cp = s[0] & 0x0f;
+    }
+    else if(s[0] >= 0xf0 && s[0] <= 0xf4){
+        len = 4; min = 0x10000; *cp = s[0] & 0x07;
+    }
+    else
+        return 0;
+    if(len > n)
+        return 0;
+    for(size_t i = 1; i < len; i++){
+        if((s[i] & 0xc0) != 0x80)
+            return 0;
+        *cp = (*cp << 6) | (s[i] & 0x3f);
+    }
+    if(*cp < min || *cp > 0x10ffff || (*cp >= 0xd800 && *cp <= 0xdfff))
+        return 0;
+    return len;
+}
+
+static size_t utf8_encode(uint32_t cp, char* out){
+    if(cp < 0x80){
+        out[0] = cp;
+        return 1;
+    }
+    if(cp < 0x800){
+        out[0] = 0xc0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    if(cp < 0x10000){
+        out[0] = 0xe0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3f);
+    out[2] = 0x80 | ((cp >> 6) & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+/* Letters and digits of the scripts we expect in the corpora, every script with a case among them, and combining
+   marks, so decomposed accents stay in their word */
+static int utf8_isletter(uint32_t cp){
+    if(cp < 0x250)
+        return cp == 0xaa || cp == 0xb5 || cp == 0xba || (cp >= 0xc0 && cp != 0xd7 && cp != 0xf7);
+    return (cp <= 0x2af)                                                    /* IPA */
+        || (cp >= 0x300 && cp <= 0x36f)                                     /* Combining diacritical marks */
+        || (cp >= 0x370 && cp <= 0x3ff && cp != 0x37e && cp != 0x387)       /* Greek, but its question mark and ano teleia */
+        || (cp >= 0x400 && cp <= 0x52f && (cp < 0x482 || cp > 0x489))      /* Cyrillic, but its thousands sign and signs */
+        || (cp >= 0x531 && cp <= 0x588 && (cp <= 0x556 || cp == 0x559 || cp >= 0x560))    /* Armenian, but its punctuation */
+        || (cp >= 0x5d0 && cp <= 0x5ea)                                     /* Hebrew */
+        || (cp >= 0x620 && cp <= 0x669)                                     /* Arabic letters, marks and digits */
+        || (cp >= 0x900 && cp <= 0x97f && cp != 0x964 && cp != 0x965)       /* Devanagari, but its dandas */
+        || (cp >= 0x10a0 && cp <= 0x10ff && cp != 0x10fb)                   /* Georgian, but its paragraph separator */
+        || (cp >= 0x13a0 && cp <= 0x13fd)                                   /* Cherokee */
+        || (cp >= 0x1c80 && cp <= 0x1cbf && (cp <= 0x1c88 || cp >= 0x1c90))    /* Cyrillic extended-C, Georgian Mtavruli */
+        || (cp >= 0x1d00 && cp <= 0x1ffc && (cp <= 0x1fbc || cp == 0x1fbe || (cp >= 0x1fc2 && (cp & 0xf) < 0xd)))
+                                    /* Phonetic extensions, Latin extended additional, Greek extended but its spacing accents */
+        || cp == 0x2126 || cp == 0x212a || cp == 0x212b || cp == 0x2132 || cp == 0x214e    /* Ohm, Kelvin, Angstrom, turned F */
+        || (cp >= 0x2c00 && cp <= 0x2cf3 && (cp <= 0x2ce4 || cp >= 0x2ceb))    /* Glagolitic, Latin extended-C, Coptic but its symbols */
+        || (cp >= 0x2d00 && cp <= 0x2d2d)                                   /* Georgian supplement */
+        || (cp >= 0x3041 && cp <= 0x30ff && cp != 0x30fb)                   /* Kana */
+        || (cp >= 0x3400 && cp <= 0x9fff)                                   /* CJK ideographs */
+        || (cp >= 0xa640 && cp <= 0xa69f && cp != 0xa673 && cp != 0xa67e)   /* Cyrillic extended-B, but its punctuation */
+        || (cp >= 0xa722 && cp <= 0xa7ff && cp != 0xa789 && cp != 0xa78a)   /* Latin extended-D, but its modifier colon and equals */
+        || (cp >= 0xab30 && cp <= 0xabbf && cp != 0xab5b && (cp <= 0xab69 || cp >= 0xab70))   /* Latin extended-E, Cherokee */
+        || (cp >= 0xac00 && cp <= 0xd7a3)                                   /* Hangul */
+        || (cp >= 0xff10 && cp <= 0xff19) || (cp >= 0xff21 && cp <= 0xff3a) || (cp >= 0xff41 && cp <= 0xff5a)
+        || (cp >= 0x10400 && cp <= 0x1044f)                                 /* Deseret */
+        || (cp >= 0x104b0 && cp <= 0x104fb && (cp <= 0x104d3 || cp >= 0x104d8))    /* Osage */
+        || (cp >= 0x10570 && cp <= 0x105bc)                                 /* Vithkuqi */
+        || (cp >= 0x10c80 && cp <= 0x10cf2 && (cp <= 0x10cb2 || cp >= 0x10cc0))    /* Old Hungarian */
+        || (cp >= 0x118a0 && cp <= 0x118e9)                                 /* Warang Citi */
+        || (cp >= 0x16e40 && cp <= 0x16e7f)                                 /* Medefaidrin */
+        || (cp >= 0x1e900 && cp <= 0x1e959 && (cp <= 0x1e94b || cp >= 0x1e950));   /* Adlam */
+}
+
+/* The simple case folding of Unicode 14 (CaseFolding.txt, statuses C and S) for the letters utf8_isletter knows, in
+   runs of code points moved by the same delta: all of first..last, or every other one for stride 2. Two departures
+   keep folded letters no longer than the letters they come from, as utf8_words needs: U+0130 folds to i, and U+023A
+   and U+023E, whose lower case takes one more byte, are where U+2C65 and U+2C66 fold to instead */
+static const struct{
+    uint32_t    first;
+    uint32_t    last;
+    int32_t     delta;
+    uint32_t    stride;
+} utf8_folds[] = {
+    { 0x000b5, 0x000b5,    775, 1 }, { 0x000c0, 0x000d6,     32, 1 }, { 0x000d8, 0x000de,     32, 1 }, { 0x00100, 0x0012e,      1, 2 },
+    { 0x00130, 0x00130,   -199, 1 }, { 0x00132, 0x00136,      1, 2 }, { 0x00139, 0x00147,      1, 2 }, { 0x0014a, 0x00176,      1, 2 },
+    { 0x00178, 0x00178,   -121, 1 }, { 0x00179, 0x0017d,      1, 2 }, { 0x0017f, 0x0017f,   -268, 1 }, { 0x00181, 0x00181,    210, 1 },
+    { 0x00182, 0x00184,      1, 2 }, { 0x00186, 0x00186,    206, 1 }, { 0x00187, 0x00187,      1, 1 }, { 0x00189, 0x0018a,    205, 1 },
+    { 0x0018b, 0x0018b,      1, 1 }, { 0x0018e, 0x0018e,     79, 1 }, { 0x0018f, 0x0018f,    202, 1 }, { 0x00190, 0x00190,    203, 1 },
+    { 0x00191, 0x00191,      1, 1 }, { 0x00193, 0x00193,    205, 1 }, { 0x00194, 0x00194,    207, 1 }, { 0x00196, 0x00196,    211, 1 },
+    { 0x00197, 0x00197,    209, 1 }, { 0x00198, 0x00198,      1, 1 }, { 0x0019c, 0x0019c,    211, 1 }, { 0x0019d, 0x0019d,    213, 1 },
+    { 0x0019f, 0x0019f,    214, 1 }, { 0x001a0, 0x001a4,      1, 2 }, { 0x001a6, 0x001a6,    218, 1 }, { 0x001a7, 0x001a7,      1, 1 },
+    { 0x001a9, 0x001a9,    218, 1 }, { 0x001ac, 0x001ac,      1, 1 }, { 0x001ae, 0x001ae,    218, 1 }, { 0x001af, 0x001af,      1, 1 },
+    { 0x001b1, 0x001b2,    217, 1 }, { 0x001b3, 0x001b5,      1, 2 }, { 0x001b7, 0x001b7,    219, 1 }, { 0x001b8, 0x001b8,      1, 1 },
+    { 0x001bc, 0x001bc,      1, 1 }, { 0x001c4, 0x001c4,      2, 1 }, { 0x001c5, 0x001c5,      1, 1 }, { 0x001c7, 0x001c7,      2, 1 },
+    { 0x001c8, 0x001c8,      1, 1 }, { 0x001ca, 0x001ca,      2, 1 }, { 0x001cb, 0x001db,      1, 2 }, { 0x001de, 0x001ee,      1, 2 },
+    { 0x001f1, 0x001f1,      2, 1 }, { 0x001f2, 0x001f4,      1, 2 }, { 0x001f6, 0x001f6,    -97, 1 }, { 0x001f7, 0x001f7,    -56, 1 },
+    { 0x001f8, 0x0021e,      1, 2 }, { 0x00220, 0x00220,   -130, 1 }, { 0x00222, 0x00232,      1, 2 }, { 0x0023b, 0x0023b,      1, 1 },
+    { 0x0023d, 0x0023d,   -163, 1 }, { 0x00241, 0x00241,      1, 1 }, { 0x00243, 0x00243,   -195, 1 }, { 0x00244, 0x00244,     69, 1 },
+    { 0x00245, 0x00245,     71, 1 }, { 0x00246, 0x0024e,      1, 2 }, { 0x00345, 0x00345,    116, 1 }, { 0x00370, 0x00372,      1, 2 },
+    { 0x00376, 0x00376,      1, 1 }, { 0x0037f, 0x0037f,    116, 1 }, { 0x00386, 0x00386,     38, 1 }, { 0x00388, 0x0038a,     37, 1 },
+    { 0x0038c, 0x0038c,     64, 1 }, { 0x0038e, 0x0038f,     63, 1 }, { 0x00391, 0x003a1,     32, 1 }, { 0x003a3, 0x003ab,     32, 1 },
+    { 0x003c2, 0x003c2,      1, 1 }, { 0x003cf, 0x003cf,      8, 1 }, { 0x003d0, 0x003d0,    -30, 1 }, { 0x003d1, 0x003d1,    -25, 1 },
+    { 0x003d5, 0x003d5,    -15, 1 }, { 0x003d6, 0x003d6,    -22, 1 }, { 0x003d8, 0x003ee,      1, 2 }, { 0x003f0, 0x003f0,    -54, 1 },
+    { 0x003f1, 0x003f1,    -48, 1 }, { 0x003f4, 0x003f4,    -60, 1 }, { 0x003f5, 0x003f5,    -64, 1 }, { 0x003f7, 0x003f7,      1, 1 },
+    { 0x003f9, 0x003f9,     -7, 1 }, { 0x003fa, 0x003fa,      1, 1 }, { 0x003fd, 0x003ff,   -130, 1 }, { 0x00400, 0x0040f,     80, 1 },
+    { 0x00410, 0x0042f,     32, 1 }, { 0x00460, 0x00480,      1, 2 }, { 0x0048a, 0x004be,      1, 2 }, { 0x004c0, 0x004c0,     15, 1 },
+    { 0x004c1, 0x004cd,      1, 2 }, { 0x004d0, 0x0052e,      1, 2 }, { 0x00531, 0x00556,     48, 1 }, { 0x010a0, 0x010c5,   7264, 1 },
+    { 0x010c7, 0x010c7,   7264, 1 }, { 0x010cd, 0x010cd,   7264, 1 }, { 0x013f8, 0x013fd,     -8, 1 }, { 0x01c80, 0x01c80,  -6222, 1 },
+    { 0x01c81, 0x01c81,  -6221, 1 }, { 0x01c82, 0x01c82,  -6212, 1 }, { 0x01c83, 0x01c84,  -6210, 1 }, { 0x01c85, 0x01c85,  -6211, 1 },
+    { 0x01c86, 0x01c86,  -6204, 1 }, { 0x01c87, 0x01c87,  -6180, 1 }, { 0x01c88, 0x01c88,  35267, 1 }, { 0x01c90, 0x01cba,  -3008, 1 },
+    { 0x01cbd, 0x01cbf,  -3008, 1 }, { 0x01e00, 0x01e94,      1, 2 }, { 0x01e9b, 0x01e9b,    -58, 1 }, { 0x01e9e, 0x01e9e,  -7615, 1 },
+    { 0x01ea0, 0x01efe,      1, 2 }, { 0x01f08, 0x01f0f,     -8, 1 }, { 0x01f18, 0x01f1d,     -8, 1 }, { 0x01f28, 0x01f2f,     -8, 1 },
+    { 0x01f38, 0x01f3f,     -8, 1 }, { 0x01f48, 0x01f4d,     -8, 1 }, { 0x01f59, 0x01f5f,     -8, 2 }, { 0x01f68, 0x01f6f,     -8, 1 },
+    { 0x01f88, 0x01f8f,     -8, 1 }, { 0x01f98, 0x01f9f,     -8, 1 }, { 0x01fa8, 0x01faf,     -8, 1 }, { 0x01fb8, 0x01fb9,     -8, 1 },
+    { 0x01fba, 0x01fbb,    -74, 1 }, { 0x01fbc, 0x01fbc,     -9, 1 }, { 0x01fbe, 0x01fbe,  -7173, 1 }, { 0x01fc8, 0x01fcb,    -86, 1 },
+    { 0x01fcc, 0x01fcc,     -9, 1 }, { 0x01fd8, 0x01fd9,     -8, 1 }, { 0x01fda, 0x01fdb,   -100, 1 }, { 0x01fe8, 0x01fe9,     -8, 1 },
+    { 0x01fea, 0x01feb,   -112, 1 }, { 0x01fec, 0x01fec,     -7, 1 }, { 0x01ff8, 0x01ff9,   -128, 1 }, { 0x01ffa, 0x01ffb,   -126, 1 },
+    { 0x01ffc, 0x01ffc,     -9, 1 }, { 0x02126, 0x02126,  -7517, 1 }, { 0x0212a, 0x0212a,  -8383, 1 }, { 0x0212b, 0x0212b,  -8262, 1 },
+    { 0x02132, 0x02132,     28, 1 }, { 0x02c00, 0x02c2f,     48, 1 }, { 0x02c60, 0x02c60,      1, 1 }, { 0x02c62, 0x02c62, -10743, 1 },
+    { 0x02c63, 0x02c63,  -3814, 1 }, { 0x02c64, 0x02c64, -10727, 1 }, { 0x02c65, 0x02c65, -10795, 1 }, { 0x02c66, 0x02c66, -10792, 1 },
+    { 0x02c67, 0x02c6b,      1, 2 }, { 0x02c6d, 0x02c6d, -10780, 1 }, { 0x02c6e, 0x02c6e, -10749, 1 }, { 0x02c6f, 0x02c6f, -10783, 1 },
+    { 0x02c70, 0x02c70, -10782, 1 }, { 0x02c72, 0x02c72,      1, 1 }, { 0x02c75, 0x02c75,      1, 1 }, { 0x02c7e, 0x02c7f, -10815, 1 },
+    { 0x02c80, 0x02ce2,      1, 2 }, { 0x02ceb, 0x02ced,      1, 2 }, { 0x02cf2, 0x02cf2,      1, 1 }, { 0x0a640, 0x0a66c,      1, 2 },
+    { 0x0a680, 0x0a69a,      1, 2 }, { 0x0a722, 0x0a72e,      1, 2 }, { 0x0a732, 0x0a76e,      1, 2 }, { 0x0a779, 0x0a77b,      1, 2 },
+    { 0x0a77d, 0x0a77d, -35332, 1 }, { 0x0a77e, 0x0a786,      1, 2 }, { 0x0a78b, 0x0a78b,      1, 1 }, { 0x0a78d, 0x0a78d, -42280, 1 },
+    { 0x0a790, 0x0a792,      1, 2 }, { 0x0a796, 0x0a7a8,      1, 2 }, { 0x0a7aa, 0x0a7aa, -42308, 1 }, { 0x0a7ab, 0x0a7ab, -42319, 1 },
+    { 0x0a7ac, 0x0a7ac, -42315, 1 }, { 0x0a7ad, 0x0a7ad, -42305, 1 }, { 0x0a7ae, 0x0a7ae, -42308, 1 }, { 0x0a7b0, 0x0a7b0, -42258, 1 },
+    { 0x0a7b1, 0x0a7b1, -42282, 1 }, { 0x0a7b2, 0x0a7b2, -42261, 1 }, { 0x0a7b3, 0x0a7b3,    928, 1 }, { 0x0a7b4, 0x0a7c2,      1, 2 },
+    { 0x0a7c4, 0x0a7c4,    -48, 1 }, { 0x0a7c5, 0x0a7c5, -42307, 1 }, { 0x0a7c6, 0x0a7c6, -35384, 1 }, { 0x0a7c7, 0x0a7c9,      1, 2 },
+    { 0x0a7d0, 0x0a7d0,      1, 1 }, { 0x0a7d6, 0x0a7d8,      1, 2 }, { 0x0a7f5, 0x0a7f5,      1, 1 }, { 0x0ab70, 0x0abbf, -38864, 1 },
+    { 0x0ff21, 0x0ff3a,     32, 1 }, { 0x10400, 0x10427,     40, 1 }, { 0x104b0, 0x104d3,     40, 1 }, { 0x10570, 0x1057a,     39, 1 },
+    { 0x1057c, 0x1058a,     39, 1 }, { 0x1058c, 0x10592,     39, 1 }, { 0x10594, 0x10595,     39, 1 }, { 0x10c80, 0x10cb2,     64, 1 },
+    { 0x118a0, 0x118bf,     32, 1 }, { 0x16e40, 0x16e5f,     32, 1 }, { 0x1e900, 0x1e921,     34, 1 }
+};
+
+static uint32_t utf8_fold(uint32_t cp){
+    // The last run starting at or before cp
+    size_t lo = 0, hi = sizeof(utf8_folds) / sizeof(utf8_folds[0]);
+    while(lo < hi){
+        size_t mid = (lo + hi) / 2;
+        if(utf8_folds[mid].first <= cp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(!lo || cp > utf8_folds[lo - 1].last || (cp - utf8_folds[lo - 1].first) % utf8_folds[lo - 1].stride)
+        return cp;
+    return cp + utf8_folds[lo - 1].delta;
+}
+
+/* Whether s, with n bytes left, is the start of a multibyte character cut short by the end of the input */
+static int utf8_truncated(const unsigned char* s, size_t n){
+    size_t len = s[0] >= 0xf0 && s[0] <= 0xf4 ? 4 : s[0] >= 0xe0 && s[0] <= 0xef ? 3 : s[0] >= 0xc2 && s[0] <= 0xdf ? 2 : 0;
+    if(len <= n)
+        return 0;
+    for(size_t i = 1; i < n; i++)
+        if((s[i] & 0xc0) != 0x80)
+            return 0;
+    return 1;
+}
+
+/* Splits a run of word bytes in UTF-8 words. Characters that aren't letters and bytes that aren't valid UTF-8 are
+   delimiters, ASCII goes through the tables. Words are clamped to WORD_MAX-1 bytes on a character boundary.
+   With keep, the run is the head of a longer one: the word going on past its end isn't emitted, but written to keep,
+   folded and clamped, followed by the bytes of a character cut short. Returns how many bytes that is, at most
+   WORD_MAX + 2. Splitting keep and the rest of the run gives the same words as splitting the whole run, since
+   folded letters are letters, fold to themselves, and are never longer than the character they come from. */
+static size_t utf8_words(const char* run, size_t len, token_sink sink, void* user, char* keep){
+    char word[WORD_MAX];
+    size_t word_len = 0;
+    for(size_t i = 0; i < len; ){
+        unsigned char c = run[i];
+        uint32_t cp = c;
+        size_t n = 1;
+        int letter;
+        if(c < 0x80){
+            letter = tok_class[c];
+            cp = tok_fold[c];
+        }
+        else {
+            n = utf8_decode((const unsigned char*)run + i, len - i, &cp);
+            if(!n && keep && utf8_truncated((const unsigned char*)run + i, len - i)){
+                memcpy(keep, word, word_len);
+                memcpy(keep + word_len, run + i, len - i);
+                return word_len + len - i;
+            }
+            letter = n && utf8_isletter(cp);
+            if(!n)
+                n = 1;
+            else if(letter)
+                cp = utf8_fold(cp);
+        }
+        i += n;
+
+        if(!letter){
+            if(word_len)
+                sink(word, word_len, user);
+            word_len = 0;
+            continue;
+        }
+        char encoded[4];
+        size_t encoded_len = utf8_encode(cp, encoded);
+        if(word_len + encoded_len <= WORD_MAX - 1){
+            memcpy(word + word_len, encoded, encoded_len);
+            word_len += encoded_len;
+        }
+    }
+    if(keep){
+        memcpy(keep, word, word_len);
+        return word_len;
+    }
+    if(word_len)
+        sink(word, word_len, user);
+    return 0;
+}
+
+typedef struct{
+    token_sink  sink;
+    void*       user;
+} Run_target;
+
+static void utf8_run(const char* run, size_t len, void* user){
+    Run_target* target = user;
+    utf8_words(run, len, target->sink, target->user, NULL);
+}
+
+/* Emits a run of raw word bytes like tokenize_span would: a single word, folded and clamped, or the UTF-8 words in it */
+static void emit_run(const char* run, size_t len, token_sink sink, void* user){
+    if(charset == TOK_UTF8){
+        utf8_words(run, len, sink, user, NULL);
+        return;
+    }
+    char word[WORD_MAX];
+    if(len > WORD_MAX - 1)
+        len = WORD_MAX - 1;
+    for(size_t i = 0; i < len; i++)
+        word[i] = tok_lower(run[i]);
+    sink(word, len, user);
+}
+
+/* Emits every run of set bits in masks[0 .. n) as a word of dst, clamped to max_len */
+static void emit_spans(const char* dst, const uint64_t* masks, size_t n, size_t max_len, token_sink sink, void* user){
+    size_t start = 0;
+    int in_word = 0;
+    for(size_t j = 0; j * 64 < n; j++){
+        uint64_t m = masks[j];
+        size_t base = j * 64;
+        if(in_word){
+            uint64_t z = ~m;
+            if(!z)
+                continue;
+            size_t e = __builtin_ctzll(z);
+            size_t len = base + e - start;
+            sink(dst + start, len < max_len ? len : max_len, user);
+            in_word = 0;
+            m &= ~0ull << e;
+        }
+        while(m){
+            size_t s = __builtin_ctzll(m);
+            uint64_t z = ~m & (~0ull << s);
+            if(!z){
+                start = base + s;
+                in_word = 1;
+                break;
+            }
+            size_t e = __builtin_ctzll(z);
+            sink(dst + base + s, e - s, user);
+            m &= ~0ull << e;
+        }
+    }
+    if(in_word){
+        size_t len = n - start;
+        sink(dst + start, len < max_len ? len : max_len, user);
+    }
+}
+
+void tokenize_span(const char* buffer, size_t len, token_sink sink, void* user){
+    char lowered[TOKEN_WINDOW];
+    uint64_t masks[TOKEN_WINDOW / 64 + 1];
+    const char* end = buffer + len;
+    Run_target target = { sink, user };
+
+    pthread_once(&kernel_once, select_kernel);
+
+    while(buffer < end){
+        size_t n = (size_t)(end - buffer) > TOKEN_WINDOW ? TOKEN_WINDOW : (size_t)(end - buffer);
+
+        /* Windows never split a word: if this one would, it's shortened to end before the word starts */
+        if(buffer + n < end && tok_isword(buffer[n - 1]) && tok_isword(buffer[n])){
+            size_t cut = n - 1;
+            while(cut > 0 && tok_isword(buffer[cut - 1]))
+                cut--;
+
+            if(cut == 0){
+                /* The whole window is a single run of word bytes: a word longer than any key we can store,
+                   of which only the head is kept, or (UTF-8) many words without an ASCII delimiter between them */
+                size_t word_len = 0;
+                while(buffer + word_len < end && tok_isword(buffer[word_len]))
+                    word_len++;
+                emit_run(buffer, word_len, sink, user);
+                buffer += word_len;
+                continue;
+            }
+            n = cut;
+        }
+
+        if(classify(buffer, n, lowered, masks) && charset != TOK_ASCII){
+            /* Off the fast path: only the tables know the high bytes of the character set */
+            memset(masks, 0, sizeof(*masks) * (n / 64 + 1));
+            classify_tail(buffer, 0, n, lowered, masks);
+            if(charset == TOK_UTF8){
+                emit_spans(lowered, masks, n, SIZE_MAX, utf8_run, &target);
+                buffer += n;
+                continue;
+            }
+        }
+        emit_spans(lowered, masks, n, WORD_MAX - 1, sink, user);
+        buffer += n;
+    }
+}
+
+void tokenize_stream_init(Token_stream* stream){
+    stream->carry_len = 0;
+    stream->in_word = 0;
+}
+
+/* Appends raw word bytes to the carry. A run of word bytes is a single word, and what doesn't fit is past what any key
+   keeps, except with UTF-8: a run may hold any number of words. Then a full carry is split, the complete words are
+   emitted, and only the word still going on is kept */
+static void carry_append(Token_stream* stream, const char* bytes, size_t n, token_sink sink, void* user){
+    while(n){
+        if(stream->carry_len == TOKEN_CARRY){
+            if(charset != TOK_UTF8)
+                return;
+            char keep[WORD_MAX + 2];
+            stream->carry_len = utf8_words(stream->carry, stream->carry_len, sink, user, keep);
+            memcpy(stream->carry, keep, stream->carry_len);
+        }
+        size_t room = TOKEN_CARRY - stream->carry_len;
+        size_t taken = n < room ? n : room;
+        memcpy(stream->carry + stream->carry_len, bytes, taken);
+        stream->carry_len += taken;
+        bytes += taken;
+        n -= taken;
+    }
+}
+
+void tokenize_stream(Token_stream* stream, const char* buffer, size_t len, token_sink sink, void* user){
+    size_t head = 0;
+
+    // Completing the word carried from the previous buffer
+    if(stream->in_word){
+        while(head < len && tok_isword(buffer[head]))
+            head++;
+        carry_append(stream, buffer, head, sink, user);
+        if(head == len)
+            return;
+        emit_run(stream->carry, stream->carry_len, sink, user);
+        stream->in_word = 0;
+    }
+
+    // The word at the end of the buffer may go on in the next one: it's carried instead of being emitted
+    size_t tail = len;
+    while(tail > head && tok_isword(buffer[tail - 1]))
+        tail--;
+
+    tokenize_span(buffer + head, tail - head, sink, user);
+
+    if(tail < len){
+        stream->in_word = 1;
+        stream->carry_len = 0;
+        carry_append(stream, buffer + tail, len - tail, sink, user);
+    }
+}
+
+void tokenize_stream_end(Token_stream* stream, token_sink sink, void* user){
+    if(stream->in_word)
+        emit_run(stream->carry, stream->carry_len, sink, user);
+    stream->in_word = 0;
+    stream->carry_len = 0;
+}
+
+static void ignore_token(const char* word, size_t len, void* user){
+    (void)word;
+    (void)len;
+    (void)user;
+}
+
+size_t tokenize_word_head(const char* buffer, size_t len, int* open){
+    size_t i = 0;
+    *open = 0;
+    if(charset != TOK_UTF8){
+        while(i < len && tok_isword(buffer[i]))
+            i++;
+        *open = i == len;
+        return i;
+    }
+
+    // The rest of a character cut in two belongs to the piece
+    while(i < len && i < 3 && ((unsigned char)buffer[i] & 0xc0) == 0x80)
+        i++;
+    while(i < len){
+        unsigned char c = buffer[i];
+        uint32_t cp = c;
+        size_t n = 1;
+        if(c >= 0x80 && !(n = utf8_decode((const unsigned char*)buffer + i, len - i, &cp))){
+            // A character cut short by the end of the buffer goes on past it, and so does the piece
+            *open = utf8_truncated((const unsigned char*)buffer + i, len - i);
+            return i;
+        }
+        if(c < 0x80 ? !tok_class[c] : !utf8_isletter(cp))
+            return i;
+        i += n;
+    }
+    *open = 1;
+    return i;
+}
+
+size_t tokenize_edge_head(const char* buffer, size_t len, char* edge){
+    size_t i = 0;
+    if(charset != TOK_UTF8){
+        for(; i < len && i < WORD_MAX - 1 && tok_isword(buffer[i]); i++)
+            edge[i] = tok_lower(buffer[i]);
+        return i;
+    }
+
+    // The rest of a character cut in two stays raw, to be put back together with its head
+    size_t split = 0;
+    while(split < len && split < 3 && ((unsigned char)buffer[split] & 0xc0) == 0x80)
+        split++;
+    int open;
+    i = tokenize_word_head(buffer, len, &open);
+    if(open)
+        i = len;
+    memcpy(edge, buffer, split);
+    return split + utf8_words(buffer + split, i - split, ignore_token, NULL, edge + split);
+}
+
+size_t tokenize_edge_tail(const char* buffer, size_t len, char* edge){
+    size_t run = len;
+    while(run > 0 && tok_isword(buffer[run - 1]))
+        run--;
+    if(charset != TOK_UTF8){
+        size_t i = 0;
+        for(; run + i < len && i < WORD_MAX - 1; i++)
+            edge[i] = tok_lower(buffer[run + i]);
+        return i;
+    }
+
+    // Decoding from the start of the run (or of the buffer, the way every decoder syncs up) to the last non-letter
+    size_t piece = run;
+    for(size_t i = run; i < len; ){
+        unsigned char c = buffer[i];
+        uint32_t cp = c;
+        size_t n = 1;
+        if(c >= 0x80 && !(n = utf8_decode((const unsigned char*)buffer + i, len - i, &cp))){
+            // The head of a character cut in two is part of the piece, not a delimiter
+            if(utf8_truncated((const unsigned char*)buffer + i, len - i))
+                break;
+            n = 1;
+            piece = i + n;
+        }
+        else if(c < 0x80 ? !tok_class[c] : !utf8_isletter(cp))
+            piece = i + n;
+        i += n;
+    }
+    return utf8_words(buffer + piece, len - piece, ignore_token, NULL, edge);
+}
+
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "mpi.h"
+#include "topk.h"
+
+/*********************************************************************************
+ * Top-K heavy hitters with Space-Saving summaries.
+ * Every process counts its words in a summary of TOPK_FACTOR * K counters, so its
+ * memory doesn't grow with the vocabulary. Counters sit in a min-heap by count,
+ * and a small open addressing table (linear probing) finds the counter of a word.
+ * Summaries are mergeable: a word missing from one of the two summaries gets the
+ * floor of that summary added to both its count and its error, and only the
+ * largest counters are kept. Merging goes up a binomial tree, like REDUCE_TREE,
+ * so every message is O(K) and root merges log2(P) summaries.
+ * *******************************************************************************/
+
+static uint32_t word_hash(const char* word, size_t len){
+    uint32_t h = 0x811c9dc5;
+    for(size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)word[i]) * 0x01000193;
+    return h;
+}
+
+Topk_summary* topk_new(int capacity){
+    Topk_summary* summary = malloc(sizeof(*summary));
+    if(capacity < 1)
+        capacity = 1;
+    int table_size = 2;
+    while(table_size < 2 * capacity)
+        table_size <<= 1;
+
+    summary->counters = malloc(sizeof(*summary->counters) * capacity);
+    summary->heap = malloc(sizeof(*summary->heap) * capacity);
+    summary->table = malloc(sizeof(*summary->table) * table_size);
+    memset(summary->table, -1, sizeof(*summary->table) * table_size);
+    summary->table_mask = table_size - 1;
+    summary->size = 0;
+    summary->capacity = capacity;
+    summary->floor = 0;
+    return summary;
+}
+
+void topk_delete(Topk_summary* summary){
+    free(summary->counters);
+    free(summary->heap);
+    free(summary->table);
+    free(summary);
+}
+
+/* Table slot holding the counter of word, or the empty slot where it would go */
+static int table_slot(Topk_summary* summary, const char* word, size_t len){
+    int slot = word_hash(word, len) & summary->table_mask;
+    for(;;){
+        int c = summary->table[slot];
+        if(c < 0 || (summary->counters[c].len == len && !memcmp(summary->counters[c].word, word, len)))
+            return slot;
+        slot = (slot + 1) & summary->table_mask;
+    }
+}
+
+/* Backward shift deletion: moves back the entries that probed past the freed slot, so no tombstones are needed */
+static void table_remove(Topk_summary* summary, int slot){
+    int mask = summary->table_mask;
+    int next = (slot + 1) & mask;
+    while(summary->table[next] >= 0){
+        Topk_counter* counter = &summary->counters[summary->table[next]];
+        int home = word_hash(counter->word, counter->len) & mask;
+        /* The entry can fill the hole if the hole lies between its home slot and where it is now */
+        if(((next - home) & mask) >= ((next - slot) & mask)){
+            summary->table[slot] = summary->table[next];
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+    summary->table[slot] = -1;
+}
+
+static void heap_swap(Topk_summary* summary, int i, int j){
+    int t = summary->heap[i];
+    summary->heap[i] = summary->heap[j];
+    summary->heap[j] = t;
+    summary->counters[summary->heap[i]].heap_pos = i;
+    summary->counters[summary->heap[j]].heap_pos = j;
+}
+
+static void sift_down(Topk_summary* summary, int i){
+    for(;;){
+        int smallest = i, l = 2 * i + 1, r = l + 1;
+        if(l < summary->size && summary->counters[summary->heap[l]].count < summary->counters[summary->heap[smallest]].count)
+            smallest = l;
+        if(r < summary->size && summary->counters[summary->heap[r]].count < summary->counters[summary->heap[smallest]].count)
+            smallest = r;
+        if(smallest == i)
+            return;
+        heap_swap(summary, i, smallest);
+        i = smallest;
+    }
+}
+
+static void sift_up(Topk_summary* summary, int i){
+    while(i > 0 && summary->counters[summary->heap[(i - 1) / 2]].count > summary->counters[summary->heap[i]].count){
+        heap_swap(summary, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/* Adds count occurrences of word, with the given error, evicting the smallest counter if the summary is full */
+static void summary_add(Topk_summary* summary, const char* word, size_t len, long count, long error){
+    int slot = table_slot(summary, word, len);
+    int c = summary->table[slot];
+    if(c >= 0){
+        summary->counters[c].count += count;
+        summary->counters[c].error += error;
+        sift_down(summary, summary->counters[c].heap_pos);
+        return;
+    }
+
+    long base = summary->floor;
+    if(summary->size < summary->capacity){
+        c = summary->size++;
+        summary->heap[c] = c;
+        summary->counters[c].heap_pos = c;
+    }
+    else {
+        /* The new word might have been seen as many times as the counter it replaces */
+        c = summary->heap[0];
+        Topk_counter* evicted = &summary->counters[c];
+        base = evicted->count;
+        summary->floor = base;
+        table_remove(summary, table_slot(summary, evicted->word, evicted->len));
+        slot = table_slot(summary, word, len);
+    }
+
+    Topk_counter* counter = &summary->counters[c];
+    memcpy(counter->word, word, len);
+    counter->len = len;
+    counter->count = base + count;
+    counter->error = base + error;
+    summary->table[slot] = c;
+    sift_up(summary, counter->heap_pos);
+    sift_down(summary, counter->heap_pos);
+}
+
+void topk_add(const char* word, size_t len, void* user){
+    summary_add(user, word, len, 1, 0);
+}
+
+static int by_count(const void* a, const void* b){
+    const Topk_counter* x = a;
+    const Topk_counter* y = b;
+    if(x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    if(x->len != y->len)
+        return x->len < y->len ? -1 : 1;
+    return memcmp(x->word, y->word, x->len);
+}
+
+void topk_merge(Topk_summary* summary, const Topk_summary* other){
+    int n = 0;
+    Topk_counter* merged = malloc(sizeof(*merged) * (summary->size + other->size));
+    Topk_summary* lookup = (Topk_summary*)other;
+
+    for(int i = 0; i < summary->size; i++){
+        Topk_counter* counter = &summary->counters[i];
+        int c = lookup->table[table_slot(lookup, counter->word, counter->len)];
+        merged[n] = *counter;
+        merged[n].count += c >= 0 ? other->counters[c].count : other->floor;
+        merged[n].error += c >= 0 ? other->counters[c].error : other->floor;
+        n++;
+    }
+    for(int i = 0; i < other->size; i++){
+        const Topk_counter* counter = &other->counters[i];
+        if(summary->table[table_slot(summary, counter->word, counter->len)] >= 0)
+            continue;
+        merged[n] = *counter;
+        merged[n].count += summary->floor;
+        merged[n].error += summary->floor;
+        n++;
+    }
+
+    qsort(merged, n, sizeof(*merged), by_count);
+    long floor = summary->floor + other->floor;
+    if(n > summary->capacity && merged[summary->capacity].count > floor)
+        floor = merged[summary->capacity].count;
+    if(n > summary->capacity)
+        n = summary->capacity;
+
+    /* Rebuilding from scratch: the counters are sorted, so the heap is just their reverse order */
+    memset(summary->table, -1, sizeof(*summary->table) * (summary->table_mask + 1));
+    summary->size = n;
+    summary->floor = floor;
+    for(int i = 0; i < n; i++){
+        summary->counters[i] = merged[i];
+        summary->counters[i].heap_pos = n - 1 - i;
+        summary->heap[n - 1 - i] = i;
+        summary->table[table_slot(summary, merged[i].word, merged[i].len)] = i;
+    }
+    free(merged);
+}
+
+/* Wire format: int32 size, int64 floor, then for every counter uint8 len, the word, int64 count and int64 error */
+static size_t pack_summary(const Topk_summary* summary, unsigned char** out){
+    size_t size = sizeof(int32_t) + sizeof(int64_t);
+    for(int i = 0; i < summary->size; i++)
+        size += 1 + summary->counters[i].len + 2 * sizeof(int64_t);
+    unsigned char* cursor = *out = malloc(sizeof(**out) * size);
+
+    int32_t n = summary->size;
+    int64_t floor = summary->floor;
+    memcpy(cursor, &n, sizeof(n)); cursor += sizeof(n);
+    memcpy(cursor, &floor, sizeof(floor)); cursor += sizeof(floor);
+    for(int i = 0; i < summary->size; i++){
+        const Topk_counter* counter = &summary->counters[i];
+        int64_t count = counter->count, error = counter->error;
+        *cursor++ = counter->len;
+        memcpy(cursor, counter->word, counter->len); cursor += counter->len;
+        memcpy(cursor, &count, sizeof(count)); cursor += sizeof(count);
+        memcpy(cursor, &error, sizeof(error)); cursor += sizeof(error);
+    }
+    return size;
+}
+
+static Topk_summary* unpack_summary(const unsigned char* data, int capacity){
+    Topk_summary* summary = topk_new(capacity);
+    int32_t n;
+    int64_t floor;
+    memcpy(&n, data, sizeof(n)); data += sizeof(n);
+    memcpy(&floor, data, sizeof(floor)); data += sizeof(floor);
+    for(int i = 0; i < n; i++){
+        int64_t count, error;
+        unsigned char len = *data++;
+        const char* word = (const char*)data; data += len;
+        memcpy(&count, data, sizeof(count)); data += sizeof(count);
+        memcpy(&error, data, sizeof(error)); data += sizeof(error);
+        summary_add(summary, word, len, count, error);
+    }
+    summary->floor = floor;
+    return summary;
+}
+
+void topk_reduce(Topk_summary* summary, int root, MPI_Comm comm){
+    int rank, wsize;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &wsize);
+
+    int relrank = (rank - root + wsize) % wsize;
+    int children = 0, parent = -1;
+    for(int mask = 1; mask < wsize; mask <<= 1){
+        if(relrank & mask){
+            parent = (relrank - mask + root) % wsize;
+            break;
+        }
+        if(relrank + mask < wsize)
+            children++;
+    }
+
+    for(int i = 0; i < children; i++){
+        MPI_Message message;
+        MPI_Status status;
+        int size;
+        MPI_Mprobe(MPI_ANY_SOURCE, TOPK_TAG, comm, &message, &status);
+        MPI_Get_count(&status, MPI_BYTE, &size);
+        unsigned char* incoming = malloc(sizeof(*incoming) * size);
+        MPI_Mrecv(incoming, size, MPI_BYTE, &message, &status);
+
+        Topk_summary* other = unpack_summary(incoming, summary->capacity);
+        topk_merge(summary, other);
+        topk_delete(other);
+        free(incoming);
+    }
+
+    if(parent >= 0){
+        unsigned char* packed;
+        size_t size = pack_summary(summary, &packed);
+        MPI_Send(packed, size, MPI_BYTE, parent, TOPK_TAG, comm);
+        free(packed);
+    }
+}
+
+void topk_print(Topk_summary* summary, int k, FILE* output){
+    Topk_counter* sorted = malloc(sizeof(*sorted) * (summary->size ? summary->size : 1));
+    memcpy(sorted, summary->counters, sizeof(*sorted) * summary->size);
+    qsort(sorted, summary->size, sizeof(*sorted), by_count);
+
+    /* A word's rank is certain if even its lowest possible count beats the highest possible count of the rest */
+    long outside = summary->floor;
+    if(summary->size > k && sorted[k].count > outside)
+        outside = sorted[k].count;
+
+    fprintf(output, "Word, Count, Error, Guaranteed\n");
+    for(int i = 0; i < k && i < summary->size; i++)
+        fprintf(output, "%.*s, %ld, %ld, %s\n", sorted[i].len, sorted[i].word, sorted[i].count, sorted[i].error,
+                sorted[i].count - sorted[i].error >= outside ? "yes" : "no");
+    free(sorted);
+}
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "mpi.h"
+#include "trace.h"
+
+/*********************************************************************************
+ * Events are kept in memory as they come, under a mutex since counting threads
+ * record their own, and only turned into JSON at the end. Timestamps come from
+ * CLOCK_MONOTONIC rather than MPI_Wtime, which worker threads aren't allowed to
+ * call with MPI_THREAD_FUNNELED. Each rank formats its events, root gathers the
+ * text with MPI_Gatherv and writes a single file, one pid per rank.
+ * *******************************************************************************/
+
+typedef struct{
+    const char* name;
+    char*       detail;
+    double      start;
+    double      end;
+    long        bytes;
+    long        peak_kb;
+    int         tid;
+} Trace_event;
+
+static int trace_enabled = 0;
+static double trace_origin = 0;
+static Trace_event* events = NULL;
+static size_t nevents = 0, capacity = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double monotonic(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void trace_init(int enabled, MPI_Comm comm){
+    trace_enabled = enabled;
+    if(!enabled)
+        return;
+    // A resident process traces every job on its own
+    nevents = 0;
+    MPI_Barrier(comm);
+    trace_origin = monotonic();
+}
+
+double trace_now(void){
+    return trace_enabled ? monotonic() - trace_origin : 0;
+}
+
+void trace_thread_event(const char* name, const char* detail, double start, long bytes, int tid){
+    if(!trace_enabled)
+        return;
+
+    double end = trace_now();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    pthread_mutex_lock(&trace_lock);
+    if(nevents == capacity){
+        capacity = capacity ? capacity * 2 : 256;
+        events = realloc(events, sizeof(*events) * capacity);
+    }
+    Trace_event* event = &events[nevents++];
+    event->name = name;
+    event->detail = detail ? strdup(detail) : NULL;
+    event->start = start;
+    event->end = end;
+    event->bytes = bytes;
+    event->peak_kb = usage.ru_maxrss;
+    event->tid = tid;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_event(const char* name, const char* detail, double start, long bytes){
+    trace_thread_event(name, detail, start, bytes, 0);
+}
+
+static void json_string(FILE* out, const char* s){
+    fputc('"', out);
+    for(; *s; s++){
+        if(*s == '"' || *s == '\\')
+            fprintf(out, "\\%c", *s);
+        else if((unsigned char)*s < 0x20)
+            fprintf(out, "\\u%04x", *s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+/* Complete ("X") events, timestamps in microseconds, plus the name of the process */
+static char* format_events(int rank, size_t* size){
+    char* text = NULL;
+    FILE* out = open_memstream(&text, size);
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"rank %d\"}},\n", rank, rank);
+    for(size_t i = 0; i < nevents; i++){
+        Trace_event* event = &events[i];
+        fprintf(out, "{\"name\":");
+        json_string(out, event->name);
+        fprintf(out, ",\"cat\":\"phase\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"bytes\":%ld,\"peak_rss_kb\":%ld",
+                rank, event->tid, event->start * 1e6, (event->end - event->start) * 1e6, event->bytes, event->peak_kb);
+        if(event->detail){
+            fprintf(out, ",\"detail\":");
+            json_string(out, event->detail);
+        }
+        fprintf(out, "}},\n");
+    }
+    fclose(out);
+    return text;
+}
+
+void trace_write(const char* path, int root, MPI_Comm comm){
+    if(!trace_enabled)
+        return;
+
+    int rank, wsize;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &wsize);
+
+    size_t size;
+    char* text = format_events(rank, &size);
+    int count = size;
+    int* counts = NULL;
+    int* displs = NULL;
+    char* all = NULL;
+    if(rank == root){
+        counts = malloc(sizeof(*counts) * wsize);
+        displs = malloc(sizeof(*displs) * wsize);
+    }
+    MPI_Gather(&count, 1, MPI_INT, counts, 1, MPI_INT, root, comm);
+    if(rank == root){
+        int total = 0;
+        for(int i = 0; i < wsize; i++){
+            displs[i] = total;
+            total += counts[i];
+        }
+        all = malloc(sizeof(*all) * (total ? total : 1));
+    }
+    MPI_Gatherv(text, count, MPI_CHAR, all, counts, displs, MPI_CHAR, root, comm);
+
+    if(rank == root){
+        FILE* out = fopen(path, "w");
+        if(out){
+            size_t total = displs[wsize - 1] + counts[wsize - 1];
+            /* Every event ends with ",\n": the last one loses its comma */
+            fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+            fwrite(all, sizeof(*all), total >= 2 ? total - 2 : 0, out);
+            fprintf(out, "\n]}\n");
+            fclose(out);
+        }
+        else
+            fprintf(stderr, "Could not write the trace to %s\n", path);
+        free(all);
+        free(counts);
+        free(displs);
+    }
+
+    free(text);
+    for(size_t i = 0; i < nevents; i++)
+        free(events[i].detail);
+    free(events);
+    events = NULL;
+    nevents = capacity = 0;
+}
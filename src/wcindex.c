@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hashdict.h"
+#include "wcindex.h"
+
+/*********************************************************************************
+ * Binary result index.
+ * The CSV output comes in hash order, so finding a word in it means parsing all
+ * of it. The index keeps the same counts in a form that can be used in place:
+ * words sorted bytewise in one string table, an array of offsets into it and a
+ * fixed width array of counts, both indexed by the rank of the word in the sorted
+ * order. A table of 257 ids splits the words by their first byte, so a lookup is
+ * a binary search touching a handful of pages, and prefix lookups are the range
+ * between two binary searches. Ids sorted by count are stored too, so the top N
+ * words are the first N entries of that array.
+ * Readers map the file read only and only ever touch the pages they need.
+ * *******************************************************************************/
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+typedef struct{
+    const char* word;
+    int         len;
+    int         count;
+} Index_entry;
+
+typedef struct{
+    Index_entry*    entries;
+    size_t          size;
+} Entry_list;
+
+static int by_word(const void* a, const void* b){
+    const Index_entry* x = a;
+    const Index_entry* y = b;
+    int c = memcmp(x->word, y->word, x->len < y->len ? x->len : y->len);
+    if(c)
+        return c;
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+/* Sorts ids by count, the entries being already sorted by word */
+static const Index_entry* sorted_entries;
+static int by_count(const void* a, const void* b){
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    if(sorted_entries[x].count != sorted_entries[y].count)
+        return sorted_entries[x].count < sorted_entries[y].count ? 1 : -1;
+    return (x > y) - (x < y);
+}
+
+static int collect_entry(void *key, int count, int *value, void *user){
+    Entry_list* list = user;
+    if(*value){
+        list->entries[list->size].word = key;
+        list->entries[list->size].len = count;
+        list->entries[list->size].count = *value;
+        list->size++;
+    }
+    return 1;
+}
+
+static int write_section(FILE* file, const void* data, size_t size, uint64_t offset){
+    static const char padding[8] = { 0 };
+    long at = ftell(file);
+    if(at < 0 || (uint64_t)at > offset || fwrite(padding, 1, offset - at, file) != offset - at)
+        return -1;
+    return fwrite(data, 1, size, file) == size ? 0 : -1;
+}
+
+int wc_index_write(struct dictionary* dic, const char* file_name){
+    Entry_list list = { malloc(sizeof(*list.entries) * (dic->count ? dic->count : 1)), 0 };
+    dic_forEach(dic, collect_entry, &list);
+    qsort(list.entries, list.size, sizeof(*list.entries), by_word);
+
+    size_t n = list.size;
+    uint32_t* first = calloc(257, sizeof(*first));
+    uint64_t* offsets = malloc(sizeof(*offsets) * (n + 1));
+    int64_t* counts = malloc(sizeof(*counts) * (n ? n : 1));
+    uint32_t* by_counts = malloc(sizeof(*by_counts) * (n ? n : 1));
+    char* strings = NULL;
+
+    Wc_index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WCINDEX_MAGIC, sizeof(header.magic));
+    header.nwords = n;
+
+    offsets[0] = 0;
+    for(size_t i = 0; i < n; i++){
+        offsets[i + 1] = offsets[i] + list.entries[i].len;
+        counts[i] = list.entries[i].count;
+        header.total += list.entries[i].count;
+        by_counts[i] = i;
+        // first[b + 1] counts the words starting with b, then the prefix sums give the ranges
+        first[(unsigned char)list.entries[i].word[0] + 1]++;
+    }
+    for(int b = 1; b < 257; b++)
+        first[b] += first[b - 1];
+    sorted_entries = list.entries;
+    qsort(by_counts, n, sizeof(*by_counts), by_count);
+
+    strings = malloc(sizeof(*strings) * (offsets[n] ? offsets[n] : 1));
+    for(size_t i = 0; i < n; i++)
+        memcpy(strings + offsets[i], list.entries[i].word, list.entries[i].len);
+
+    header.first_offset = ALIGN8(sizeof(header));
+    header.offsets_offset = ALIGN8(header.first_offset + 257 * sizeof(*first));
+    header.counts_offset = ALIGN8(header.offsets_offset + (n + 1) * sizeof(*offsets));
+    header.by_count_offset = ALIGN8(header.counts_offset + n * sizeof(*counts));
+    header.strings_offset = ALIGN8(header.by_count_offset + n * sizeof(*by_counts));
+    header.strings_size = offsets[n];
+
+    // Readers may have the old index mapped: it's replaced in one go, never rewritten in place
+    char* temp_name = malloc(strlen(file_name) + sizeof(WCINDEX_TEMP_SUFFIX));
+    sprintf(temp_name, "%s%s", file_name, WCINDEX_TEMP_SUFFIX);
+    FILE* file = fopen(temp_name, "wb");
+    int failed = !file;
+    if(file){
+        failed = fwrite(&header, sizeof(header), 1, file) != 1
+            || write_section(file, first, 257 * sizeof(*first), header.first_offset)
+            || write_section(file, offsets, (n + 1) * sizeof(*offsets), header.offsets_offset)
+            || write_section(file, counts, n * sizeof(*counts), header.counts_offset)
+            || write_section(file, by_counts, n * sizeof(*by_counts), header.by_count_offset)
+            || write_section(file, strings, header.strings_size, header.strings_offset);
+        failed |= fclose(file) != 0;
+        if(!failed)
+            failed = rename(temp_name, file_name) != 0;
+        if(failed)
+            unlink(temp_name);
+    }
+
+    free(temp_name);
+    free(strings);
+    free(by_counts);
+    free(counts);
+    free(offsets);
+    free(first);
+    free(list.entries);
+    return failed ? -1 : 0;
+}
+
+int wc_index_open(Wc_index* index, const char* file_name){
+    int fd = open(file_name, O_RDONLY);
+    if(fd < 0)
+        return -1;
+    struct stat st;
+    if(fstat(fd, &st) || (size_t)st.st_size < sizeof(Wc_index_header)){
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return -1;
+    // Lookups jump around: readahead would only bring in pages nobody asked for
+    madvise(map, st.st_size, MADV_RANDOM);
+
+    const Wc_index_header* header = map;
+    uint64_t n = header->nwords;
+    uint64_t size = st.st_size;
+    if(memcmp(header->magic, WCINDEX_MAGIC, sizeof(header->magic))
+        || n > UINT32_MAX
+        || header->first_offset + 257 * sizeof(uint32_t) > size
+        || header->offsets_offset + (n + 1) * sizeof(uint64_t) > size
+        || header->counts_offset + n * sizeof(int64_t) > size
+        || header->by_count_offset + n * sizeof(uint32_t) > size
+        || header->strings_offset + header->strings_size > size
+        || (header->first_offset | header->offsets_offset | header->counts_offset | header->by_count_offset) % 8){
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    index->map = map;
+    index->size = st.st_size;
+    index->header = header;
+    index->first = (const uint32_t*)((const char*)map + header->first_offset);
+    index->offsets = (const uint64_t*)((const char*)map + header->offsets_offset);
+    index->counts = (const int64_t*)((const char*)map + header->counts_offset);
+    index->by_count = (const uint32_t*)((const char*)map + header->by_count_offset);
+    index->strings = (const char*)map + header->strings_offset;
+    if(index->first[256] != n || index->offsets[n] != header->strings_size){
+        munmap(map, st.st_size);
+        return -1;
+    }
+    return 0;
+}
+
+void wc_index_close(Wc_index* index){
+    munmap(index->map, index->size);
+    index->map = NULL;
+}
+
+/* Compares word id with key, looking at no more than limit bytes of the word */
+static int compare_word(const Wc_index* index, size_t id, const char* key, size_t len, size_t limit){
+    size_t wlen;
+    const char* word = wc_index_word(index, id, &wlen);
+    if(wlen > limit)
+        wlen = limit;
+    int c = memcmp(word, key, wlen < len ? wlen : len);
+    if(c)
+        return c;
+    return (wlen > len) - (wlen < len);
+}
+
+/* First id of [lo, hi) whose word, cut to limit bytes, isn't less than key */
+static size_t lower_bound(const Wc_index* index, size_t lo, size_t hi, const char* key, size_t len, size_t limit){
+    while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        if(compare_word(index, mid, key, len, limit) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+long wc_index_find(const Wc_index* index, const char* word, size_t len){
+    if(!len)
+        return -1;
+    unsigned char b = word[0];
+    size_t lo = index->first[b], hi = index->first[b + 1];
+    size_t id = lower_bound(index, lo, hi, word, len, (size_t)-1);
+    if(id < hi && !compare_word(index, id, word, len, (size_t)-1))
+        return id;
+    return -1;
+}
+
+size_t wc_index_prefix(const Wc_index* index, const char* prefix, size_t len, size_t* first){
+    size_t lo = 0, hi = index->header->nwords;
+    if(len){
+        lo = index->first[(unsigned char)prefix[0]];
+        hi = index->first[(unsigned char)prefix[0] + 1];
+    }
+    // Cut to the length of the prefix, every word starting with it compares equal: the range ends at the first greater one
+    *first = lower_bound(index, lo, hi, prefix, len, len);
+    size_t end = hi;
+    lo = *first;
+    while(lo < end){
+        size_t mid = lo + (end - lo) / 2;
+        if(compare_word(index, mid, prefix, len, len) <= 0)
+            lo = mid + 1;
+        else
+            end = mid;
+    }
+    return end - *first;
+}
@@ -1,15 +1,35 @@
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <time.h>
 #include <stdlib.h>
+#include <math.h>
 #include "mpi.h"
 #include "futils.h"
 #include "workload.h"
 #include "chnkcnt.h"
 #include "hashdict.h"
 #include "histogram.h"
+#include "chnkpool.h"
+#include "collread.h"
+#include "asyncread.h"
+#include "wcindex.h"
+#include "tasksched.h"
+#include "rescache.h"
+#include "topk.h"
+#include "hll.h"
+#include "trace.h"
+#include "sortout.h"
+#include "gzindex.h"
+#include "daemon.h"
 
 #define MASTER 0
+#define SHARD_TAG 2
+
+#define IO_MMAP 0
+#define IO_MPIIO 1
+#define IO_ASYNC 2
 
 typedef enum {
 	DEFAULT_MODE,
@@ -18,20 +38,56 @@ typedef enum {
 	FAILURE = -1
 } Mode;
 
+typedef struct {
+	Mode	mode;
+	char*	input_dir;
+	char*	output_file;
+	int		reduction;
+	int		threads;
+	int		io;
+	long	stripe;
+	int		align;
+	int		schedule;
+	long	task_size;
+	char*	manifest;
+	char*	cache_dir;
+	int		top;
+	int		distinct;
+	int		presize;
+	char*	trace;
+	int		sort;
+	int		charset;
+	char*	index_file;
+	char*	daemon;
+	int		scan_threads;
+} Options;
+
 void usage_print(char* program_name);
 
-Mode mode_init(int argc, char* argv[]);
+Mode mode_init(int argc, char* argv[], Options* opts);
+
+/* stdout without an output file. Returns NULL, and sets *failed, if the file can't be opened */
+FILE* open_output(const char* output_file, int* failed);
+
+int print_word(void *key, int count, int *value, void *user);
+
+int write_shard(struct dictionary* dic, char* output_file, int rank, int wsize);
+
+struct dictionary* run_job(Options* opts, struct dictionary* dic, char* exec_name, int rank, int wsize, int* failed);
+
+struct dictionary* run_daemon(Options* opts, struct dictionary* dic, char* exec_name, int rank, int wsize);
 
 int main(int argc, char* argv[]){
 	int rank, wsize;
-	long *localszs = NULL; 
-	double start, end;
+	Options opts;
 
-	MPI_Init(&argc, &argv);
+	// Only the main thread of each process talks to MPI, the others just count
+	int provided;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
 	MPI_Comm_size(MPI_COMM_WORLD, &wsize);
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
-	Mode mode = mode_init(argc, argv);
+	Mode mode = mode_init(argc, argv, &opts);
 
 	if(mode == FAILURE){
 		if(MASTER == rank)
@@ -39,36 +95,74 @@ int main(int argc, char* argv[]){
 		exit(EXIT_FAILURE);
 	}
 
-	// Creating histogram datatype for partial result transfer
-	MPI_Datatype histogram_element_dt;
-	MPI_Type_create_histogram(&histogram_element_dt);
+	// Without thread support every process keeps to one thread: a serial scan, and no reader thread for --io async
+	if(provided < MPI_THREAD_FUNNELED){
+		if(opts.threads > 1){
+			if(MASTER == rank)
+				fprintf(stderr, "\nThe MPI library doesn't support threads (MPI_THREAD_FUNNELED): -t must be 1\n");
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
+		opts.scan_threads = 1;
+		read_pipeline_allow_thread(0);
+	}
+
+	// Every process splits words the same way
+	tokenize_set_charset(opts.charset);
+
+	// The dictionary, its table and its key blocks, outlive the jobs
+	struct dictionary* dic = dic_new(0);
+	int failed = 0;
+	if(opts.daemon)
+		dic = run_daemon(&opts, dic, argv[0], rank, wsize);
+	else
+		dic = run_job(&opts, dic, argv[0], rank, wsize, &failed);
+	dic_delete(dic);
+
+    MPI_Finalize();
+
+	return failed ? EXIT_FAILURE : 0;
+}
+
+/* Counts the words of opts->input_dir into opts->output_file. dic comes in empty, and the dictionary left at the end
+   (the reductions may replace it) is returned to be cleared and reused. *failed is set on every process if some
+   output couldn't be written: that fails the job, not the processes */
+struct dictionary* run_job(Options* opts, struct dictionary* dic, char* exec_name, int rank, int wsize, int* failed){
+	double start, end;
+	*failed = 0;
 
 	// Starting line for benchmarking
 	MPI_Barrier(MPI_COMM_WORLD);
 	start = MPI_Wtime();
+	trace_init(opts->trace != NULL, MPI_COMM_WORLD);
+	double phase = trace_now();
 
-	// Obtaining all the files in the selected directory
-	size_t total_size;
+	// Obtaining all the files: the master walks the directory (or reads the manifest) and shares the list
+	size_t total_size = 0;
 	File_vector *file_list = NULL;
-	char* output_file = NULL;
-
-	// Depending on the mode
-	if(mode == DEFAULT_MODE)	// Reading from cwd
-		get_file_vec(&file_list, &total_size, ".", argv[0]);
+	if(MASTER == rank){
+		int found = opts->manifest ? read_manifest(&file_list, &total_size, opts->manifest) : get_file_vec(&file_list, &total_size, opts->input_dir, exec_name, opts->scan_threads);
+		if(found < 0){
+			fprintf(stderr, "\nCould not read %s\n", opts->manifest ? opts->manifest : opts->input_dir);
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
 
-	else if(mode == (DEFAULT_MODE + FILE_FLAG)){	// Reading from cwd with file output
-		get_file_vec(&file_list, &total_size, ".", argv[0]);
-		output_file = argv[2];
-	}
-	
-	else if(mode == DIRECTORY_MODE) // Reading from selected directory
-		get_file_vec(&file_list, &total_size, argv[2], argv[0]);
-	
-	else {
-		get_file_vec(&file_list, &total_size, argv[3], argv[0]);
-		output_file = argv[4];
+		// Compressed files are planned by the length of their uncompressed stream, indexed here the first time
+		if(gz_resolve_sizes(&file_list, &total_size) && opts->io == IO_MPIIO){
+			fprintf(stderr, "\nCompressed input can't be read with --io mpiio\n");
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
 	}
 
+	// Unchanged files are taken from the cache, only the others get a workload
+	Result_cache cache = { opts->cache_dir, NULL, NULL };
+	if(opts->cache_dir && MASTER == rank){
+		double lookup = trace_now();
+		size_t cached = cache_lookup(&cache, &file_list, &total_size, dic);
+		fprintf(stderr, "\n\t%zu file(s) from the cache\n", cached);
+		trace_event("cache lookup", NULL, lookup, 0);
+	}
+	share_file_vec(&file_list, &total_size, MASTER, MPI_COMM_WORLD);
+	trace_event("discovery", NULL, phase, total_size);
 
 	// Printing the list of files 
 	if(MASTER == rank){
@@ -76,165 +170,523 @@ int main(int argc, char* argv[]){
 		fprintf(stderr, "\n\tTotal Size: %8ld bytes\n", total_size);
 	}
 
-	// Dividing workloads
-	Chunk_vector **chunks_proc = malloc(sizeof(*chunks_proc) * wsize);
-	for(int i = 0; i < wsize; i++)
-		chunks_proc[i] = NULL;
+	Hll_sketch sketch;
+	hll_init(&sketch);
+	double global_words = 0;
+	Topk_summary* summary = NULL;
+	if(opts->top)
+		summary = topk_new(TOPK_FACTOR * opts->top > TOPK_MIN_COUNTERS ? TOPK_FACTOR * opts->top : TOPK_MIN_COUNTERS);
+	if(opts->schedule == SCHEDULE_DYNAMIC){
+		// Cutting the files in tasks, claimed at run time by whoever is free
+		phase = trace_now();
+		Chunk_vector* tasks = NULL;
+		get_tasks(&tasks, &file_list, opts->task_size);
+		free_file_vec(file_list);
+		trace_event("planning", NULL, phase, 0);
 
-	// Computing workload for all wsize processes
-	get_workload(chunks_proc, wsize, &file_list, total_size, file_list->size);
+		if(MASTER == rank)
+			fprintf(stderr, "\n\t%zu task(s) of about %ld bytes\n", tasks ? tasks->size : 0, opts->task_size);
 
-	// Freeing heap memory
-	free(file_list);
+		count_tasks(tasks, opts->threads, dic, MPI_COMM_WORLD);
 
-	// Printing the workload for each processor
-	if(MASTER == rank){
-		for(int i = 0; i < wsize; i++)
-			print_chunk_vec(&chunks_proc[i]);
+		for(size_t i = 0; tasks && i < tasks->size; i++)
+			free(tasks->chunks[i].file_name);
+		free(tasks);
 	}
+	else {
+		// Dividing workloads
+		phase = trace_now();
+		Chunk_vector **chunks_proc = malloc(sizeof(*chunks_proc) * wsize);
+		for(int i = 0; i < wsize; i++)
+			chunks_proc[i] = NULL;
 
-	// Counting words
-	sync_info* special_chunks = malloc(sizeof(*special_chunks) * 2);
-	special_chunks[0].chunk_type = -1;
-	special_chunks[1].chunk_type = -1;
+		// Computing workload for all wsize processes
+		get_workload(chunks_proc, wsize, &file_list, total_size, file_list->size);
 
-	struct dictionary* dic = dic_new(0);
-	for(size_t i = 0, j = 0; i < chunks_proc[rank]->size; i++){
-		File_chunk curr_chunk = chunks_proc[rank]->chunks[i];
-		char* first_word = NULL;
-		char* last_word = count_words_chunk(curr_chunk.file_name, curr_chunk.start, curr_chunk.end, dic, &first_word);
-		if(curr_chunk.special_position != UNIQUE){
-			special_chunks[j].last_word = last_word ? strdup(last_word): NULL;
-			special_chunks[j].first_word = first_word ? strdup(first_word): NULL;
-			special_chunks[j].chunk_type = curr_chunk.special_position;
-			j++;
-		}
+		// Collective reads work best when nobody shares a stripe with someone else
+		if(opts->io == IO_MPIIO)
+			align_workload(chunks_proc, wsize, opts->stripe);
 
-		// Freeing heap memory
-		if(first_word)
-			free(first_word);
-		if(last_word)
-			free(last_word);
-	}
+		// Moving the cuts between processes off the words, so that (almost) no synchronization is needed
+		char* needs_sync = NULL;
+		if(opts->align){
+			needs_sync = malloc(sizeof(*needs_sync) * wsize);
+			align_cuts_to_words(chunks_proc, rank, wsize, needs_sync, MPI_COMM_WORLD);
+		}
 
-	for(int i = 0; i < 2; i++){
-		if(special_chunks[i].chunk_type==FIRST){
-			sync_with_next(special_chunks[i].last_word, rank, dic, MPI_COMM_WORLD);
+		// Printing the workload for each processor
+		if(MASTER == rank){
+			for(int i = 0; i < wsize; i++)
+				print_chunk_vec(&chunks_proc[i]);
 		}
-		else if(special_chunks[i].chunk_type == LAST){
-			sync_with_prev(special_chunks[i].first_word, rank, dic, MPI_COMM_WORLD);
+		trace_event("planning", NULL, phase, 0);
+
+		// Sizing the dictionary for the words we're about to see: one more pass over the input, but no resizes
+		if(opts->presize){
+			phase = trace_now();
+			hll_sketch_chunks(&sketch, chunks_proc[rank]);
+			dic_reserve(dic, hll_estimate(&sketch));
+			hll_allreduce(&sketch, MPI_COMM_WORLD);
+			global_words = hll_estimate(&sketch);
+			trace_event("presize", NULL, phase, 0);
 		}
-		else if(special_chunks[i].chunk_type == REGULAR){
-			sync_with_prev(special_chunks[i].first_word, rank, dic, MPI_COMM_WORLD);
-			sync_with_next(special_chunks[i].last_word, rank, dic, MPI_COMM_WORLD);
+		else if(!opts->distinct && !summary){
+			// A sample of a large input is enough for a first size (small ones just grow): past it the table grows a few groups per insert
+			phase = trace_now();
+			dic_reserve(dic, hll_vocabulary_hint(chunks_proc[rank]));
+			trace_event("presize", NULL, phase, 0);
 		}
-	}
-
 
-	// Freeing heap memory
-	for(int i = 0; i < wsize; i++)
-		free(chunks_proc[i]);
-	free(chunks_proc);
-
-	free(special_chunks);
-
-	// Creating local histograms
-	histogram_element *local_elements = malloc(sizeof(*local_elements) * dic->count);
-	long snd_sz = get_local_histogram(local_elements, dic);
-
-	if(MASTER == rank)
-		localszs = malloc(sizeof(*localszs)*wsize);
-	
-	// Gathering the number of words to receive from each process
-	MPI_Gather(&snd_sz, 1, MPI_LONG, localszs, 1, MPI_LONG, MASTER, MPI_COMM_WORLD);
-
-	if(MASTER == rank){
-		// Allocating space for wsize histogram_element[]
-		histogram_element **process_histograms = malloc(sizeof(*process_histograms)*wsize);
-		for(int i = 1; i < wsize; i++)
-			process_histograms[i] = malloc(sizeof(histogram_element) * localszs[i]);
-
-		// Receiving local histograms
-		MPI_Status status;
-		for(int i = 1; i < wsize; i++){
-			MPI_Recv(process_histograms[i], localszs[i], histogram_element_dt, i, 0, MPI_COMM_WORLD, &status);
+		if(opts->distinct){
+			// Just the sketch, no dictionary at all
+			phase = trace_now();
+			hll_sketch_chunks(&sketch, chunks_proc[rank]);
+			trace_event("sketch", NULL, phase, 0);
 		}
-
-		// Merge histograms in one big histogram 
-		merge_dict(dic, process_histograms, localszs, wsize);
-
-		FILE *output_file_pointer;
-		if(mode == DEFAULT_MODE || mode == DIRECTORY_MODE){
-			output_file_pointer = stdout;
+		else if(opts->cache_dir){
+			// Every chunk gets a histogram of its own, for the cache entry of its file
+			count_and_cache(&cache, file_list, chunks_proc, opts->threads, dic, MASTER, MPI_COMM_WORLD);
+		}
+		else if(summary){
+			// Words go to the summary, and a summary can't take back a partial word: chunks own the words starting in them
+			for(size_t i = 0; i < chunks_proc[rank]->size; i++){
+				phase = trace_now();
+				File_chunk owned = chunks_proc[rank]->chunks[i];
+				own_words(&owned);
+				tokenize_chunk(owned.file_name, owned.start, owned.end, topk_add, summary);
+				trace_event("count", owned.file_name, phase, owned.end - owned.start);
+			}
 		}
 		else {
-			output_file_pointer = fopen(output_file, "w+");
+			// Posting the exchange of the words on our cuts (cut rank-1 is the previous one, cut rank the next one),
+			// it completes while we count
+			int sync_prev = rank > 0 && (!needs_sync || needs_sync[rank - 1]);
+			int sync_next = rank < wsize - 1 && (!needs_sync || needs_sync[rank]);
+			phase = trace_now();
+			Boundary_exchange boundary;
+			boundary_post(&boundary, chunks_proc[rank], rank, sync_prev, sync_next, MPI_COMM_WORLD);
+			trace_event("boundary post", NULL, phase, 0);
+
+			// Counting words
+			if(opts->io == IO_MPIIO)
+				count_chunk_vector_mpiio(chunks_proc, rank, wsize, opts->stripe, dic);
+			else if(opts->io == IO_ASYNC)
+				count_chunk_vector_async(chunks_proc[rank], dic);
+			else
+				count_chunk_vector(chunks_proc[rank], opts->threads, dic);
+
+			// Fixing the words split by the cuts
+			phase = trace_now();
+			boundary_complete(&boundary, dic);
+			trace_event("boundary sync", NULL, phase, 0);
 		}
-
-		// Make it a function so it's less verbose? @todo
-		// Printing to output_file
-		fprintf(output_file_pointer, "Word, Count\n");
-		for (int i = 0; i < dic->length; i++) {
-	        if (dic->table[i] != 0) {
-	            struct keynode *k = dic->table[i];
-	            while (k) {
-	                if(k->value){
-	                    fprintf(output_file_pointer, "%.*s, %d\n", k->len, k->key, k->value);
-	                }
-	                k = k->next;
-	            }
-	        }
-    	}
+		free(needs_sync);
+		free_file_vec(file_list);
+		free_result_cache(&cache);
 
 		// Freeing heap memory
-		free(process_histograms);
-		free(localszs);
+		for(int i = 0; i < wsize; i++)
+			free(chunks_proc[i]);
+		free(chunks_proc);
+	}
+
+	if(opts->distinct){
+		hll_reduce(&sketch, MASTER, MPI_COMM_WORLD);
+		if(MASTER == rank){
+			FILE *output_file_pointer = open_output(opts->output_file, failed);
+			if(output_file_pointer)
+				fprintf(output_file_pointer, "Distinct words: %.0f (standard error %.2f%%)\n", hll_estimate(&sketch), 104.0 / sqrt(HLL_REGISTERS));
+			if(output_file_pointer && output_file_pointer != stdout)
+				fclose(output_file_pointer);
+		}
+	}
+	else if(summary){
+		// Only the summaries travel, up a binomial tree
+		topk_reduce(summary, MASTER, MPI_COMM_WORLD);
+		if(MASTER == rank){
+			FILE *output_file_pointer = open_output(opts->output_file, failed);
+			if(output_file_pointer)
+				topk_print(summary, opts->top, output_file_pointer);
+			if(output_file_pointer && output_file_pointer != stdout)
+				fclose(output_file_pointer);
+		}
+		topk_delete(summary);
+	}
+	else if(opts->sort){
+		// Exact counts first, partitioned by hash, then sorted across all processes
+		dic = shuffle_histograms(dic, MPI_COMM_WORLD);
+		*failed = write_sorted(dic, opts->sort, opts->output_file, MASTER, MPI_COMM_WORLD) != 0;
+	}
+	else if(opts->reduction == REDUCE_SHUFFLE){
+		// Every process owns a slice of the vocabulary and writes its own shard
+		dic = shuffle_histograms(dic, MPI_COMM_WORLD);
+		phase = trace_now();
+		*failed = write_shard(dic, opts->output_file, rank, wsize) != 0;
+		trace_event("write", NULL, phase, 0);
 	}
 	else {
-		// Sending histograms to master 
-		MPI_Send(local_elements, snd_sz, histogram_element_dt, MASTER, 0, MPI_COMM_WORLD);
+		// Reducing every local histogram into the master's dictionary, sized for the whole vocabulary if we know it
+		if(MASTER == rank && global_words > 0)
+			dic_reserve(dic, global_words);
+		reduce_histograms(dic, opts->reduction, MASTER, MPI_COMM_WORLD);
+
+		if(MASTER == rank){
+			FILE *output_file_pointer = open_output(opts->output_file, failed);
+
+			// Printing to output_file
+			if(output_file_pointer){
+				phase = trace_now();
+				fprintf(output_file_pointer, "Word, Count\n");
+				dic_forEach(dic, print_word, output_file_pointer);
+				trace_event("write", NULL, phase, 0);
+
+				if(output_file_pointer != stdout)
+					fclose(output_file_pointer);
+			}
+
+			// Same counts, sorted and laid out to be used straight from an mmap
+			if(opts->index_file){
+				phase = trace_now();
+				if(wc_index_write(dic, opts->index_file)){
+					fprintf(stderr, "\nUnable to write index %s.\n", opts->index_file);
+					*failed = 1;
+				}
+				trace_event("index", NULL, phase, 0);
+			}
+		}
 	}
 
-	MPI_Barrier(MPI_COMM_WORLD);
+	// Shards fail on their own process, the rest on the master: everybody gets to know, which also lines them up
+	MPI_Allreduce(MPI_IN_PLACE, failed, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
     end = MPI_Wtime();
 
-    // Freeing heap memory
-	dic_delete(dic);
-	free(local_elements);
+    // Freeing heap memory. Indexes are loaded again by the next job, the files may have changed in between
+	gz_free_indexes();
 
     if(MASTER == rank)
     	fprintf(stderr, "\n\tTime elapsed: %f\n", end-start);
 
-    MPI_Type_free(&histogram_element_dt);
-    MPI_Finalize();
+    if(opts->trace)
+    	trace_write(opts->trace, MASTER, MPI_COMM_WORLD);
 
-	return 0;
+    return dic;
+}
+
+/* Runs the jobs of opts->daemon, with the options of the daemon, until one says stop */
+struct dictionary* run_daemon(Options* opts, struct dictionary* dic, char* exec_name, int rank, int wsize){
+	Job_source source;
+	if(MASTER == rank && job_source_open(&source, opts->daemon)){
+		fprintf(stderr, "\n%s is neither a directory nor a FIFO\n", opts->daemon);
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	for(;;){
+		Daemon_job job = { NULL, NULL, NULL };
+		int running = 1;
+		if(MASTER == rank){
+			// A job whose input isn't there, or whose output can't be written, fails right away: nobody else hears of it
+			while((running = job_next(&source, &job)) && job_check(&job)){
+				job_finish(&source, &job, 1);
+				job_free(&job);
+			}
+		}
+		if(!job_share(&job, running, MASTER, MPI_COMM_WORLD))
+			break;
+
+		opts->input_dir = job.input_dir;
+		opts->output_file = job.output_file;
+		dic_clear(dic);
+		int failed;
+		dic = run_job(opts, dic, exec_name, rank, wsize, &failed);
+
+		if(MASTER == rank)
+			job_finish(&source, &job, failed);
+		job_free(&job);
+	}
+
+	if(MASTER == rank)
+		job_source_close(&source);
+	return dic;
 }
 
 void usage_print(char* exec_name){
-	fprintf(stderr, "Usage: %s [-d] [-f]  <directory> <output_file>\n", exec_name);
+	fprintf(stderr, "Usage: %s [-d] [-f] [options] <directory> <output_file>\n", exec_name);
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "  -d : Specify directory\n");
 	fprintf(stderr, "  -f : Specify file\n");
 	fprintf(stderr, "  -d -f : Specify directory and file\n");
+	fprintf(stderr, "  -r, --reduce flat|tree|shuffle|ids : How local histograms are reduced (default: flat).\n");
+	fprintf(stderr, "      shuffle partitions the vocabulary by hash, every process writes <output_file>.<rank>\n");
+	fprintf(stderr, "      ids agrees on a global ID for every word and sums dense count vectors on the master\n");
+	fprintf(stderr, "  -t, --threads N : Counting threads for every process (default: 1). More than one needs MPI_THREAD_FUNNELED\n");
+	fprintf(stderr, "  -i, --io mmap|mpiio|async : Input backend (default: mmap). mpiio reads shared files collectively,\n");
+	fprintf(stderr, "      with chunks aligned to stripes. async keeps %d reads of %d KiB in flight (io_uring, or a reader\n", ASYNC_DEPTH, ASYNC_BLOCK >> 10);
+	fprintf(stderr, "      thread) while tokenizing. Both count in the main thread only\n");
+	fprintf(stderr, "  -S, --stripe BYTES : Stripe size of the file system, for --io mpiio (default: %d)\n", MPIIO_STRIPE);
+	fprintf(stderr, "  -a, --align : Move the cuts between processes to the nearest non-word byte, skipping synchronization\n");
+	fprintf(stderr, "  -s, --schedule static|dynamic : static splits the input evenly between processes up front (default),\n");
+	fprintf(stderr, "      dynamic cuts it in tasks that processes claim as they go. Only with --io mmap\n");
+	fprintf(stderr, "  -T, --task-size BYTES : Size of a task, for --schedule dynamic (default: %d)\n", TASK_SIZE);
+	fprintf(stderr, "  -m, --manifest FILE : Read the files listed in FILE, one per line (optionally followed by a tab and\n");
+	fprintf(stderr, "      the size in bytes), instead of walking a directory. Can't be used with -d\n");
+	fprintf(stderr, "  -c, --cache DIR : Keep the histogram of every file in DIR, and only count the files that changed\n");
+	fprintf(stderr, "      since the last run. Not available with --schedule dynamic, nor with --io other than mmap\n");
+	fprintf(stderr, "  -k, --top K : Only the K most frequent words, counted in fixed memory (Space-Saving), with error bounds.\n");
+	fprintf(stderr, "      Not available with --schedule dynamic, --io other than mmap or --cache\n");
+	fprintf(stderr, "  -u, --distinct : Only estimate how many distinct words there are, with HyperLogLog sketches\n");
+	fprintf(stderr, "  -p, --presize : Estimate the vocabulary first (one more pass over the input) to size the dictionaries\n");
+	fprintf(stderr, "      upfront. Neither is available with --schedule dynamic\n");
+	fprintf(stderr, "  -x, --trace FILE : Write the phases of every process (and thread) to FILE, in Chrome trace JSON\n");
+	fprintf(stderr, "  -o, --sort word|count : Sort the output by word, or by count (highest first), with a sample sort over\n");
+	fprintf(stderr, "      all processes that write their ranges of <output_file> in parallel. Reduces with a shuffle,\n");
+	fprintf(stderr, "      whatever --reduce says. Not available with --top or --distinct\n");
+	fprintf(stderr, "  -C, --charset ascii|latin1|utf8 : What a word is made of (default: ascii, runs of [A-Za-z0-9]).\n");
+	fprintf(stderr, "      latin1 adds the letters of ISO-8859-1, utf8 the letters of UTF-8 text, case folded as Unicode's\n");
+	fprintf(stderr, "      simple case folding in every script with a case\n");
+	fprintf(stderr, "  -I, --index FILE : Also write the counts to FILE as a binary index, sorted and usable through mmap\n");
+	fprintf(stderr, "      (see wc_query.out). Not available with --reduce shuffle, --sort, --top or --distinct\n");
+	fprintf(stderr, "  -D, --daemon SPOOL : Stay up and run jobs, with the same options, until a job says \"%s\". SPOOL is a FIFO\n", DAEMON_STOP);
+	fprintf(stderr, "      or a directory of <name>%s files, renamed to <name>%s and then <name>%s (or %s). A job is a line:\n", JOB_SUFFIX, JOB_RUNNING_SUFFIX, JOB_DONE_SUFFIX, JOB_FAILED_SUFFIX);
+	fprintf(stderr, "      the directory, then optionally a tab and the output file. Can't be used with -d, -f or -m\n");
+	fprintf(stderr, "Directories are walked recursively.\n");
 	fprintf(stderr, "If you launch the executable without arguments it will scan the cwd.\n");
 }
 
-Mode mode_init(int argc, char* argv[]){
+FILE* open_output(const char* output_file, int* failed){
+	if(!output_file)
+		return stdout;
+	FILE* output_file_pointer = fopen(output_file, "w+");
+	if(!output_file_pointer){
+		fprintf(stderr, "\nUnable to open file %s for writing.\n", output_file);
+		*failed = 1;
+	}
+	return output_file_pointer;
+}
+
+int print_word(void *key, int count, int *value, void *user){
+	if(*value)
+		fprintf((FILE*)user, "%.*s, %d\n", count, (char*)key, *value);
+	return 1;
+}
+
+/* Shards go to <output_file>.<rank>, each one with its own header. Without an output file every process
+   formats its shard in memory and the master prints them, in rank order, under a single header:
+   stdout is forwarded by mpirun, which wouldn't keep the lines of different processes apart. */
+int write_shard(struct dictionary* dic, char* output_file, int rank, int wsize){
+	if(output_file){
+		char shard_name[strlen(output_file) + 16];
+		sprintf(shard_name, "%s.%d", output_file, rank);
+		int failed = 0;
+		FILE *output_file_pointer = open_output(shard_name, &failed);
+		if(failed)
+			return -1;
+		fprintf(output_file_pointer, "Word, Count\n");
+		dic_forEach(dic, print_word, output_file_pointer);
+		fclose(output_file_pointer);
+		return 0;
+	}
+
+	if(MASTER == rank){
+		fprintf(stdout, "Word, Count\n");
+		dic_forEach(dic, print_word, stdout);
+		for(int i = 1; i < wsize; i++){
+			MPI_Message message;
+			MPI_Status status;
+			int size;
+			MPI_Mprobe(i, SHARD_TAG, MPI_COMM_WORLD, &message, &status);
+			MPI_Get_count(&status, MPI_CHAR, &size);
+			char* shard = malloc(sizeof(*shard) * (size ? size : 1));
+			MPI_Mrecv(shard, size, MPI_CHAR, &message, &status);
+			fwrite(shard, sizeof(*shard), size, stdout);
+			free(shard);
+		}
+	}
+	else {
+		char* shard = NULL;
+		size_t size = 0;
+		FILE *shard_stream = open_memstream(&shard, &size);
+		dic_forEach(dic, print_word, shard_stream);
+		fclose(shard_stream);
+		MPI_Send(shard, size, MPI_CHAR, MASTER, SHARD_TAG, MPI_COMM_WORLD);
+		free(shard);
+	}
+	return 0;
+}
+
+Mode mode_init(int argc, char* argv[], Options* opts){
+	static struct option long_options[] = {
+		{"reduce",	required_argument,	NULL, 'r'},
+		{"threads",	required_argument,	NULL, 't'},
+		{"io",		required_argument,	NULL, 'i'},
+		{"stripe",	required_argument,	NULL, 'S'},
+		{"align",	no_argument,		NULL, 'a'},
+		{"schedule",	required_argument,	NULL, 's'},
+		{"task-size",	required_argument,	NULL, 'T'},
+		{"manifest",	required_argument,	NULL, 'm'},
+		{"cache",	required_argument,	NULL, 'c'},
+		{"top",		required_argument,	NULL, 'k'},
+		{"distinct",	no_argument,		NULL, 'u'},
+		{"presize",	no_argument,		NULL, 'p'},
+		{"trace",	required_argument,	NULL, 'x'},
+		{"sort",	required_argument,	NULL, 'o'},
+		{"charset",	required_argument,	NULL, 'C'},
+		{"index",	required_argument,	NULL, 'I'},
+		{"daemon",	required_argument,	NULL, 'D'},
+		{NULL,		0,					NULL,  0 }
+	};
 	int opt;
 	Mode exec_mode = DEFAULT_MODE;
 
-	while((opt = getopt(argc, argv, "df")) != -1) {
+	opts->input_dir = ".";
+	opts->output_file = NULL;
+	opts->reduction = REDUCE_FLAT;
+	opts->threads = 1;
+	opts->scan_threads = SCAN_THREADS;
+	opts->io = IO_MMAP;
+	opts->stripe = MPIIO_STRIPE;
+	opts->align = 0;
+	opts->schedule = SCHEDULE_STATIC;
+	opts->task_size = TASK_SIZE;
+	opts->manifest = NULL;
+	opts->cache_dir = NULL;
+	opts->top = 0;
+	opts->distinct = 0;
+	opts->presize = 0;
+	opts->trace = NULL;
+	opts->sort = SORT_NONE;
+	opts->charset = TOK_ASCII;
+	opts->index_file = NULL;
+	opts->daemon = NULL;
+
+	while((opt = getopt_long(argc, argv, "dfr:t:i:S:as:T:m:c:k:upx:o:C:I:D:", long_options, NULL)) != -1) {
 		switch(opt){
 			case 'd': exec_mode += DIRECTORY_MODE; break;
 			case 'f': exec_mode += FILE_FLAG; break;
+			case 'r':
+				if(!strcmp(optarg, "flat"))
+					opts->reduction = REDUCE_FLAT;
+				else if(!strcmp(optarg, "tree"))
+					opts->reduction = REDUCE_TREE;
+				else if(!strcmp(optarg, "shuffle"))
+					opts->reduction = REDUCE_SHUFFLE;
+				else if(!strcmp(optarg, "ids"))
+					opts->reduction = REDUCE_IDS;
+				else
+					return FAILURE;
+				break;
+			case 'I': opts->index_file = optarg; break;
+			case 'D': opts->daemon = optarg; break;
+			case 'C':
+				if(!strcmp(optarg, "ascii"))
+					opts->charset = TOK_ASCII;
+				else if(!strcmp(optarg, "latin1"))
+					opts->charset = TOK_LATIN1;
+				else if(!strcmp(optarg, "utf8"))
+					opts->charset = TOK_UTF8;
+				else
+					return FAILURE;
+				break;
+			case 't':
+				opts->threads = atoi(optarg);
+				if(opts->threads < 1)
+					return FAILURE;
+				break;
+			case 'i':
+				if(!strcmp(optarg, "mmap"))
+					opts->io = IO_MMAP;
+				else if(!strcmp(optarg, "mpiio"))
+					opts->io = IO_MPIIO;
+				else if(!strcmp(optarg, "async"))
+					opts->io = IO_ASYNC;
+				else
+					return FAILURE;
+				break;
+			case 'S':
+				opts->stripe = atol(optarg);
+				if(opts->stripe < 1)
+					return FAILURE;
+				break;
+			case 'a': opts->align = 1; break;
+			case 's':
+				if(!strcmp(optarg, "static"))
+					opts->schedule = SCHEDULE_STATIC;
+				else if(!strcmp(optarg, "dynamic"))
+					opts->schedule = SCHEDULE_DYNAMIC;
+				else
+					return FAILURE;
+				break;
+			case 'T':
+				opts->task_size = atol(optarg);
+				if(opts->task_size < 1)
+					return FAILURE;
+				break;
+			case 'm': opts->manifest = optarg; break;
+			case 'c': opts->cache_dir = optarg; break;
+			case 'u': opts->distinct = 1; break;
+			case 'p': opts->presize = 1; break;
+			case 'x': opts->trace = optarg; break;
+			case 'o':
+				if(!strcmp(optarg, "word"))
+					opts->sort = SORT_WORD;
+				else if(!strcmp(optarg, "count"))
+					opts->sort = SORT_COUNT;
+				else
+					return FAILURE;
+				break;
+			case 'k':
+				opts->top = atoi(optarg);
+				if(opts->top < 1)
+					return FAILURE;
+				break;
+			default: return FAILURE;
 		}
 	}
 
-	if((argc > 5) || (exec_mode == DIRECTORY_MODE && argc != 3) || (exec_mode == FILE_FLAG && argc != 3) || (exec_mode == (DIRECTORY_MODE+FILE_FLAG) && argc != 5)) {
-		exec_mode = FAILURE;
+	// Cache entries are per file, and need every chunk counted on its own with the static workload
+	if(opts->cache_dir && (opts->schedule == SCHEDULE_DYNAMIC || opts->io != IO_MMAP))
+		return FAILURE;
+
+	// Summaries are filled by the main thread, straight from the static chunks
+	if(opts->top && (opts->schedule == SCHEDULE_DYNAMIC || opts->io != IO_MMAP || opts->cache_dir))
+		return FAILURE;
+
+	// Sketches are filled from the static chunks, before (or instead of) counting
+	if((opts->distinct || opts->presize) && opts->schedule == SCHEDULE_DYNAMIC)
+		return FAILURE;
+	if(opts->distinct && (opts->io != IO_MMAP || opts->cache_dir || opts->top))
+		return FAILURE;
+
+	// Those two print their own estimates, there's no histogram to sort
+	if(opts->sort && (opts->top || opts->distinct))
+		return FAILURE;
+
+	// The index is written by the master, from the whole vocabulary
+	if(opts->index_file && (opts->top || opts->distinct || opts->sort || opts->reduction == REDUCE_SHUFFLE))
+		return FAILURE;
+
+	// A manifest replaces the directory
+	if(opts->manifest && (exec_mode == DIRECTORY_MODE || exec_mode == (DIRECTORY_MODE+FILE_FLAG)))
+		return FAILURE;
+
+	// Collective and pipelined reads need to know the whole workload in advance
+	if(opts->schedule == SCHEDULE_DYNAMIC && opts->io != IO_MMAP)
+		return FAILURE;
+
+	// Resident: directories and output files come with the jobs
+	if(opts->daemon && (exec_mode != DEFAULT_MODE || optind < argc || opts->manifest))
+		return FAILURE;
+
+	// Whatever is left are the directory and/or the output file, in this order
+	int positional = argc - optind;
+	if((exec_mode == DEFAULT_MODE && positional != 0) || (exec_mode == DIRECTORY_MODE && positional != 1) || (exec_mode == FILE_FLAG && positional != 1) || (exec_mode == (DIRECTORY_MODE+FILE_FLAG) && positional != 2) || exec_mode > (DIRECTORY_MODE+FILE_FLAG)) {
+		return FAILURE;
 	}
 
+	if(exec_mode == DIRECTORY_MODE || exec_mode == (DIRECTORY_MODE+FILE_FLAG))
+		opts->input_dir = argv[optind++];
+	if(exec_mode == FILE_FLAG || exec_mode == (DIRECTORY_MODE+FILE_FLAG))
+		opts->output_file = argv[optind++];
+
+	opts->mode = exec_mode;
 	return exec_mode;
 }
-
@@ -115,7 +115,66 @@ void get_workload(Chunk_vector** chunks_proc, int wsize, File_vector** file_list
         }
     }
     for(int i = 0; i < wsize; i++){
+        // Processes left without work still get an (empty) chunk vector
+        if(!chunks_proc[i])
+            chunks_proc[i] = calloc(1, sizeof(**chunks_proc));
         set_owner(&chunks_proc[i], i);
     }
 }
 
+
+int get_cut(Chunk_vector** chunks_proc, int proc, File_chunk** before, File_chunk** after){
+    if(!chunks_proc[proc] || !chunks_proc[proc + 1] || !chunks_proc[proc]->size || !chunks_proc[proc + 1]->size)
+        return 0;
+
+    *before = &chunks_proc[proc]->chunks[chunks_proc[proc]->size - 1];
+    *after = &chunks_proc[proc + 1]->chunks[0];
+    return (*before)->end == (*after)->start && !strcmp((*before)->file_name, (*after)->file_name);
+}
+
+int move_cut(Chunk_vector** chunks_proc, int proc, long offset){
+    File_chunk *before, *after;
+    if(!get_cut(chunks_proc, proc, &before, &after) || offset <= before->start || offset >= after->end)
+        return 1;
+
+    before->end = offset;
+    after->start = offset;
+    return 0;
+}
+
+void align_workload(Chunk_vector** chunks_proc, int wsize, long alignment){
+    for(int i = 0; i < wsize - 1; i++){
+        File_chunk *before, *after;
+        if(!get_cut(chunks_proc, i, &before, &after))
+            continue;
+
+        // Rounding to the nearest multiple, and if that would empty a chunk, to the other one
+        long down = before->end - before->end % alignment;
+        long up = down + alignment;
+        long nearest = (before->end - down) <= (up - before->end) ? down : up;
+        if(move_cut(chunks_proc, i, nearest))
+            move_cut(chunks_proc, i, nearest == down ? up : down);
+    }
+}
+
+void get_tasks(Chunk_vector** tasks, File_vector** file_list, long task_size){
+    for(size_t i = 0; i < file_list[0]->size; i++){
+        File_info cur_file = file_list[0]->files[i];
+        long file_size = cur_file.file_size;
+        if(file_size <= task_size){
+            chunk_push_back(tasks, strdup(cur_file.file_name), 0, file_size, UNIQUE);
+            continue;
+        }
+
+        // The last task of a file takes the leftover, rather than leaving a tiny one behind
+        for(long start = 0; start < file_size; start += task_size){
+            long end = file_size - start < task_size + task_size / 2 ? file_size : start + task_size;
+            int type = start == 0 ? FIRST : (end == file_size ? LAST : REGULAR);
+            chunk_push_back(tasks, strdup(cur_file.file_name), start, end, type);
+            if(end == file_size)
+                break;
+        }
+    }
+    if(*tasks)
+        set_owner(tasks, -1);
+}
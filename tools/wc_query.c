@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "wcindex.h"
+
+/* Looks words up in an index written with --index, straight from the mapped file. Prints CSV, like word_count. */
+
+static void usage_print(char* exec_name){
+    fprintf(stderr, "Usage: %s [options] <index_file> [word ...]\n", exec_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -p PREFIX : Every word starting with PREFIX, in word order\n");
+    fprintf(stderr, "  -n N : The N most frequent words\n");
+    fprintf(stderr, "  -s : Only print the number of words and their total count\n");
+    fprintf(stderr, "Words are looked up as they're given: the index holds them lowercased, as they were counted.\n");
+    fprintf(stderr, "Words that aren't in the index are printed with a count of 0.\n");
+}
+
+static void print_id(const Wc_index* index, size_t id){
+    size_t len;
+    const char* word = wc_index_word(index, id, &len);
+    printf("%.*s, %lld\n", (int)len, word, (long long)index->counts[id]);
+}
+
+int main(int argc, char* argv[]){
+    const char* prefix = NULL;
+    long top = 0;
+    int summary = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "p:n:s")) != -1){
+        switch(opt){
+            case 'p': prefix = optarg; break;
+            case 'n': top = atol(optarg); break;
+            case 's': summary = 1; break;
+            default: usage_print(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if(optind >= argc || top < 0){
+        usage_print(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Wc_index index;
+    if(wc_index_open(&index, argv[optind])){
+        fprintf(stderr, "%s is not a word count index\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    if(summary)
+        printf("Words: %llu, Total: %llu\n", (unsigned long long)index.header->nwords, (unsigned long long)index.header->total);
+
+    if(prefix || top || optind + 1 < argc)
+        printf("Word, Count\n");
+
+    for(int i = optind + 1; i < argc; i++){
+        long id = wc_index_find(&index, argv[i], strlen(argv[i]));
+        if(id >= 0)
+            print_id(&index, id);
+        else
+            printf("%s, 0\n", argv[i]);
+    }
+
+    if(prefix){
+        size_t first;
+        size_t count = wc_index_prefix(&index, prefix, strlen(prefix), &first);
+        for(size_t id = first; id < first + count; id++)
+            print_id(&index, id);
+    }
+
+    for(long i = 0; i < top && (uint64_t)i < index.header->nwords; i++)
+        print_id(&index, index.by_count[i]);
+
+    wc_index_close(&index);
+    return 0;
+}